@@ -0,0 +1,157 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+
+#include "alloc_trace.h"
+
+#ifdef ALLOC_TRACE
+
+namespace helpers {
+    namespace alloc_trace {
+        static const char *const tag_names[tag_count] = {"other", "parse", "distribute", "output_write", "flush"};
+
+        // Everything here is statically zero-initialized, so it is usable
+        // by allocations made before main(), and none of it allocates.
+        struct Counts {
+            std::uint64_t allocs[tag_count];
+            std::uint64_t bytes[tag_count];
+            std::uint64_t messages;
+            std::uint64_t copied;
+        };
+
+        static std::atomic<std::uint64_t> allocs[tag_count];
+        static std::atomic<std::uint64_t> bytes[tag_count];
+        static std::atomic<std::uint64_t> messages;
+        static std::atomic<std::uint64_t> copied;
+        static thread_local Tag current = Tag::OTHER;
+
+        // counts at the last reset() and the last interim report
+        static Counts at_reset;
+        static Counts at_report;
+
+        static void *allocate(std::size_t size) {
+            std::size_t tag = (std::size_t)current;
+            allocs[tag].fetch_add(1, std::memory_order_relaxed);
+            bytes[tag].fetch_add(size, std::memory_order_relaxed);
+            return std::malloc(size ? size : 1);
+        }
+
+        static Counts snapshot() {
+            Counts counts;
+            for (std::size_t i = 0; i < tag_count; ++i) {
+                counts.allocs[i] = allocs[i].load(std::memory_order_relaxed);
+                counts.bytes[i] = bytes[i].load(std::memory_order_relaxed);
+            }
+            counts.messages = messages.load(std::memory_order_relaxed);
+            counts.copied = copied.load(std::memory_order_relaxed);
+            return counts;
+        }
+
+        // the difference between two snapshots, as totals over all tags
+        static std::uint64_t total_allocs(const Counts &now, const Counts &then) {
+            std::uint64_t total = 0;
+            for (std::size_t i = 0; i < tag_count; ++i)
+                total += now.allocs[i] - then.allocs[i];
+            return total;
+        }
+
+        static double per_message(std::uint64_t count, std::uint64_t messages) { return messages ? (double)count / messages : 0.0; }
+
+        Scope::Scope(Tag tag) : previous(current) { current = tag; }
+
+        Scope::~Scope() { current = previous; }
+
+        void note_messages(std::size_t count) { messages.fetch_add(count, std::memory_order_relaxed); }
+
+        void note_copied(std::size_t count) { copied.fetch_add(count, std::memory_order_relaxed); }
+
+        void reset() { at_reset = at_report = snapshot(); }
+
+        void report(std::ostream &os, bool totals) {
+            Counts now = snapshot();
+            const Counts &then = (totals ? at_reset : at_report);
+            std::uint64_t count = now.messages - then.messages;
+
+            std::ios::fmtflags flags = os.flags();
+            std::streamsize precision = os.precision();
+            os << "alloc trace" << (totals ? " (total)" : "") << ": " << count << " messages, " << std::fixed << std::setprecision(3) << per_message(total_allocs(now, then), count) << " allocs/message, " << per_message(now.copied - then.copied, count) << " bytes copied/message;";
+            for (std::size_t i = 0; i < tag_count; ++i)
+                os << " " << tag_names[i] << " " << (now.allocs[i] - then.allocs[i]) << "/" << (now.bytes[i] - then.bytes[i]) << "B";
+            os << std::endl;
+            os.flags(flags);
+            os.precision(precision);
+
+            if (!totals)
+                at_report = now;
+        }
+
+        static bool check_ceiling(std::ostream &os, const char *variable, const char *what, double value) {
+            const char *limit = std::getenv(variable);
+            if (!limit || !*limit)
+                return true;
+
+            if (value <= std::strtod(limit, nullptr))
+                return true;
+
+            os << "alloc trace: " << value << " " << what << " per message exceeds " << variable << "=" << limit << std::endl;
+            return false;
+        }
+
+        bool within_ceiling(std::ostream &os) {
+            Counts now = snapshot();
+            std::uint64_t count = now.messages - at_reset.messages;
+
+            bool ok = check_ceiling(os, "ALLOC_TRACE_MAX_ALLOCS", "allocations", per_message(total_allocs(now, at_reset), count));
+            ok = check_ceiling(os, "ALLOC_TRACE_MAX_COPIED", "bytes copied", per_message(now.copied - at_reset.copied, count)) && ok;
+            return ok;
+        }
+    }; // namespace alloc_trace
+};     // namespace helpers
+
+void *operator new(std::size_t size) {
+    void *p = helpers::alloc_trace::allocate(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept { return helpers::alloc_trace::allocate(size); }
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept { return helpers::alloc_trace::allocate(size); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete[](void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
+
+#endif
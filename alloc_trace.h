@@ -0,0 +1,87 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef ALLOC_TRACE_H
+#define ALLOC_TRACE_H
+
+#include <cstddef>
+#include <ostream>
+
+namespace helpers {
+    // Accounting of heap allocations and copied bytes, for checking what
+    // the message paths actually cost. This is only compiled in with
+    // `make ALLOC_TRACE=1`, which also replaces the global operator new
+    // and delete; otherwise everything here does nothing.
+    //
+    // Allocations are attributed to whichever tag the allocating thread
+    // has in scope; the innermost Scope wins.
+    namespace alloc_trace {
+        enum class Tag { OTHER, PARSE, DISTRIBUTE, OUTPUT_WRITE, FLUSH };
+        static const std::size_t tag_count = 5;
+
+#ifdef ALLOC_TRACE
+        class Scope {
+          public:
+            explicit Scope(Tag tag);
+            ~Scope();
+
+            Scope(const Scope &) = delete;
+            Scope &operator=(const Scope &) = delete;
+
+          private:
+            Tag previous;
+        };
+
+        // count messages received, and bytes copied on their way out
+        void note_messages(std::size_t count);
+        void note_copied(std::size_t bytes);
+
+        // start counting afresh, e.g. once setup is done
+        void reset();
+
+        // write per-message figures and per-tag counts, either since the
+        // last interim report or (with totals) since the last reset()
+        void report(std::ostream &os, bool totals);
+
+        // checks the figures since the last reset() against the ceilings
+        // in $ALLOC_TRACE_MAX_ALLOCS and $ALLOC_TRACE_MAX_COPIED (per
+        // message); returns false, having said why, if either is exceeded
+        bool within_ceiling(std::ostream &os);
+#else
+        class Scope {
+          public:
+            explicit Scope(Tag) {}
+        };
+
+        inline void note_messages(std::size_t) {}
+        inline void note_copied(std::size_t) {}
+        inline void reset() {}
+        inline void report(std::ostream &, bool) {}
+        inline bool within_ceiling(std::ostream &) { return true; }
+#endif
+    }; // namespace alloc_trace
+};     // namespace helpers
+
+#endif
@@ -0,0 +1,113 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+
+#include "beast_backlog.h"
+
+namespace beast {
+    static std::mutex current_mutex;
+    static Backlog::pointer current_backlog;
+
+    Backlog::pointer Backlog::current() {
+        std::lock_guard<std::mutex> lock(current_mutex);
+        return current_backlog;
+    }
+
+    void Backlog::set_current(pointer backlog) {
+        std::lock_guard<std::mutex> lock(current_mutex);
+        current_backlog = backlog;
+    }
+
+    Backlog::Backlog(modes::FilterDistributor &distributor_, const modes::Filter &filter_, std::chrono::milliseconds window_, std::size_t capacity) : distributor(distributor_), handle(0), filter(filter_), window(window_), ring(helpers::round_up_pow2(capacity)), written(0) {}
+
+    void Backlog::start() {
+        auto self(shared_from_this());
+        handle = distributor.add_batch_client(std::bind(&Backlog::write_batch, self, std::placeholders::_1), filter);
+    }
+
+    void Backlog::close() { distributor.remove_client(handle); }
+
+    void Backlog::write_batch(const modes::FilterDistributor::MessageRefs &messages) {
+        // This is on the broadcast path, so it only copies into
+        // preallocated records.
+        auto now = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        const std::size_t mask = ring.size() - 1;
+        for (auto message : messages) {
+            record &r = ring[written++ & mask];
+            r.received = now;
+            r.serial = message->serial();
+            r.timestamp = message->timestamp();
+            r.type = message->type();
+            r.timestamp_type = message->timestamp_type();
+            r.signal = message->signal();
+            r.length = (std::uint8_t)message->data().size();
+            std::copy(message->data().begin(), message->data().end(), r.data.begin());
+        }
+    }
+
+    std::uint64_t Backlog::snapshot(const modes::Filter &output_filter, modes::MessageBatch &out) {
+        auto cutoff = std::chrono::steady_clock::now() - window;
+
+        // Copy the records out and build messages from them after
+        // releasing the lock, so that we hold up the broadcast for as
+        // little time as possible.
+        std::vector<record> copied;
+        std::uint64_t through;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (written == 0)
+                return 0;
+
+            const std::size_t mask = ring.size() - 1;
+            std::uint64_t oldest = (written > ring.size() ? written - ring.size() : 0);
+
+            // records are in arrival order, so binary search for the
+            // first one inside the window
+            std::uint64_t first = oldest, last = written;
+            while (first < last) {
+                std::uint64_t mid = first + (last - first) / 2;
+                if (ring[mid & mask].received < cutoff)
+                    first = mid + 1;
+                else
+                    last = mid;
+            }
+
+            copied.reserve(written - first);
+            for (std::uint64_t i = first; i < written; ++i)
+                copied.push_back(ring[i & mask]);
+            through = ring[(written - 1) & mask].serial;
+        }
+
+        for (const auto &r : copied) {
+            modes::Message message(r.type, r.timestamp_type, r.timestamp, r.signal, helpers::bytespan(r.data.data(), r.length), r.serial);
+            if (output_filter(message))
+                out.push_back(message);
+        }
+
+        return through;
+    }
+}; // namespace beast
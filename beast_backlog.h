@@ -0,0 +1,110 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BEAST_BACKLOG_H
+#define BEAST_BACKLOG_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "modes_filter.h"
+#include "modes_message.h"
+
+namespace beast {
+    // Keeps the last few seconds of messages, so that a client that
+    // has just connected (with backlog=on) can be sent some recent
+    // history before live data. Trackers and MLAT clients otherwise
+    // start cold after every reconnect.
+    //
+    // The ring holds a fixed number of messages, which bounds the
+    // memory used whatever the message rate; messages older than the
+    // window are not sent even if they are still in the ring.
+    //
+    // Messages are recorded as they are broadcast, with a fixed
+    // filter (the combination of the initial settings of every output
+    // that uses the backlog), so a client only gets backlog for the
+    // messages that filter lets through.
+    //
+    // Each output that wants the backlog takes a snapshot of it once,
+    // and afterwards drops any live message that was in the snapshot,
+    // so there is neither a gap nor a repeat between the two.
+    class Backlog : public std::enable_shared_from_this<Backlog> {
+      public:
+        typedef std::shared_ptr<Backlog> pointer;
+
+        // factory method, this class must always be constructed via make_shared
+        static pointer create(modes::FilterDistributor &distributor, const modes::Filter &filter, std::chrono::milliseconds window, std::size_t capacity) { return pointer(new Backlog(distributor, filter, window, capacity)); }
+
+        // the backlog used by outputs with backlog=on, if there is one
+        static pointer current();
+        static void set_current(pointer backlog);
+
+        void start();
+        void close();
+
+        // Appends the messages within the window that pass filter to
+        // out, oldest first, and returns the serial of the last message
+        // recorded (whether or not it passed), or 0 if there is none.
+        std::uint64_t snapshot(const modes::Filter &filter, modes::MessageBatch &out);
+
+        // true if message was recorded by the time of a snapshot that
+        // returned through
+        bool recorded(const modes::Message &message, std::uint64_t through) const { return message.serial() != 0 && message.serial() <= through && filter(message); }
+
+      private:
+        Backlog(modes::FilterDistributor &distributor_, const modes::Filter &filter_, std::chrono::milliseconds window_, std::size_t capacity);
+
+        void write_batch(const modes::FilterDistributor::MessageRefs &messages);
+
+        // a recorded message, without the derived CRC state that
+        // modes::Message carries
+        struct record {
+            std::chrono::steady_clock::time_point received;
+            std::uint64_t serial;
+            std::uint64_t timestamp;
+            modes::MessageType type;
+            modes::TimestampType timestamp_type;
+            std::uint8_t signal;
+            std::uint8_t length;
+            std::array<std::uint8_t, modes::max_payload_size> data;
+        };
+
+        modes::FilterDistributor &distributor;
+        modes::FilterDistributor::handle handle;
+        const modes::Filter filter;
+        const std::chrono::milliseconds window;
+
+        std::mutex mutex;
+        std::vector<record> ring; // power-of-two size
+        std::uint64_t written;    // total messages ever recorded
+    };
+}; // namespace beast
+
+#endif
@@ -0,0 +1,291 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "beast_encode.h"
+
+#include <array>
+#include <cstring>
+
+#include <boost/preprocessor/repetition/enum.hpp>
+
+namespace beast {
+    namespace encode {
+        namespace {
+            // two hex characters for every byte value, built at compile time
+            struct hexpair {
+                char hi;
+                char lo;
+            };
+
+#define HEXPAIR(Z, N, _) {"0123456789ABCDEF"[(N) >> 4], "0123456789ABCDEF"[(N)&15]}
+            const hexpair hex_table[256] = {BOOST_PP_ENUM(256, HEXPAIR, _)};
+#undef HEXPAIR
+
+            inline std::uint8_t *put_hex(std::uint8_t *out, std::uint8_t b) {
+                out[0] = (std::uint8_t)hex_table[b].hi;
+                out[1] = (std::uint8_t)hex_table[b].lo;
+                return out + 2;
+            }
+
+            inline std::uint8_t *put_escaped(std::uint8_t *out, std::uint8_t b) {
+                *out++ = b;
+                if (b == 0x1A)
+                    *out++ = 0x1A;
+                return out;
+            }
+        }; // namespace
+
+        std::uint8_t *escape(std::uint8_t *out, helpers::bytespan data) {
+            // 0x1A is rare in real data, so copy the runs between them in bulk
+            const std::uint8_t *p = data.begin();
+            const std::uint8_t *end = data.end();
+            while (p < end) {
+                const std::uint8_t *next = helpers::find_1a(p, end);
+                std::memcpy(out, p, next - p);
+                out += next - p;
+                if (next == end)
+                    break;
+
+                *out++ = 0x1A;
+                *out++ = 0x1A;
+                p = next + 1;
+            }
+
+            return out;
+        }
+
+        std::uint8_t *hex(std::uint8_t *out, helpers::bytespan data) {
+            for (auto b : data)
+                out = put_hex(out, b);
+            return out;
+        }
+
+        std::uint8_t *binary(std::uint8_t *out, modes::MessageType type, std::uint64_t timestamp, std::uint8_t signal, helpers::bytespan data) {
+            *out++ = 0x1A;
+            *out++ = messagetype_to_byte(type);
+
+            if (type != modes::MessageType::POSITION) {
+                // position messages have no metadata
+                out = put_escaped(out, (timestamp >> 40) & 0xFF);
+                out = put_escaped(out, (timestamp >> 32) & 0xFF);
+                out = put_escaped(out, (timestamp >> 24) & 0xFF);
+                out = put_escaped(out, (timestamp >> 16) & 0xFF);
+                out = put_escaped(out, (timestamp >> 8) & 0xFF);
+                out = put_escaped(out, timestamp & 0xFF);
+                out = put_escaped(out, signal);
+            }
+
+            return escape(out, data);
+        }
+
+        std::uint8_t *prefixed(std::uint8_t *out, modes::MessageType type, std::uint64_t timestamp, std::uint8_t signal, helpers::bytespan data) {
+            out[0] = messagetype_to_record_byte(type);
+            out[1] = (std::uint8_t)data.size();
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            std::memcpy(out + 2, reinterpret_cast<const std::uint8_t *>(&timestamp) + 2, 6);
+#else
+            std::memcpy(out + 2, &timestamp, 6);
+#endif
+            out[8] = signal;
+            std::memcpy(out + prefixed_header_size, data.data(), data.size());
+            return out + prefixed_header_size + data.size();
+        }
+
+        std::uint8_t *batch_header(std::uint8_t *out, std::uint32_t count) {
+            out[0] = 0x1A;
+            out[1] = (std::uint8_t)'L';
+            out[2] = 0;
+            out[3] = 0;
+            std::memcpy(out + 4, &count, 4);
+            return out + batch_header_size;
+        }
+
+        namespace {
+            inline std::uint8_t *link_header(std::uint8_t *out, std::uint8_t type, std::uint8_t flags, std::uint32_t count, std::uint64_t value) {
+                out[0] = 0x1A;
+                out[1] = type;
+                out[2] = flags;
+                out[3] = 0;
+                std::memcpy(out + 4, &count, 4);
+                std::memcpy(out + 8, &value, 8);
+                return out + link_header_size;
+            }
+        }; // namespace
+
+        std::uint8_t *link_batch_header(std::uint8_t *out, std::uint32_t count, std::uint64_t last_serial) { return link_header(out, (std::uint8_t)'S', 0, count, last_serial); }
+
+        std::uint8_t *link_hello(std::uint8_t *out, std::uint8_t flags, std::uint32_t replayed, std::uint64_t epoch) { return link_header(out, (std::uint8_t)'H', flags, replayed, epoch); }
+
+        std::uint8_t *link_resume(std::uint8_t *out, std::uint64_t epoch, std::uint64_t last_serial) {
+            out[0] = 0x1A;
+            out[1] = (std::uint8_t)'S';
+            std::memcpy(out + 2, &epoch, 8);
+            std::memcpy(out + 10, &last_serial, 8);
+            return out + link_resume_size;
+        }
+
+        std::uint8_t *avr(std::uint8_t *out, helpers::bytespan data) {
+            *out++ = (std::uint8_t)'*';
+            out = hex(out, data);
+            *out++ = (std::uint8_t)';';
+            *out++ = (std::uint8_t)'\n';
+            return out;
+        }
+
+        std::uint8_t *avrmlat(std::uint8_t *out, std::uint64_t timestamp, helpers::bytespan data) {
+            *out++ = (std::uint8_t)'@';
+            out = put_hex(out, (timestamp >> 40) & 0xFF);
+            out = put_hex(out, (timestamp >> 32) & 0xFF);
+            out = put_hex(out, (timestamp >> 24) & 0xFF);
+            out = put_hex(out, (timestamp >> 16) & 0xFF);
+            out = put_hex(out, (timestamp >> 8) & 0xFF);
+            out = put_hex(out, timestamp & 0xFF);
+            out = hex(out, data);
+            *out++ = (std::uint8_t)';';
+            *out++ = (std::uint8_t)'\n';
+            return out;
+        }
+
+        TimestampConversion timestamp_conversion(const Settings &settings, modes::TimestampType timestamp_type) {
+            if (timestamp_type == modes::TimestampType::TWELVEMEG && !settings.radarcape.off() && settings.gps_timestamps.on()) {
+                // GPS timestamps were explicitly requested
+                return TimestampConversion::TO_GPS;
+            } else if (timestamp_type == modes::TimestampType::GPS && (settings.radarcape.off() || settings.gps_timestamps.off())) {
+                // beast output or 12MHz timestamps were explicitly requested
+                return TimestampConversion::TO_TWELVEMEG;
+            } else {
+                // if gps_timestamps is DONTCARE, we just use whatever is provided
+                return TimestampConversion::NONE;
+            }
+        }
+
+        bool representable(const Settings &settings, const modes::Message &message) { return settings.binary_format || settings.length_prefixed || (message.type() != modes::MessageType::STATUS && message.type() != modes::MessageType::POSITION); }
+
+        namespace {
+            // the details of how a particular message is encoded for a
+            // particular client
+            struct plan {
+                plan(const Settings &settings, const modes::Message &message) : emulate_gps(false), needs_fec(false) {
+                    if (message.type() == modes::MessageType::STATUS) {
+                        // local connection settings override the upstream data
+                        Settings upstream = Settings(message.data()[0]);
+                        used = settings | upstream;
+
+                        // are we translating 12MHz to "GPS"?
+                        emulate_gps = (settings.gps_timestamps.on() && !upstream.gps_timestamps.on());
+                    } else {
+                        // apply FEC if requested
+                        needs_fec = (!settings.verbatim && !settings.fec_disable && message.crc_correctable());
+                    }
+                }
+
+                Settings used;
+                bool emulate_gps;
+                bool needs_fec;
+            };
+        }; // namespace
+
+        std::uint32_t variant(const Settings &settings, const modes::Message &message) {
+            // bits 0-1: output format (binary, AVR-mlat, AVR, length-prefixed)
+            // bits 2-3: timestamp conversion
+            // bit 4:    FEC applied
+            // bit 5:    status message
+            // bit 6:    emulated GPS timestamp flags (status only)
+            // bits 8-15: rewritten status byte (status only)
+            plan p(settings, message);
+
+            std::uint32_t v = (settings.length_prefixed ? 3 : settings.binary_format ? 0 : settings.avrmlat ? 1 : 2);
+            v |= (std::uint32_t)timestamp_conversion(settings, message.timestamp_type()) << 2;
+            if (message.type() == modes::MessageType::STATUS)
+                v |= 0x20 | (p.emulate_gps ? 0x40 : 0) | ((std::uint32_t)p.used.to_status_byte() << 8);
+            else
+                v |= (p.needs_fec ? 0x10 : 0);
+            return v;
+        }
+
+        bool passthrough(const Settings &settings, const modes::Message &message) {
+            if (!settings.binary_format || settings.length_prefixed || message.type() == modes::MessageType::STATUS || message.type() == modes::MessageType::POSITION)
+                return false;
+            if (timestamp_conversion(settings, message.timestamp_type()) != TimestampConversion::NONE)
+                return false;
+            return !plan(settings, message).needs_fec;
+        }
+
+        std::uint8_t *message(std::uint8_t *out, const Settings &settings, const modes::Message &message) {
+            if (!representable(settings, message))
+                return out;
+
+            plan p(settings, message);
+
+            std::uint64_t timestamp = message.timestamp();
+            switch (timestamp_conversion(settings, message.timestamp_type())) {
+            case TimestampConversion::TO_GPS: {
+                // scale 12MHz to pseudo-GPS
+                std::uint64_t ns = timestamp * 1000ULL / 12ULL;
+                std::uint64_t seconds = (ns / 1000000000ULL) % 86400;
+                std::uint64_t nanos = ns % 1000000000ULL;
+                timestamp = (seconds << 30) | nanos;
+            } break;
+
+            case TimestampConversion::TO_TWELVEMEG: {
+                // scale GPS to 12MHz
+                std::uint64_t seconds = timestamp >> 30;
+                std::uint64_t nanos = timestamp & 0x3FFFFFFF;
+                std::uint64_t ns = seconds * 1000000000ULL + nanos;
+                timestamp = ns * 12ULL / 1000ULL;
+            } break;
+
+            case TimestampConversion::NONE:
+                break;
+            }
+
+            std::array<std::uint8_t, modes::max_payload_size> copy;
+            helpers::bytespan data;
+            if (message.type() == modes::MessageType::STATUS) {
+                auto original = message.data();
+                std::copy(original.begin(), original.end(), copy.begin());
+                copy[0] = p.used.to_status_byte();
+
+                if (p.emulate_gps) {
+                    // set the emulation flag
+                    copy[2] |= 0x80; // set UTC-bugfix-and-more-bits flag
+                    copy[2] |= 0x20; // set emulated-timestamp flag
+                }
+
+                data = helpers::bytespan(copy.data(), original.size());
+            } else {
+                data = (p.needs_fec ? message.corrected_data() : message.data());
+            }
+
+            if (settings.length_prefixed)
+                return prefixed(out, message.type(), timestamp, message.signal(), data);
+            else if (settings.binary_format)
+                return binary(out, message.type(), timestamp, message.signal(), data);
+            else if (settings.avrmlat)
+                return avrmlat(out, timestamp, data);
+            else
+                return avr(out, data);
+        }
+    }; // namespace encode
+};     // namespace beast
@@ -0,0 +1,167 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BEAST_ENCODE_H
+#define BEAST_ENCODE_H
+
+#include <cstdint>
+
+#include "beast_settings.h"
+#include "helpers.h"
+#include "modes_message.h"
+
+namespace beast {
+    inline std::uint8_t messagetype_to_byte(modes::MessageType t) {
+        switch (t) {
+        case modes::MessageType::MODE_AC:
+            return 0x31;
+        case modes::MessageType::MODE_S_SHORT:
+            return 0x32;
+        case modes::MessageType::MODE_S_LONG:
+            return 0x33;
+        case modes::MessageType::STATUS:
+            return 0x34;
+        default:
+            return 0;
+        }
+    }
+
+    // As messagetype_to_byte, for the formats we defined ourselves (the
+    // length-prefixed format and the shared-memory ring). These carry
+    // position messages as 0x35, as the receiver does; Beast binary
+    // output has always sent them with a type of 0.
+    inline std::uint8_t messagetype_to_record_byte(modes::MessageType t) { return (t == modes::MessageType::POSITION ? 0x35 : messagetype_to_byte(t)); }
+
+    // Low-level encoders for the output formats we generate. These all
+    // write into a caller-supplied buffer that must have room for the
+    // worst case (see the max_*_size functions), and return a pointer
+    // just past the last byte written. They know nothing about sockets
+    // or settings, so any output sink can use them.
+    namespace encode {
+        // worst case size of a Beast binary frame with the given payload
+        // length (every byte after the leading 0x1A might need escaping)
+        inline std::size_t max_binary_size(std::size_t payload_size) { return 2 + 2 * (7 + payload_size); }
+
+        // worst case size of an AVR frame: *<hex>;\n
+        inline std::size_t max_avr_size(std::size_t payload_size) { return 1 + 2 * payload_size + 2; }
+
+        // worst case size of an AVR-mlat frame: @<timestamp hex><hex>;\n
+        inline std::size_t max_avrmlat_size(std::size_t payload_size) { return 1 + 12 + 2 * payload_size + 2; }
+
+        // Length-prefixed format (settings letter L): Beast binary without
+        // the escaping, so frames can be walked with pointer arithmetic.
+        // Each frame is a fixed header followed by the payload:
+        //
+        //   0     type byte, as in Beast binary ('1'..'5')
+        //   1     payload length
+        //   2-7   48-bit timestamp, host byte order (zero for position messages)
+        //   8     signal level (likewise)
+        //   9..   payload
+        //
+        // Frames are grouped into batches, each starting with a header:
+        //
+        //   0-1   0x1A 'L'
+        //   2-3   zero
+        //   4-7   number of frames that follow, host byte order
+        static const std::size_t prefixed_header_size = 9;
+        static const std::size_t batch_header_size = 8;
+
+        // The link protocol between beast-splitter instances (see
+        // beast_link.h) uses the same frames, but with 16-byte headers:
+        //
+        //   0-1   0x1A 'S' (a batch of frames) or 0x1A 'H' (hello)
+        //   2     flags (hello only, see LinkReplay)
+        //   3     zero
+        //   4-7   number of frames that follow, or for a hello, the
+        //         number of frames about to be replayed
+        //   8-15  serial of the last frame in the batch, or for a
+        //         hello, the sender's epoch
+        //
+        // The receiver asks to resume with 0x1A 'S' followed by the epoch
+        // and the last serial it received (8 bytes each, unescaped).
+        static const std::size_t link_header_size = 16;
+        static const std::size_t link_resume_size = 18;
+
+        inline std::size_t prefixed_size(std::size_t payload_size) { return prefixed_header_size + payload_size; }
+
+        // worst case size of any single encoded message
+        inline std::size_t max_frame_size() { return max_binary_size(modes::max_payload_size); }
+
+        // copy data, doubling any 0x1A bytes
+        std::uint8_t *escape(std::uint8_t *out, helpers::bytespan data);
+
+        // write data as uppercase hex, two characters per byte
+        std::uint8_t *hex(std::uint8_t *out, helpers::bytespan data);
+
+        // write a Beast binary frame; position frames have no timestamp or signal
+        std::uint8_t *binary(std::uint8_t *out, modes::MessageType type, std::uint64_t timestamp, std::uint8_t signal, helpers::bytespan data);
+
+        // write a length-prefixed frame
+        std::uint8_t *prefixed(std::uint8_t *out, modes::MessageType type, std::uint64_t timestamp, std::uint8_t signal, helpers::bytespan data);
+
+        // write a length-prefixed batch header; this can be called again
+        // on the same header to update the count
+        std::uint8_t *batch_header(std::uint8_t *out, std::uint32_t count);
+
+        // write link protocol headers and commands
+        std::uint8_t *link_batch_header(std::uint8_t *out, std::uint32_t count, std::uint64_t last_serial);
+        std::uint8_t *link_hello(std::uint8_t *out, std::uint8_t flags, std::uint32_t replayed, std::uint64_t epoch);
+        std::uint8_t *link_resume(std::uint8_t *out, std::uint64_t epoch, std::uint64_t last_serial);
+
+        // write an AVR frame (no timestamp)
+        std::uint8_t *avr(std::uint8_t *out, helpers::bytespan data);
+
+        // write an AVR-mlat frame (48-bit timestamp)
+        std::uint8_t *avrmlat(std::uint8_t *out, std::uint64_t timestamp, helpers::bytespan data);
+
+        // how timestamps of a given type are translated for a client with given settings
+        enum class TimestampConversion { NONE, TO_GPS, TO_TWELVEMEG };
+        TimestampConversion timestamp_conversion(const Settings &settings, modes::TimestampType timestamp_type);
+
+        // false if the message has no representation in the output format
+        // selected by settings (e.g. status messages in AVR format)
+        bool representable(const Settings &settings, const modes::Message &message);
+
+        // A key identifying exactly which encoding of a message a client
+        // with the given settings gets. Clients that get the same variant
+        // of a message get exactly the same bytes.
+        std::uint32_t variant(const Settings &settings, const modes::Message &message);
+
+        // true if message() would write exactly the frame that was
+        // received upstream, so the received bytes (message.raw()) can
+        // be copied instead: Beast binary, with no FEC, timestamp
+        // translation or status byte rewriting to do, and not a position
+        // message (see messagetype_to_record_byte)
+        bool passthrough(const Settings &settings, const modes::Message &message);
+
+        // Encode a message as a client with the given settings wants it,
+        // applying FEC, timestamp translation and status byte rewriting.
+        // Writes nothing if the message is not representable.
+        std::uint8_t *message(std::uint8_t *out, const Settings &settings, const modes::Message &message);
+    }; // namespace encode
+};     // namespace beast
+
+#endif
@@ -25,9 +25,11 @@
 
 #include <algorithm>
 #include <boost/asio.hpp>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 
+#include "alloc_trace.h"
 #include "beast_input.h"
 #include "modes_message.h"
 
@@ -35,7 +37,7 @@ using namespace beast;
 
 enum class BeastInput::ParserState { RESYNC, READ_1A, READ_TYPE, READ_DATA, READ_ESCAPED_1A };
 
-BeastInput::BeastInput(boost::asio::io_service &service_, const Settings &fixed_settings_, const modes::Filter &filter_) : receiver_type(ReceiverType::UNKNOWN), fixed_settings(fixed_settings_), filter(filter_), receiving_gps_timestamps(false), autodetect_timer(service_), reconnect_timer(service_), liveness_timer(service_), good_sync(false), good_messages_count(0), bad_bytes_count(0), first_message(true), state(ParserState::RESYNC) {}
+BeastInput::BeastInput(boost::asio::io_service &service_, const Settings &fixed_settings_, const modes::Filter &filter_) : strand(service_), frame_start(nullptr), next_serial(1), receiver_type(ReceiverType::UNKNOWN), fixed_settings(fixed_settings_), filter(filter_), receiving_gps_timestamps(false), autodetect_timer(service_), reconnect_timer(service_), liveness_timer(service_), good_sync(false), good_messages_count(0), bad_bytes_count(0), first_message(true), framelen(0), state(ParserState::RESYNC) {}
 
 void BeastInput::start() { try_to_connect(); }
 
@@ -63,17 +65,22 @@ void BeastInput::connection_established() {
     else {
         receiver_type = ReceiverType::UNKNOWN;
         autodetect_timer.expires_from_now(radarcape_detect_interval);
-        autodetect_timer.async_wait([this, self](const boost::system::error_code &ec) {
+        autodetect_timer.async_wait(strand.wrap([this, self](const boost::system::error_code &ec) {
             if (!ec) {
                 receiver_type = ReceiverType::BEAST;
                 send_settings_message();
             }
-        });
+        }));
     }
 
     send_settings_message();
 }
 
+void BeastInput::assume_receiver(ReceiverType type) {
+    autodetect_timer.cancel();
+    receiver_type = type;
+}
+
 void BeastInput::connection_failed() {
     good_sync = false;
     autodetect_timer.cancel();
@@ -81,11 +88,11 @@ void BeastInput::connection_failed() {
     // schedule reconnect.
     auto self(shared_from_this());
     reconnect_timer.expires_from_now(reconnect_interval);
-    reconnect_timer.async_wait([this, self](const boost::system::error_code &ec) {
+    reconnect_timer.async_wait(strand.wrap([this, self](const boost::system::error_code &ec) {
         if (!ec) {
             try_to_connect();
         }
-    });
+    }));
 }
 
 void BeastInput::send_settings_message() {
@@ -112,50 +119,108 @@ void BeastInput::send_settings_message() {
 }
 
 void BeastInput::set_filter(const modes::Filter &newfilter) {
-    if (filter != newfilter) {
-        filter = newfilter;
-        send_settings_message();
-    }
+    // this is called as clients come and go, which may be on any thread
+    auto self(shared_from_this());
+    strand.dispatch([this, self, newfilter] {
+        if (filter != newfilter) {
+            filter = newfilter;
+            send_settings_message();
+        }
+    });
+}
+
+// Try to deframe one complete message starting at p, which should point
+// at the leading 1A. This handles the common case where the whole frame is
+// in the current buffer and contains no escaped 1A bytes: that can be
+// checked with a single scan and copied in one go.
+//
+// Returns a pointer just past the frame on success, or nullptr if the frame
+// needs to go through the byte-at-a-time FSM in parse_input instead.
+const std::uint8_t *BeastInput::parse_frame_fast(const std::uint8_t *p, const std::uint8_t *end) {
+    if (end - p < 2 || p[0] != 0x1A)
+        return nullptr;
+
+    modes::MessageType type = messagetype_from_byte(p[1]);
+    if (type == modes::MessageType::INVALID)
+        return nullptr;
+
+    const std::uint8_t *body = p + 2;
+    std::size_t len = 7 + modes::message_size(type);
+    if ((std::size_t)(end - body) < len)
+        return nullptr; // split across reads
+
+    if (helpers::find_1a(body, body + len) != body + len)
+        return nullptr; // needs unescaping
+
+    messagetype = type;
+    std::memcpy(framedata.data(), body, len);
+    framelen = len;
+    return body + len;
 }
 
 void BeastInput::parse_input(const helpers::bytebuf &buf) {
-    auto p = buf.begin();
-    auto last_good_message_end = p;
+    helpers::alloc_trace::Scope trace(helpers::alloc_trace::Tag::PARSE);
+    const std::uint8_t *p = buf.data();
+    const std::uint8_t *end = p + buf.size();
+    const std::uint8_t *last_good_message_end = p;
+
+    batch.clear();
+    batch_raw.clear();
+
+    // a frame already in progress started in an earlier buffer
+    frame_start = nullptr;
 
-    while (p != buf.end()) {
+    while (p != end) {
         switch (state) {
-        case ParserState::RESYNC:
+        case ParserState::RESYNC: {
             // Scanning for <not-1A> <1A> <typebyte> <data...>
-            for (; p != buf.end(); ++p) {
-                if (*p != 0x1A) {
-                    auto q = p + 1;
-                    if (q == buf.end()) {
-                        // can't decide yet
+            // Find each 1A in turn and look at the byte before it.
+            const std::uint8_t *q = p + 1;
+            for (;;) {
+                q = helpers::find_1a(q, end);
+                if (q == end) {
+                    // If the final byte is not a 1A, it might be
+                    // the start of a <not-1A> <1A> pair; we
+                    // can't decide yet.
+                    if (end[-1] != 0x1A)
                         state = ParserState::READ_1A;
-                        p = q;
-                        break;
-                    }
-
-                    if (*q == 0x1A) {
-                        state = ParserState::READ_TYPE;
-                        p = q + 1;
-                        break;
-                    }
+                    p = end;
+                    break;
                 }
-            }
 
-            break;
+                if (q[-1] != 0x1A) {
+                    frame_start = q;
+                    state = ParserState::READ_TYPE;
+                    p = q + 1;
+                    break;
+                }
+
+                ++q;
+            }
+        } break;
 
-        case ParserState::READ_1A:
+        case ParserState::READ_1A: {
             // Expecting <1A> <typebyte> <data...>
+            // Consume as many complete, unescaped frames as possible first.
+            const std::uint8_t *next;
+            while ((next = parse_frame_fast(p, end)) != nullptr) {
+                saw_good_message();
+                dispatch_message(helpers::bytespan(p, next - p));
+                p = last_good_message_end = next;
+            }
+
+            if (p == end)
+                break;
+
             if (*p == 0x1A) {
+                frame_start = p;
                 state = ParserState::READ_TYPE;
                 ++p;
             } else {
                 lost_sync();
                 break;
             }
-            break;
+        } break;
 
         case ParserState::READ_TYPE:
             // Expecting <typebyte> <data...>
@@ -164,8 +229,7 @@ void BeastInput::parse_input(const helpers::bytebuf &buf) {
                 lost_sync();
                 break;
             } else {
-                metadata.clear();
-                messagedata.clear();
+                framelen = 0;
                 state = ParserState::READ_DATA;
                 ++p;
             }
@@ -173,37 +237,40 @@ void BeastInput::parse_input(const helpers::bytebuf &buf) {
             break;
 
         case ParserState::READ_DATA: {
-            // Reading message contents
-            std::size_t msglen = modes::message_size(messagetype);
-            while (p != buf.end() && messagedata.size() < msglen) {
-                uint8_t b = *p++;
-                if (b == 0x1A) {
-                    if (p == buf.end()) {
-                        // Can't handle it this time around.
-                        state = ParserState::READ_ESCAPED_1A;
-                        break;
-                    }
-
-                    if (*p != 0x1A) {
-                        lost_sync();
-                        break;
-                    }
-
-                    // valid 1A escape, consume it
-                    ++p;
+            // Reading message contents. We only get here for frames that
+            // contain escapes or that are split across reads.
+            std::size_t msglen = 7 + modes::message_size(messagetype);
+            while (p != end && framelen < msglen) {
+                // copy everything up to the next 1A in one go
+                const std::uint8_t *run_end = p + std::min<std::size_t>(msglen - framelen, end - p);
+                const std::uint8_t *escape = helpers::find_1a(p, run_end);
+                std::memcpy(&framedata[framelen], p, escape - p);
+                framelen += (escape - p);
+                p = escape;
+                if (p == run_end)
+                    continue;
+
+                ++p;
+                if (p == end) {
+                    // Can't handle it this time around.
+                    state = ParserState::READ_ESCAPED_1A;
+                    break;
+                }
+
+                if (*p != 0x1A) {
+                    lost_sync();
+                    break;
                 }
 
-                if (metadata.size() < 7)
-                    metadata.push_back(b);
-                else
-                    messagedata.push_back(b);
+                // valid 1A escape, consume it
+                framedata[framelen++] = *p++;
             }
 
-            if (messagedata.size() >= msglen) {
+            if (framelen >= msglen) {
                 // Done with this message.
                 saw_good_message();
                 last_good_message_end = p;
-                dispatch_message();
+                dispatch_message(frame_start ? helpers::bytespan(frame_start, p - frame_start) : helpers::bytespan());
                 state = ParserState::READ_1A;
             }
         } break;
@@ -221,12 +288,9 @@ void BeastInput::parse_input(const helpers::bytebuf &buf) {
             }
 
             // valid 1A escape
-            if (metadata.size() < 7)
-                metadata.push_back(*p++);
-            else
-                messagedata.push_back(*p++);
+            framedata[framelen++] = *p++;
 
-            if (messagedata.size() >= modes::message_size(messagetype)) {
+            if (framelen >= 7 + modes::message_size(messagetype)) {
                 saw_good_message();
                 last_good_message_end = p;
                 dispatch_message();
@@ -244,7 +308,53 @@ void BeastInput::parse_input(const helpers::bytebuf &buf) {
     }
 
     if (!good_sync) {
-        bad_bytes_count += (buf.end() - last_good_message_end);
+        bad_bytes_count += (end - last_good_message_end);
+    }
+
+    end_batch();
+}
+
+bool BeastInput::add_frame(modes::MessageType type, std::uint64_t timestamp, std::uint8_t signal, helpers::bytespan data) {
+    if (type == modes::MessageType::INVALID || data.size() != modes::payload_size(type))
+        return false;
+
+    // rebuild the deframed form that dispatch_message expects
+    messagetype = type;
+    if (type == modes::MessageType::POSITION) {
+        std::memcpy(framedata.data(), data.data(), data.size());
+        framelen = data.size();
+    } else {
+        for (int i = 0; i < 6; ++i)
+            framedata[i] = (std::uint8_t)(timestamp >> (40 - 8 * i));
+        framedata[6] = signal;
+        std::memcpy(framedata.data() + 7, data.data(), data.size());
+        framelen = 7 + data.size();
+    }
+
+    saw_good_message();
+    dispatch_message();
+    return true;
+}
+
+void BeastInput::end_batch() {
+    if (batch.empty())
+        return;
+
+    // counted here, where the messages are produced, rather than by each
+    // distributor that they pass through on their way out
+    helpers::alloc_trace::note_messages(batch.size());
+
+    // the batch is complete, so it won't move again; let consumers that
+    // want the frames as received copy them from the read buffer
+    for (std::size_t i = 0; i < batch.size(); ++i)
+        batch[i].set_raw(batch_raw[i]);
+
+    if (batch_notifier)
+        batch_notifier(batch);
+
+    if (message_notifier) {
+        for (const auto &message : batch)
+            message_notifier(message);
     }
 }
 
@@ -262,11 +372,11 @@ void BeastInput::lost_sync() {
     state = ParserState::RESYNC;
 }
 
-void BeastInput::dispatch_message() {
+void BeastInput::dispatch_message(helpers::bytespan raw) {
     // monitor status messages for GPS timestamp bit
     // and for radarcape autodetection
     if (messagetype == modes::MessageType::STATUS) {
-        receiving_gps_timestamps = Settings(messagedata[0]).gps_timestamps.on();
+        receiving_gps_timestamps = Settings(framedata[7]).gps_timestamps.on();
         if (receiver_type != ReceiverType::RADARCAPE) {
             receiver_type = ReceiverType::RADARCAPE;
             autodetect_timer.cancel();
@@ -275,13 +385,13 @@ void BeastInput::dispatch_message() {
 
         auto self(shared_from_this());
         liveness_timer.expires_from_now(radarcape_liveness_interval);
-        liveness_timer.async_wait([this, self](const boost::system::error_code &ec) {
+        liveness_timer.async_wait(strand.wrap([this, self](const boost::system::error_code &ec) {
             if (!ec) {
                 std::cerr << what() << ": no recent status messages received" << std::endl;
                 disconnect();
                 connection_failed();
             }
-        });
+        }));
     }
 
     if (!can_dispatch())
@@ -292,25 +402,27 @@ void BeastInput::dispatch_message() {
         std::cerr << what() << ": connected to a " << (receiver_type == ReceiverType::RADARCAPE ? "Radarcape" : "Beast") << "-style receiver" << std::endl;
     }
 
-    if (!message_notifier)
+    if (!message_notifier && !batch_notifier)
         return;
 
     // basic decoding, then pass it on.
     std::uint64_t timestamp = 0;
     std::uint8_t signal = 0;
+    const std::uint8_t *data_begin = framedata.data() + 7;
 
     if (messagetype == modes::MessageType::POSITION) {
         // position messages are special, they use the metadata area for actual data
-        // so glue the metadata bytes onto the start of the data bytes and don't decode
+        // so keep the metadata bytes on the start of the data bytes and don't decode
         // timestamp/signal
-        messagedata.insert(messagedata.begin(), metadata.cbegin(), metadata.cend());
+        data_begin = framedata.data();
     } else {
-        timestamp = ((std::uint64_t)metadata[0] << 40) | ((std::uint64_t)metadata[1] << 32) | ((std::uint64_t)metadata[2] << 24) | ((std::uint64_t)metadata[3] << 16) | ((std::uint64_t)metadata[4] << 8) | ((std::uint64_t)metadata[5]);
+        timestamp = ((std::uint64_t)framedata[0] << 40) | ((std::uint64_t)framedata[1] << 32) | ((std::uint64_t)framedata[2] << 24) | ((std::uint64_t)framedata[3] << 16) | ((std::uint64_t)framedata[4] << 8) | ((std::uint64_t)framedata[5]);
 
-        signal = metadata[6];
+        signal = framedata[6];
     }
 
-    // dispatch it
-    message_notifier(modes::Message(messagetype, receiving_gps_timestamps ? modes::TimestampType::GPS : modes::TimestampType::TWELVEMEG, timestamp, signal, std::move(messagedata)));
-    messagedata.clear(); // make sure we leave it in a valid state after moving
+    // queue it for dispatch at the end of this read
+    batch.emplace_back(messagetype, receiving_gps_timestamps ? modes::TimestampType::GPS : modes::TimestampType::TWELVEMEG, timestamp, signal, helpers::bytespan(data_begin, framedata.data() + framelen - data_begin), next_serial++);
+    helpers::alloc_trace::note_copied(framelen + (framedata.data() + framelen - data_begin)); // deframed, then into the message
+    batch_raw.push_back(raw);
 }
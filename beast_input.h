@@ -28,6 +28,7 @@
 #ifndef BEAST_INPUT_H
 #define BEAST_INPUT_H
 
+#include <array>
 #include <chrono>
 #include <cstdint>
 #include <memory>
@@ -36,6 +37,7 @@
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/serial_port.hpp>
 #include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
 
 #include "beast_settings.h"
 #include "helpers.h"
@@ -80,6 +82,9 @@ namespace beast {
         // message notifier type
         typedef std::function<void(const modes::Message &)> MessageNotifier;
 
+        // batch notifier type
+        typedef std::function<void(const modes::MessageBatch &)> BatchNotifier;
+
         void start(void);
         void close(void);
 
@@ -87,12 +92,19 @@ namespace beast {
 
         ReceiverType receiver(void) const { return receiver_type; }
 
-        // change the input filter to the given filter
+        // change the input filter to the given filter; safe to call from any thread
         void set_filter(const modes::Filter &filter_);
 
-        // change where received messages go to
+        // the strand that all of this input's work (including delivering
+        // messages to the notifiers) runs on
+        boost::asio::io_service::strand &get_strand() { return strand; }
+
+        // change where received messages go to, one message at a time
         void set_message_notifier(MessageNotifier notifier) { message_notifier = notifier; }
 
+        // change where received messages go to, as one batch per read
+        void set_batch_notifier(BatchNotifier notifier) { batch_notifier = notifier; }
+
       protected:
         // construct a new input instance
         BeastInput(boost::asio::io_service &service_, const Settings &fixed_settings_, const modes::Filter &filter_);
@@ -101,7 +113,22 @@ namespace beast {
 
         void connection_established();
         void connection_failed();
+
+        // for subclasses that know what is at the other end (e.g. another
+        // beast-splitter, over the link protocol): skip autodetection, so
+        // that messages are dispatched from the start of the connection
+        void assume_receiver(ReceiverType type);
         void parse_input(const helpers::bytebuf &buf);
+
+        // For subclasses that do their own framing: deliver messages
+        // as parse_input would, one batch at a time. add_frame returns
+        // false if the payload is the wrong size for the type.
+        void begin_batch() {
+            batch.clear();
+            batch_raw.clear();
+        }
+        bool add_frame(modes::MessageType type, std::uint64_t timestamp, std::uint8_t signal, helpers::bytespan data);
+        void end_batch();
         bool have_good_sync() const { return good_sync; }
         unsigned good_messages() const { return good_messages_count; }
         unsigned bad_bytes() const { return bad_bytes_count; }
@@ -115,13 +142,31 @@ namespace beast {
         virtual bool low_level_write(std::shared_ptr<helpers::bytebuf> message) = 0;
         virtual void apply_connection_settings(Settings &settings) {}
 
+        // subclasses must wrap all their handlers in this
+        boost::asio::io_service::strand strand;
+
       private:
         void send_settings_message(void);
         void lost_sync(void);
-        void dispatch_message(void);
+        void dispatch_message(helpers::bytespan raw = helpers::bytespan());
+        const std::uint8_t *parse_frame_fast(const std::uint8_t *p, const std::uint8_t *end);
 
-        // handler to call with deframed messages
+        // handlers to call with deframed messages
         MessageNotifier message_notifier;
+        BatchNotifier batch_notifier;
+
+        // messages deframed by the current parse_input call, and where
+        // each one's frame was in the read buffer (empty if the frame
+        // was not entirely within it)
+        modes::MessageBatch batch;
+        std::vector<helpers::bytespan> batch_raw;
+
+        // the leading 1A of the frame being deframed, if it is in the
+        // buffer currently being parsed
+        const std::uint8_t *frame_start;
+
+        // serial number to assign to the next deframed message
+        std::uint64_t next_serial;
 
         // the currently detected receiver type
         ReceiverType receiver_type;
@@ -159,10 +204,12 @@ namespace beast {
         // are we still waiting for the first good message?
         bool first_message;
 
-        // deframed message (possibly still being built)
+        // deframed message (possibly still being built);
+        // the first 7 bytes are the timestamp/signal metadata,
+        // the rest is the message data
         modes::MessageType messagetype;
-        helpers::bytebuf metadata;
-        helpers::bytebuf messagedata;
+        std::array<std::uint8_t, 7 + 14> framedata;
+        std::size_t framelen;
 
         // parser FSM state
         enum class ParserState;
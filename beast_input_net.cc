@@ -24,6 +24,7 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <algorithm>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 
@@ -31,13 +32,15 @@
 #include <boost/asio/ip/v6_only.hpp>
 #include <boost/asio/steady_timer.hpp>
 
+#include "beast_encode.h"
 #include "beast_input_net.h"
+#include "beast_link.h"
 #include "modes_message.h"
 
 using namespace beast;
 using boost::asio::ip::tcp;
 
-NetInput::NetInput(boost::asio::io_service &service_, const std::string &host_, const std::string &port_or_service_, const Settings &fixed_settings_, const modes::Filter &filter_) : BeastInput(service_, fixed_settings_, filter_), host(host_), port_or_service(port_or_service_), resolver(service_), socket(service_), reconnect_timer(service_), readbuf(std::make_shared<helpers::bytebuf>(read_buffer_size)), warned_about_framing(false) {}
+NetInput::NetInput(boost::asio::io_service &service_, const std::string &host_, const std::string &port_or_service_, const Settings &fixed_settings_, const modes::Filter &filter_) : BeastInput(service_, fixed_settings_, filter_), host(host_), port_or_service(port_or_service_), resolver(service_), socket(service_), reconnect_timer(service_), readbuf(std::make_shared<helpers::bytebuf>(read_buffer_size)), warned_about_framing(false), sniffing(false), link(false), link_epoch(0), link_serial(0) {}
 
 std::string NetInput::what() const { return std::string("net(") + host + std::string(":") + port_or_service + std::string(")"); }
 
@@ -45,7 +48,7 @@ void NetInput::try_to_connect(void) {
     auto self(shared_from_this());
 
     tcp::resolver::query query(host, port_or_service);
-    resolver.async_resolve(query, [this, self](const boost::system::error_code &ec, tcp::resolver::iterator it) {
+    resolver.async_resolve(query, strand.wrap([this, self](const boost::system::error_code &ec, tcp::resolver::iterator it) {
         if (!ec) {
             next_endpoint = it;
             try_next_endpoint();
@@ -56,7 +59,7 @@ void NetInput::try_to_connect(void) {
             connection_failed();
             return;
         }
-    });
+    }));
 }
 
 void NetInput::try_next_endpoint() {
@@ -69,7 +72,7 @@ void NetInput::try_next_endpoint() {
     tcp::endpoint endpoint = *next_endpoint++;
 
     auto self(shared_from_this());
-    socket.async_connect(endpoint, [this, self, endpoint](const boost::system::error_code &ec) {
+    socket.async_connect(endpoint, strand.wrap([this, self, endpoint](const boost::system::error_code &ec) {
         if (!ec) {
             connection_established(endpoint);
         } else if (ec == boost::asio::error::operation_aborted) {
@@ -79,7 +82,7 @@ void NetInput::try_next_endpoint() {
             socket.close();
             try_next_endpoint();
         }
-    });
+    }));
 }
 
 void NetInput::connection_established(const tcp::endpoint &endpoint) {
@@ -87,6 +90,19 @@ void NetInput::connection_established(const tcp::endpoint &endpoint) {
 
     BeastInput::connection_established();
     warned_about_framing = false;
+    sniffing = true;
+    sniffed.clear();
+    decompressor.reset();
+
+    if (link) {
+        // the peer is a beast-splitter, and everything it replays has
+        // to reach our clients, so don't wait for autodetection
+        assume_receiver(ReceiverType::BEAST);
+        link_pending.clear();
+        auto message = std::make_shared<helpers::bytebuf>(encode::link_resume_size);
+        encode::link_resume(message->data(), link_epoch, link_serial);
+        low_level_write(message);
+    }
     start_reading();
 }
 
@@ -102,10 +118,10 @@ bool NetInput::low_level_write(std::shared_ptr<helpers::bytebuf> message) {
         return false;
 
     auto self(shared_from_this());
-    boost::asio::async_write(socket, boost::asio::buffer(*message), [this, self, message](boost::system::error_code ec, std::size_t len) {
+    boost::asio::async_write(socket, boost::asio::buffer(*message), strand.wrap([this, self, message](boost::system::error_code ec, std::size_t len) {
         if (ec)
             handle_error(ec);
-    });
+    }));
     return true;
 }
 
@@ -131,6 +147,140 @@ void NetInput::check_framing_errors(void) {
     }
 }
 
+// Handles one read's worth of data from the socket, decompressing it if
+// needed. Returns false if the connection has failed.
+bool NetInput::receive(helpers::bytebuf &buf) {
+    helpers::bytebuf *input = &buf;
+
+    if (sniffing) {
+        sniffed.insert(sniffed.end(), buf.begin(), buf.end());
+
+        // wait for the whole header if this could be the start of one
+        if (sniffed.size() < compression::header_size && sniffed[0] == 0x1A && (sniffed.size() < 2 || sniffed[1] == 'Z'))
+            return true;
+
+        sniffing = false;
+        input = &sniffed;
+
+        Compression codec;
+        if (compression::is_header(sniffed, codec)) {
+            std::cerr << what() << ": receiving " << compression::name(codec) << " compressed data" << std::endl;
+            decompressor = Decompressor::create(codec);
+            sniffed.erase(sniffed.begin(), sniffed.begin() + compression::header_size);
+        }
+    }
+
+    if (decompressor) {
+        std::string error;
+        decompressed.clear();
+        if (!decompressor->decompress(*input, decompressed, error)) {
+            std::cerr << what() << ": bad compressed data: " << error << std::endl;
+            connection_failed();
+            disconnect();
+            return false;
+        }
+        input = &decompressed;
+    }
+
+    bool ok = true;
+    if (link) {
+        ok = receive_link(*input);
+    } else {
+        parse_input(*input);
+        check_framing_errors();
+    }
+
+    sniffed.clear();
+    return ok;
+}
+
+// Deframes link protocol data. Only complete batches are delivered, so
+// that link_serial always says exactly what we have received.
+bool NetInput::receive_link(const helpers::bytebuf &buf) {
+    link_pending.insert(link_pending.end(), buf.begin(), buf.end());
+
+    const std::uint8_t *start = link_pending.data();
+    const std::uint8_t *end = start + link_pending.size();
+    const std::uint8_t *p = start;
+    bool ok = true;
+
+    begin_batch();
+    while (ok && (std::size_t)(end - p) >= encode::link_header_size) {
+        std::uint32_t count;
+        std::uint64_t value;
+        std::memcpy(&count, p + 4, 4);
+        std::memcpy(&value, p + 8, 8);
+
+        if (p[0] != 0x1A || (p[1] != 'S' && p[1] != 'H')) {
+            ok = false;
+            break;
+        }
+
+        if (p[1] == 'H') {
+            link_hello(p[2], count, value);
+            p += encode::link_header_size;
+            continue;
+        }
+
+        // is the whole batch here yet?
+        const std::uint8_t *frame = p + encode::link_header_size;
+        std::uint32_t i;
+        for (i = 0; i < count; ++i) {
+            if ((std::size_t)(end - frame) < encode::prefixed_header_size || (std::size_t)(end - frame) < encode::prefixed_size(frame[1]))
+                break;
+            frame += encode::prefixed_size(frame[1]);
+        }
+        if (i < count)
+            break;
+
+        frame = p + encode::link_header_size;
+        for (i = 0; i < count; ++i) {
+            std::uint64_t timestamp = 0;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            std::memcpy(reinterpret_cast<std::uint8_t *>(&timestamp) + 2, frame + 2, 6);
+#else
+            std::memcpy(&timestamp, frame + 2, 6);
+#endif
+            if (!add_frame(messagetype_from_byte(frame[0]), timestamp, frame[8], helpers::bytespan(frame + encode::prefixed_header_size, frame[1]))) {
+                ok = false;
+                break;
+            }
+            frame += encode::prefixed_size(frame[1]);
+        }
+
+        if (ok) {
+            link_serial = value;
+            p = frame;
+        }
+    }
+    end_batch();
+
+    link_pending.erase(link_pending.begin(), link_pending.begin() + (p - start));
+
+    if (!ok) {
+        std::cerr << what() << ": link protocol error, is the peer a beast-splitter with link=on?" << std::endl;
+        connection_failed();
+        disconnect();
+    }
+
+    return ok;
+}
+
+void NetInput::link_hello(std::uint8_t flags, std::uint32_t replayed, std::uint64_t epoch) {
+    if (link_epoch != 0 && epoch != link_epoch) {
+        std::cerr << what() << ": peer has restarted, messages sent before the restart may have been lost" << std::endl;
+    } else if (flags & LinkReplay::HELLO_RESUMED) {
+        std::cerr << what() << ": resumed link after message " << link_serial << ", " << replayed << " messages replayed" << std::endl;
+        if (flags & LinkReplay::HELLO_GAP)
+            std::cerr << what() << ": some messages were lost, the peer's replay buffer was too small for this outage" << std::endl;
+    }
+
+    if (epoch != link_epoch) {
+        link_epoch = epoch;
+        link_serial = 0;
+    }
+}
+
 void NetInput::start_reading(const boost::system::error_code &ec) {
     if (ec) {
         assert(ec == boost::asio::error::operation_aborted);
@@ -147,17 +297,17 @@ void NetInput::start_reading(const boost::system::error_code &ec) {
         buf = std::make_shared<helpers::bytebuf>(read_buffer_size);
     }
 
-    socket.async_read_some(boost::asio::buffer(*buf), [this, self, buf](const boost::system::error_code &ec, std::size_t len) {
+    socket.async_read_some(boost::asio::buffer(*buf), strand.wrap(helpers::make_alloc_handler(read_memory, [this, self, buf](const boost::system::error_code &ec, std::size_t len) {
         if (ec) {
             readbuf = buf;
             handle_error(ec);
         } else {
             buf->resize(len);
-            parse_input(*buf);
-            check_framing_errors();
+            bool ok = receive(*buf);
             readbuf = buf;
 
-            start_reading();
+            if (ok)
+                start_reading();
         }
-    });
+    })));
 }
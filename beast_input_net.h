@@ -31,6 +31,8 @@
 #include <boost/asio/ip/tcp.hpp>
 
 #include "beast_input.h"
+#include "compression.h"
+#include "handler_memory.h"
 
 namespace beast {
     class NetInput : public BeastInput {
@@ -43,6 +45,10 @@ namespace beast {
         // factory method
         static pointer create(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, const Settings &fixed_settings = Settings(), const modes::Filter &filter = modes::Filter()) { return pointer(new NetInput(service, host, port_or_service, fixed_settings, filter)); }
 
+        // speak the link protocol to another beast-splitter (see
+        // beast_link.h), resuming where we left off after a reconnect
+        void set_link(bool link_) { link = link_; }
+
       protected:
         std::string what() const override;
         void try_to_connect(void) override;
@@ -59,6 +65,9 @@ namespace beast {
         void start_reading(const boost::system::error_code &ec = boost::system::error_code());
         void handle_error(const boost::system::error_code &ec);
         void check_framing_errors(void);
+        bool receive(helpers::bytebuf &buf);
+        bool receive_link(const helpers::bytebuf &buf);
+        void link_hello(std::uint8_t flags, std::uint32_t replayed, std::uint64_t epoch);
 
         std::string host;
         std::string port_or_service;
@@ -68,11 +77,30 @@ namespace beast {
         boost::asio::steady_timer reconnect_timer;
         boost::asio::ip::tcp::resolver::iterator next_endpoint;
 
-        // cached buffer used for reads
+        // cached buffer used for reads, and storage for the read handler
         std::shared_ptr<helpers::bytebuf> readbuf;
+        helpers::HandlerMemory read_memory;
 
         // have we warned about a possibly bad protocol?
         bool warned_about_framing;
+
+        // the start of the stream, held back until we know whether it
+        // is compressed (see compression.h)
+        bool sniffing;
+        helpers::bytebuf sniffed;
+
+        // set if the stream is compressed, with the decompressed output
+        // of the current read
+        Decompressor::pointer decompressor;
+        helpers::bytebuf decompressed;
+
+        // link protocol state: the sender's epoch and the serial of the
+        // last complete batch we received from it, which survive
+        // reconnections, and any partial batch
+        bool link;
+        std::uint64_t link_epoch;
+        std::uint64_t link_serial;
+        helpers::bytebuf link_pending;
     };
 }; // namespace beast
 
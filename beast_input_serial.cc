@@ -82,11 +82,11 @@ void SerialInput::try_to_connect(void) {
     if (autobaud_rates.size() > 1) {
         autobaud_timer.expires_from_now(autobaud_interval);
 
-        autobaud_timer.async_wait([this, self](const boost::system::error_code &ec) {
+        autobaud_timer.async_wait(strand.wrap([this, self](const boost::system::error_code &ec) {
             if (!ec) {
                 advance_autobaud();
             }
-        });
+        }));
     }
 
     connection_established();
@@ -107,10 +107,10 @@ bool SerialInput::low_level_write(std::shared_ptr<helpers::bytebuf> message) {
         return false;
 
     auto self(shared_from_this());
-    boost::asio::async_write(port, boost::asio::buffer(*message), [this, self, message](boost::system::error_code ec, std::size_t len) {
+    boost::asio::async_write(port, boost::asio::buffer(*message), strand.wrap([this, self, message](boost::system::error_code ec, std::size_t len) {
         if (ec)
             handle_error(ec);
-    });
+    }));
     return true;
 }
 
@@ -186,7 +186,7 @@ void SerialInput::start_reading(const boost::system::error_code &ec) {
     }
 
     read_timer.expires_from_now(read_interval);
-    port.async_read_some(boost::asio::buffer(*buf), [this, self, buf](const boost::system::error_code &ec, std::size_t len) {
+    port.async_read_some(boost::asio::buffer(*buf), strand.wrap(helpers::make_alloc_handler(read_memory, [this, self, buf](const boost::system::error_code &ec, std::size_t len) {
         if (ec) {
             readbuf = buf;
             handle_error(ec);
@@ -203,12 +203,12 @@ void SerialInput::start_reading(const boost::system::error_code &ec) {
             // little more data arrives, but at least we don't have to do a bunch of work on every one of
             // those)
             if (len < read_buffer_size * 3 / 4) {
-                read_timer.async_wait(std::bind(&SerialInput::start_reading, self, std::placeholders::_1));
+                read_timer.async_wait(strand.wrap(helpers::make_alloc_handler(read_timer_memory, std::bind(&SerialInput::start_reading, self, std::placeholders::_1))));
             } else {
                 start_reading();
             }
         }
-    });
+    })));
 }
 
 void SerialInput::saw_good_message() {
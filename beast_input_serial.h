@@ -31,6 +31,7 @@
 #include <boost/asio/serial_port.hpp>
 
 #include "beast_input.h"
+#include "handler_memory.h"
 
 namespace beast {
     class SerialInput : public BeastInput {
@@ -107,8 +108,11 @@ namespace beast {
         // timer that expires when we want to read some more data
         boost::asio::steady_timer read_timer;
 
-        // cached buffer used for reads
+        // cached buffer used for reads, and storage for the read and
+        // read_timer handlers
         std::shared_ptr<helpers::bytebuf> readbuf;
+        helpers::HandlerMemory read_memory;
+        helpers::HandlerMemory read_timer_memory;
 
         // have we warned about a possibly bad baud rate?
         bool warned_about_rate;
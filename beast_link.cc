@@ -0,0 +1,200 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+
+#include "beast_link.h"
+#include "beast_output.h"
+
+namespace beast {
+    static std::uint64_t random_epoch() {
+        std::random_device rd;
+        std::uint64_t epoch = 0;
+        while (epoch == 0)
+            epoch = ((std::uint64_t)rd() << 32) ^ rd();
+        return epoch;
+    }
+
+    LinkReplay::LinkReplay(modes::FilterDistributor &distributor_, const Settings &initial_settings, std::size_t capacity) : distributor(distributor_), handle(0), epoch(random_epoch()), filter(initial_settings.to_filter()), ring(helpers::round_up_pow2(capacity)), written(0), lost_serial(0), writing(false) {}
+
+    void LinkReplay::start() {
+        auto self(shared_from_this());
+        handle = distributor.add_batch_client(std::bind(&LinkReplay::write_batch, self, std::placeholders::_1), filter);
+    }
+
+    void LinkReplay::close() {
+        distributor.remove_client(handle);
+
+        std::vector<target> closing;
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            closing.swap(targets);
+        }
+
+        for (auto &t : closing)
+            t.output->close();
+    }
+
+    void LinkReplay::write_batch(const modes::FilterDistributor::MessageRefs &messages) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+
+        const std::size_t mask = ring.size() - 1;
+        for (auto message : messages) {
+            record &r = ring[written++ & mask];
+            if (r.serial != 0)
+                lost_serial = r.serial;
+
+            r.serial = message->serial();
+            r.timestamp = message->timestamp();
+            r.type = message->type();
+            r.timestamp_type = message->timestamp_type();
+            r.signal = message->signal();
+            r.length = (std::uint8_t)message->data().size();
+            std::copy(message->data().begin(), message->data().end(), r.data.begin());
+        }
+
+        // writing to an output may close it, which detaches it, or
+        // (via the recursive lock) attach another; so go by index, and
+        // leave removal until we are done
+        writing = true;
+        for (std::size_t i = 0; i < targets.size(); ++i) {
+            if (targets[i].deleted)
+                continue;
+
+            selected.clear();
+            for (auto message : messages) {
+                if (targets[i].filter(*message))
+                    selected.push_back(message);
+            }
+
+            if (!selected.empty()) {
+                auto output = targets[i].output;
+                output->write_batch(selected);
+            }
+        }
+        writing = false;
+
+        targets.erase(std::remove_if(targets.begin(), targets.end(), [](const target &t) { return t.deleted; }), targets.end());
+    }
+
+    void LinkReplay::attach(std::shared_ptr<SocketOutput> output, const modes::Filter &output_filter, std::uint64_t resume_epoch, std::uint64_t resume_serial) {
+        modes::Filter newfilter;
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+
+            std::uint8_t flags = 0;
+            modes::MessageBatch replay;
+            if (resume_epoch == epoch) {
+                flags |= HELLO_RESUMED;
+                if (lost_serial > resume_serial)
+                    flags |= HELLO_GAP;
+
+                const std::size_t mask = ring.size() - 1;
+                std::uint64_t oldest = (written > ring.size() ? written - ring.size() : 0);
+                for (std::uint64_t i = oldest; i < written; ++i) {
+                    const record &r = ring[i & mask];
+                    if (r.serial <= resume_serial)
+                        continue;
+
+                    modes::Message message(r.type, r.timestamp_type, r.timestamp, r.signal, helpers::bytespan(r.data.data(), r.length), r.serial);
+                    if (output_filter(message))
+                        replay.push_back(message);
+                }
+            } else if (resume_epoch != 0) {
+                // we have restarted since the receiver last saw us
+                flags |= HELLO_GAP;
+            }
+
+            // we are on the output's strand, so all of this is queued
+            // before any live messages, which can only arrive once we
+            // release the lock
+            output->write_link_hello(flags, (std::uint32_t)replay.size(), epoch);
+            if (!replay.empty()) {
+                modes::FilterDistributor::MessageRefs refs;
+                refs.reserve(replay.size());
+                for (const auto &message : replay)
+                    refs.push_back(&message);
+                output->write_batch(refs);
+            }
+
+            if (output->is_closed())
+                return; // the replay was too much for it
+
+            targets.push_back({output, output_filter, false});
+            newfilter = filter = combined_filter();
+        }
+
+        // not under our lock, as the distributor may be calling write_batch
+        distributor.update_client_filter(handle, newfilter);
+    }
+
+    void LinkReplay::update_filter(SocketOutput *output, const modes::Filter &output_filter) {
+        modes::Filter newfilter;
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            auto i = std::find_if(targets.begin(), targets.end(), [output](const target &t) { return t.output.get() == output && !t.deleted; });
+            if (i == targets.end())
+                return; // not attached yet, attach() will pick this up
+
+            i->filter = output_filter;
+            newfilter = filter = combined_filter();
+        }
+
+        distributor.update_client_filter(handle, newfilter);
+    }
+
+    void LinkReplay::detach(SocketOutput *output) {
+        // Leave the filter alone, so we keep recording what this
+        // output wanted until it comes back.
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        if (writing) {
+            // write_batch is iterating over targets, and will tidy up
+            for (auto &t : targets) {
+                if (t.output.get() == output)
+                    t.deleted = true;
+            }
+            return;
+        }
+
+        targets.erase(std::remove_if(targets.begin(), targets.end(), [output](const target &t) { return t.output.get() == output; }), targets.end());
+    }
+
+    modes::Filter LinkReplay::combined_filter() const {
+        bool first = true;
+        modes::Filter f = filter;
+        for (const auto &t : targets) {
+            if (t.deleted)
+                continue;
+
+            if (first)
+                f = t.filter;
+            else
+                f.inplace_combine(t.filter);
+            first = false;
+        }
+        return f;
+    }
+}; // namespace beast
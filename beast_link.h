@@ -0,0 +1,128 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BEAST_LINK_H
+#define BEAST_LINK_H
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "beast_settings.h"
+#include "modes_filter.h"
+#include "modes_message.h"
+
+namespace beast {
+    class SocketOutput;
+
+    // The sending side of the link protocol used between chained
+    // beast-splitter instances (--listen with link=on at one end, --net
+    // with :link at the other).
+    //
+    // Messages are sent as length-prefixed frames, in batches whose
+    // header carries the serial number of the last message in the
+    // batch (see beast_encode.h for the exact layout). The receiver
+    // remembers the last serial it received, and when it reconnects it
+    // asks to resume from there. We keep a ring of recent messages so
+    // that we can replay whatever it missed while it was away.
+    //
+    // Serials are only meaningful within one run of the sender, so each
+    // run picks a random epoch, which the receiver quotes back when it
+    // resumes.
+    //
+    // There is one of these per link listener. It stays registered with
+    // the distributor while no clients are connected, with the filter
+    // of the clients that were, so that the messages they will want are
+    // still recorded (and the upstream receiver stays configured for
+    // them) during an outage.
+    class LinkReplay : public std::enable_shared_from_this<LinkReplay> {
+      public:
+        typedef std::shared_ptr<LinkReplay> pointer;
+
+        // flags in the hello header
+        static const std::uint8_t HELLO_RESUMED = 0x01; // replaying from the requested serial
+        static const std::uint8_t HELLO_GAP = 0x02;     // some messages the receiver wanted are gone
+
+        // factory method, this class must always be constructed via make_shared
+        static pointer create(modes::FilterDistributor &distributor, const Settings &initial_settings, std::size_t capacity) { return pointer(new LinkReplay(distributor, initial_settings, capacity)); }
+
+        void start();
+        void close();
+
+        // Starts sending messages that match filter to output. First,
+        // on output's strand, sends a hello and replays everything
+        // after resume_serial if resume_epoch is ours.
+        void attach(std::shared_ptr<SocketOutput> output, const modes::Filter &filter, std::uint64_t resume_epoch, std::uint64_t resume_serial);
+        void update_filter(SocketOutput *output, const modes::Filter &filter);
+        void detach(SocketOutput *output);
+
+      private:
+        LinkReplay(modes::FilterDistributor &distributor_, const Settings &initial_settings, std::size_t capacity);
+
+        void write_batch(const modes::FilterDistributor::MessageRefs &messages);
+
+        // compute the filter to record with; call with the mutex held
+        modes::Filter combined_filter() const;
+
+        // a recorded message, without the derived CRC state that
+        // modes::Message carries
+        struct record {
+            std::uint64_t serial;
+            std::uint64_t timestamp;
+            modes::MessageType type;
+            modes::TimestampType timestamp_type;
+            std::uint8_t signal;
+            std::uint8_t length;
+            std::array<std::uint8_t, modes::max_payload_size> data;
+        };
+
+        // targets detached while write_batch is working through them
+        // are only marked as deleted, and removed once it is done
+        struct target {
+            std::shared_ptr<SocketOutput> output;
+            modes::Filter filter;
+            bool deleted;
+        };
+
+        modes::FilterDistributor &distributor;
+        modes::FilterDistributor::handle handle;
+        std::uint64_t epoch;
+
+        // recursive, as writing to an output may close it, which detaches it
+        std::recursive_mutex mutex;
+        modes::Filter filter;
+        std::vector<record> ring;   // power-of-two size
+        std::uint64_t written;      // total messages ever recorded
+        std::uint64_t lost_serial;  // newest serial overwritten in the ring, 0 if none
+        std::vector<target> targets;
+        bool writing;
+        modes::FilterDistributor::MessageRefs selected;
+    };
+}; // namespace beast
+
+#endif
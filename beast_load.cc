@@ -0,0 +1,382 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// A load generator for measuring how beast-splitter copes with many clients
+// (see "Measuring client load" in README.md).
+//
+// It plays the part of a Beast receiver, sending synthetic messages at a
+// fixed rate to a beast-splitter that it starts itself with --net pointed at
+// it, and then opens many clients against one of that splitter's --listen
+// ports. Once everything is running, it reports how many messages the
+// clients received and how much CPU the splitter used doing it.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock clock_type;
+
+// DF17 messages with good CRCs, so that the default filter passes them
+static const std::uint8_t sample_messages[][14] = {
+    {0x8D, 0x48, 0x40, 0xD6, 0x20, 0x2C, 0xC3, 0x71, 0xC3, 0x2C, 0xE0, 0x57, 0x60, 0x98},
+    {0x8D, 0x40, 0x62, 0x1D, 0x58, 0xC3, 0x82, 0xD6, 0x90, 0xC8, 0xAC, 0x28, 0x63, 0xA7},
+};
+
+struct options {
+    int feed_port = 30005;
+    int listen_port = 30105;
+    unsigned clients = 1000;
+    unsigned rate = 1000;    // messages per second
+    unsigned burst_ms = 100; // interval between writes to the splitter
+    unsigned warmup = 5;     // seconds
+    unsigned duration = 20;  // seconds
+    std::vector<std::string> command;
+};
+
+static void die(const std::string &what) {
+    std::cerr << "beast-load: " << what << ": " << std::strerror(errno) << std::endl;
+    std::exit(1);
+}
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        die("fcntl");
+}
+
+static sockaddr_in loopback(int port) {
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+// CPU time (user + system) used by a process so far, in seconds
+static double process_cpu(pid_t pid) {
+    char path[64];
+    std::snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = std::fopen(path, "r");
+    if (!f)
+        return 0;
+
+    char buf[1024];
+    std::size_t len = std::fread(buf, 1, sizeof(buf) - 1, f);
+    std::fclose(f);
+    buf[len] = 0;
+
+    // utime and stime are the 14th and 15th fields; the command name in
+    // the 2nd field may contain spaces, so count from the closing paren
+    const char *p = std::strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (!p || std::sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return 0;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double own_cpu() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Appends one Beast mode S long frame. The timestamp bytes never contain
+// 0x1A, so nothing needs escaping and every 0x1A a client sees starts a
+// frame.
+static void append_frame(std::vector<std::uint8_t> &out, std::uint64_t n) {
+    out.push_back(0x1A);
+    out.push_back('3');
+    for (int i = 0; i < 6; ++i)
+        out.push_back(0x20 + ((n >> (i * 5)) & 0x1F));
+    out.push_back(0x80); // signal
+    const std::uint8_t *data = sample_messages[n % 2];
+    out.insert(out.end(), data, data + 14);
+}
+
+static pid_t start_splitter(const std::vector<std::string> &command) {
+    pid_t pid = fork();
+    if (pid < 0)
+        die("fork");
+
+    if (pid == 0) {
+        std::vector<char *> argv;
+        for (const auto &arg : command)
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        die("exec " + command[0]);
+    }
+
+    return pid;
+}
+
+// Connects the clients one at a time, retrying until the splitter is
+// listening
+static std::vector<int> connect_clients(const options &opts) {
+    std::vector<int> fds;
+    sockaddr_in addr = loopback(opts.listen_port);
+    auto give_up = clock_type::now() + std::chrono::seconds(10);
+
+    while (fds.size() < opts.clients) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            die("socket");
+
+        if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+            if (errno != ECONNREFUSED || !fds.empty() || clock_type::now() > give_up)
+                die("connect to port " + std::to_string(opts.listen_port));
+            close(fd);
+            usleep(100000);
+            continue;
+        }
+
+        set_nonblocking(fd);
+        fds.push_back(fd);
+    }
+
+    return fds;
+}
+
+static void usage() {
+    std::cerr << "usage: beast-load [options] -- beast-splitter --net 127.0.0.1:FEED --listen 127.0.0.1:LISTEN ..." << std::endl
+              << "  --feed PORT        port to accept the splitter's --net connection on (30005)" << std::endl
+              << "  --listen PORT      splitter --listen port to connect clients to (30105)" << std::endl
+              << "  --clients N        number of clients (1000)" << std::endl
+              << "  --rate N           messages per second sent to the splitter (1000)" << std::endl
+              << "  --burst MS         interval between writes to the splitter (100)" << std::endl
+              << "  --warmup SECONDS   time to run before measuring (5)" << std::endl
+              << "  --duration SECONDS time to measure for (20)" << std::endl;
+    std::exit(1);
+}
+
+static options parse_options(int argc, char **argv) {
+    static const option longopts[] = {
+        {"feed", required_argument, nullptr, 'f'},     {"listen", required_argument, nullptr, 'l'},   {"clients", required_argument, nullptr, 'c'},
+        {"rate", required_argument, nullptr, 'r'},     {"burst", required_argument, nullptr, 'b'},    {"warmup", required_argument, nullptr, 'w'},
+        {"duration", required_argument, nullptr, 'd'}, {nullptr, 0, nullptr, 0},
+    };
+
+    options opts;
+    int c;
+    while ((c = getopt_long(argc, argv, "", longopts, nullptr)) != -1) {
+        switch (c) {
+        case 'f':
+            opts.feed_port = std::atoi(optarg);
+            break;
+        case 'l':
+            opts.listen_port = std::atoi(optarg);
+            break;
+        case 'c':
+            opts.clients = std::atoi(optarg);
+            break;
+        case 'r':
+            opts.rate = std::atoi(optarg);
+            break;
+        case 'b':
+            opts.burst_ms = std::max(1, std::atoi(optarg));
+            break;
+        case 'w':
+            opts.warmup = std::atoi(optarg);
+            break;
+        case 'd':
+            opts.duration = std::max(1, std::atoi(optarg));
+            break;
+        default:
+            usage();
+        }
+    }
+
+    for (int i = optind; i < argc; ++i)
+        opts.command.push_back(argv[i]);
+    if (opts.command.empty())
+        usage();
+
+    return opts;
+}
+
+int main(int argc, char **argv) {
+    options opts = parse_options(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    // the splitter connects to us for its input
+    int feed_listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(feed_listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in feed_addr = loopback(opts.feed_port);
+    if (bind(feed_listener, (sockaddr *)&feed_addr, sizeof(feed_addr)) < 0 || listen(feed_listener, 1) < 0)
+        die("listen on port " + std::to_string(opts.feed_port));
+
+    // give up if the splitter exits first, e.g. on a bad option
+    pid_t splitter = start_splitter(opts.command);
+    for (;;) {
+        pollfd pfd = {feed_listener, POLLIN, 0};
+        if (poll(&pfd, 1, 100) > 0)
+            break;
+
+        int status;
+        if (waitpid(splitter, &status, WNOHANG) == splitter) {
+            std::cerr << "beast-load: the splitter exited before connecting, with status " << (WIFEXITED(status) ? WEXITSTATUS(status) : -1) << std::endl;
+            return 1;
+        }
+    }
+
+    int feed = accept(feed_listener, nullptr, nullptr);
+    if (feed < 0)
+        die("accept");
+    close(feed_listener);
+    set_nonblocking(feed);
+
+    std::vector<int> clients = connect_clients(opts);
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+        die("epoll_create1");
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = feed;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, feed, &ev);
+    for (int fd : clients) {
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    unsigned per_burst = std::max(1U, opts.rate * opts.burst_ms / 1000);
+    std::uint64_t sent = 0, received = 0, received_bytes = 0, closed = 0;
+    std::vector<std::uint8_t> burst;
+    std::vector<std::uint8_t> buf(65536);
+    std::vector<epoll_event> events(1024);
+
+    auto start = clock_type::now();
+    auto next_burst = start;
+    auto measure_from = start + std::chrono::seconds(opts.warmup);
+    auto measure_until = measure_from + std::chrono::seconds(opts.duration);
+    bool measuring = false;
+    std::uint64_t base_sent = 0, base_received = 0, base_bytes = 0;
+    double base_splitter_cpu = 0, base_own_cpu = 0;
+
+    for (;;) {
+        auto now = clock_type::now();
+        if (!measuring && now >= measure_from) {
+            measuring = true;
+            base_sent = sent;
+            base_received = received;
+            base_bytes = received_bytes;
+            base_splitter_cpu = process_cpu(splitter);
+            base_own_cpu = own_cpu();
+        }
+        if (now >= measure_until)
+            break;
+
+        if (now >= next_burst) {
+            // the splitter only reads what we send in whole bursts, so a
+            // short write just holds up the next one
+            burst.clear();
+            for (unsigned i = 0; i < per_burst; ++i)
+                append_frame(burst, sent + i);
+            std::size_t off = 0;
+            while (off < burst.size()) {
+                ssize_t n = write(feed, burst.data() + off, burst.size() - off);
+                if (n < 0 && errno != EAGAIN)
+                    die("write to splitter");
+                if (n > 0)
+                    off += n;
+            }
+            sent += per_burst;
+            next_burst += std::chrono::milliseconds(opts.burst_ms);
+            continue;
+        }
+
+        int timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(next_burst - now).count() + 1;
+        int count = epoll_wait(epfd, events.data(), events.size(), timeout);
+        if (count < 0 && errno != EINTR)
+            die("epoll_wait");
+
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            for (;;) {
+                ssize_t n = read(fd, buf.data(), buf.size());
+                if (n > 0) {
+                    if (fd != feed) {
+                        received_bytes += n;
+                        received += std::count(buf.begin(), buf.begin() + n, 0x1A);
+                    }
+                    continue;
+                }
+
+                if (n == 0 || errno != EAGAIN) {
+                    if (fd == feed) {
+                        std::cerr << "beast-load: the splitter closed its input connection" << std::endl;
+                        return 1;
+                    }
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                    close(fd);
+                    ++closed;
+                }
+                break;
+            }
+        }
+    }
+
+    double splitter_cpu = process_cpu(splitter) - base_splitter_cpu;
+    double load_cpu = own_cpu() - base_own_cpu;
+    double seconds = opts.duration;
+    std::uint64_t expected = (sent - base_sent) * clients.size();
+    std::uint64_t delivered = received - base_received;
+
+    // an ALLOC_TRACE build exits on SIGTERM, with status 3 if it went
+    // over $ALLOC_TRACE_MAX_ALLOCS or $ALLOC_TRACE_MAX_COPIED; otherwise
+    // the splitter is simply killed
+    int status = 0;
+    kill(splitter, SIGTERM);
+    waitpid(splitter, &status, 0);
+
+    std::printf("clients=%zu rate=%u/s delivered=%.0f msg/s (%.1f%% of sent) %.2f MB/s splitter_cpu=%.1f%% cpu_per_1M_msgs=%.3fs load_cpu=%.1f%% disconnected=%llu\n", clients.size(), opts.rate, delivered / seconds, expected ? 100.0 * delivered / expected : 0.0, (received_bytes - base_bytes) / seconds / 1e6, 100.0 * splitter_cpu / seconds, delivered ? splitter_cpu * 1e6 / delivered : 0.0, 100.0 * load_cpu / seconds, (unsigned long long)closed);
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        std::cerr << "beast-load: the splitter exited with status " << WEXITSTATUS(status) << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -23,43 +23,608 @@
 // OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <boost/asio.hpp>
 #include <boost/asio/ip/v6_only.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include <boost/asio/steady_timer.hpp>
 
+#include "alloc_trace.h"
 #include "beast_output.h"
 #include "modes_message.h"
+#include "output_workers.h"
 
 namespace asio = boost::asio;
 using boost::asio::ip::tcp;
 
 namespace beast {
-    enum class SocketOutput::ParserState { FIND_1A, READ_1, READ_OPTION };
+    OutputOptions::OutputOptions() : max_queue(0), overflow(OverflowPolicy::DROP_NEWEST), keepalive(0), user_timeout(0), profile(FlushProfile::DEFAULT), flush_window(100), compress(Compression::NONE), mtu(1400), multicast_ttl(1), shm_records(65536), link(false), link_replay(262144), backlog(false), conflate(false), zerocopy(false) {}
+
+    static unsigned long parse_number(const std::string &key, const std::string &value, bool allow_suffix) {
+        std::size_t end = 0;
+        unsigned long n;
+        try {
+            n = std::stoul(value, &end);
+        } catch (std::logic_error &) {
+            throw std::invalid_argument("bad value for " + key + ": " + value);
+        }
+
+        if (allow_suffix && end + 1 == value.size()) {
+            switch (value[end]) {
+            case 'k':
+            case 'K':
+                return n * 1024;
+            case 'm':
+            case 'M':
+                return n * 1024 * 1024;
+            default:
+                break;
+            }
+        }
+
+        if (end != value.size())
+            throw std::invalid_argument("bad value for " + key + ": " + value);
+        return n;
+    }
+
+    OutputOptions::OutputOptions(const std::string &str) : OutputOptions() {
+        std::size_t start = 0;
+        while (start < str.size()) {
+            std::size_t comma = str.find(',', start);
+            if (comma == std::string::npos)
+                comma = str.size();
+
+            std::string item = str.substr(start, comma - start);
+            start = comma + 1;
+            if (item.empty())
+                continue;
+
+            std::size_t eq = item.find('=');
+            if (eq == std::string::npos)
+                throw std::invalid_argument("expected key=value: " + item);
+
+            std::string key = item.substr(0, eq);
+            std::string value = item.substr(eq + 1);
+
+            if (key == "queue") {
+                max_queue = parse_number(key, value, true);
+            } else if (key == "overflow") {
+                if (value == "drop-newest")
+                    overflow = OverflowPolicy::DROP_NEWEST;
+                else if (value == "drop-oldest")
+                    overflow = OverflowPolicy::DROP_OLDEST;
+                else if (value == "disconnect")
+                    overflow = OverflowPolicy::DISCONNECT;
+                else
+                    throw std::invalid_argument("bad value for overflow: " + value);
+            } else if (key == "keepalive") {
+                keepalive = std::chrono::seconds(parse_number(key, value, false));
+            } else if (key == "timeout") {
+                user_timeout = std::chrono::seconds(parse_number(key, value, false));
+            } else if (key == "profile") {
+                if (value == "default")
+                    profile = FlushProfile::DEFAULT;
+                else if (value == "low-latency")
+                    profile = FlushProfile::LOW_LATENCY;
+                else if (value == "bulk")
+                    profile = FlushProfile::BULK;
+                else
+                    throw std::invalid_argument("bad value for profile: " + value);
+            } else if (key == "window") {
+                flush_window = std::chrono::milliseconds(parse_number(key, value, false));
+            } else if (key == "compress") {
+                compress = compression::parse(value);
+            } else if (key == "mtu") {
+                mtu = parse_number(key, value, false);
+                if (mtu < 64 || mtu > 65507)
+                    throw std::invalid_argument("mtu must be between 64 and 65507: " + value);
+            } else if (key == "records") {
+                shm_records = parse_number(key, value, true);
+                if (shm_records < 16 || shm_records > (1U << 24))
+                    throw std::invalid_argument("records must be between 16 and 16m: " + value);
+            } else if (key == "link") {
+                if (value == "on")
+                    link = true;
+                else if (value == "off")
+                    link = false;
+                else
+                    throw std::invalid_argument("bad value for link: " + value);
+            } else if (key == "conflate") {
+                if (value == "on")
+                    conflate = true;
+                else if (value == "off")
+                    conflate = false;
+                else
+                    throw std::invalid_argument("bad value for conflate: " + value);
+            } else if (key == "zerocopy") {
+                if (value == "on")
+                    zerocopy = true;
+                else if (value == "off")
+                    zerocopy = false;
+                else
+                    throw std::invalid_argument("bad value for zerocopy: " + value);
+            } else if (key == "backlog") {
+                if (value == "on")
+                    backlog = true;
+                else if (value == "off")
+                    backlog = false;
+                else
+                    throw std::invalid_argument("bad value for backlog: " + value);
+            } else if (key == "replay") {
+                link_replay = parse_number(key, value, true);
+                if (link_replay < 16 || link_replay > (1U << 24))
+                    throw std::invalid_argument("replay must be between 16 and 16m: " + value);
+            } else if (key == "ttl") {
+                multicast_ttl = parse_number(key, value, false);
+                if (multicast_ttl > 255)
+                    throw std::invalid_argument("ttl must be at most 255: " + value);
+            } else {
+                throw std::invalid_argument("unrecognized output option: " + key);
+            }
+        }
+    }
+
+    std::ostream &operator<<(std::ostream &os, const OutputOptions &o) {
+        os << "queue=" << o.max_queue << ",overflow=";
+        switch (o.overflow) {
+        case OutputOptions::OverflowPolicy::DROP_NEWEST:
+            os << "drop-newest";
+            break;
+        case OutputOptions::OverflowPolicy::DROP_OLDEST:
+            os << "drop-oldest";
+            break;
+        case OutputOptions::OverflowPolicy::DISCONNECT:
+            os << "disconnect";
+            break;
+        }
+        os << ",keepalive=" << o.keepalive.count() << ",timeout=" << o.user_timeout.count() << ",profile=";
+        switch (o.profile) {
+        case OutputOptions::FlushProfile::DEFAULT:
+            os << "default";
+            break;
+        case OutputOptions::FlushProfile::LOW_LATENCY:
+            os << "low-latency";
+            break;
+        case OutputOptions::FlushProfile::BULK:
+            os << "bulk";
+            break;
+        }
+        os << ",window=" << o.flush_window.count() << ",compress=" << compression::name(o.compress) << ",mtu=" << o.mtu << ",ttl=" << o.multicast_ttl << ",records=" << o.shm_records << ",link=" << (o.link ? "on" : "off") << ",replay=" << o.link_replay << ",backlog=" << (o.backlog ? "on" : "off") << ",conflate=" << (o.conflate ? "on" : "off") << ",zerocopy=" << (o.zerocopy ? "on" : "off");
+        return os;
+    }
+
+    //////////////
+
+    struct EncodeCache::registry {
+        std::mutex mutex;
+        std::vector<EncodeCache *> caches;
+        std::uint64_t retired_hits = 0;
+        std::uint64_t retired_misses = 0;
+    };
+
+    EncodeCache::registry &EncodeCache::all_caches() {
+        // never destroyed, as thread-local caches may outlive it
+        static registry *r = new registry();
+        return *r;
+    }
+
+    EncodeCache::EncodeCache() : entries(num_entries), hit_count(0), miss_count(0) {
+        registry &r = all_caches();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.caches.push_back(this);
+    }
+
+    EncodeCache::~EncodeCache() {
+        registry &r = all_caches();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.caches.erase(std::remove(r.caches.begin(), r.caches.end(), this), r.caches.end());
+        r.retired_hits += hits();
+        r.retired_misses += misses();
+    }
+
+    std::uint64_t EncodeCache::total_hits() {
+        registry &r = all_caches();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        std::uint64_t total = r.retired_hits;
+        for (auto cache : r.caches)
+            total += cache->hits();
+        return total;
+    }
+
+    std::uint64_t EncodeCache::total_misses() {
+        registry &r = all_caches();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        std::uint64_t total = r.retired_misses;
+        for (auto cache : r.caches)
+            total += cache->misses();
+        return total;
+    }
+
+    helpers::bytespan EncodeCache::lookup(std::uint64_t serial, std::uint32_t variant) {
+        // plain load/store rather than an atomic increment; only
+        // this thread ever writes the counters
+        const entry &e = entries[index(serial, variant)];
+        if (e.serial == serial && e.variant == variant && e.length > 0) {
+            hit_count.store(hits() + 1, std::memory_order_relaxed);
+            return helpers::bytespan(e.bytes.data(), e.length);
+        }
+
+        miss_count.store(misses() + 1, std::memory_order_relaxed);
+        return helpers::bytespan();
+    }
+
+    void EncodeCache::store(std::uint64_t serial, std::uint32_t variant, helpers::bytespan encoded) {
+        if (encoded.size() > max_entry_size)
+            return;
+
+        entry &e = entries[index(serial, variant)];
+        e.serial = serial;
+        e.variant = variant;
+        e.length = (std::uint8_t)encoded.size();
+        std::copy(encoded.begin(), encoded.end(), e.bytes.begin());
+        helpers::alloc_trace::note_copied(encoded.size());
+    }
+
+    //////////////
+
+    SharedEncodings::batch_key SharedEncodings::key_of(const modes::FilterDistributor::MessageRefs &messages) {
+        batch_key key = {0, 0, 0, messages.size()};
+        if (messages.empty())
+            return key;
+
+        key.first = messages.front()->serial();
+        key.last = messages.back()->serial();
+        for (auto message : messages)
+            key.hash = (key.hash ^ message->serial()) * 0x100000001B3ULL;
+        return key;
+    }
+
+    const SharedEncodings::Slices *SharedEncodings::lookup(const modes::FilterDistributor::MessageRefs &messages, const Settings &settings) {
+        batch_key key = key_of(messages);
+        if (key.first == 0 || !(key == current))
+            return nullptr; // unnumbered messages, or a different batch
+
+        for (std::size_t i = 0; i < used; ++i) {
+            if (entries[i].first == settings)
+                return &entries[i].second;
+        }
+
+        return nullptr;
+    }
+
+    SharedEncodings::Slices &SharedEncodings::insert(const modes::FilterDistributor::MessageRefs &messages, const Settings &settings) {
+        batch_key key = key_of(messages);
+        if (key.first == 0 || !(key == current)) {
+            // anything we had is for an older batch, let go of its
+            // chunks but keep the entries to fill in again
+            for (std::size_t i = 0; i < used; ++i)
+                entries[i].second.clear();
+            used = 0;
+            current = key;
+        }
+
+        if (used == entries.size())
+            entries.emplace_back(settings, Slices());
+        else
+            entries[used].first = settings;
+        return entries[used++].second;
+    }
+
+    std::uint8_t *SharedEncodings::reserve(std::size_t size) {
+        if (!chunk || chunk->available() < size)
+            chunk = helpers::ChunkPool::instance().allocate();
+        return chunk->tail();
+    }
+
+    void SharedEncodings::commit(Slices &slices, std::size_t length, std::uint32_t messages) {
+        if (length == 0)
+            return;
+
+        std::size_t offset = chunk->size();
+        chunk->commit(length);
+        helpers::alloc_trace::note_copied(length);
+
+        // extend the last slice if this directly follows it
+        if (!slices.empty()) {
+            helpers::ChunkSlice &last = slices.back();
+            if (last.chunk == chunk && last.offset + last.length == offset) {
+                last.length += length;
+                last.messages += messages;
+                return;
+            }
+        }
 
-    SocketOutput::SocketOutput(asio::io_service &service_, tcp::socket &&socket_, const Settings &settings_) : service(service_), socket(std::move(socket_)), peer(socket.remote_endpoint()), state(ParserState::FIND_1A), settings(settings_), flush_pending(false) {}
+        slices.push_back({chunk, (std::uint32_t)offset, (std::uint32_t)length, messages});
+    }
+
+    //////////////
+
+    boost::asio::io_service::id FlushCoordinator::id;
+
+    FlushCoordinator::FlushCoordinator(asio::io_service &owner) : asio::io_service::service(owner), service(owner), pass_pending(false), parallel(false) {}
+
+    void FlushCoordinator::shutdown_service() {
+        std::lock_guard<std::mutex> lock(mutex);
+        dirty.clear();
+    }
+
+    void FlushCoordinator::schedule(std::shared_ptr<SocketOutput> output) {
+        std::lock_guard<std::mutex> lock(mutex);
+        dirty.push_back(std::move(output));
+        if (!pass_pending) {
+            pass_pending = true;
+            service.post(helpers::make_alloc_handler(flush_all_memory, std::bind(&FlushCoordinator::flush_all, this)));
+        }
+    }
+
+    void FlushCoordinator::flush_all() {
+        helpers::alloc_trace::Scope trace(helpers::alloc_trace::Tag::FLUSH);
+
+        // flushing may close outputs, which may in turn schedule more
+        // work, so work from a separate list
+        std::vector<std::shared_ptr<SocketOutput>> outputs;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pass_pending = false;
+            outputs.swap(dirty);
+        }
+
+        for (auto &output : outputs) {
+            // with a single thread, dispatch runs the flush right here
+            auto flush = helpers::make_alloc_handler(output->flush_memory, std::bind(&SocketOutput::flush_queue, output));
+            if (parallel)
+                output->strand.post(flush);
+            else
+                output->strand.dispatch(flush);
+        }
+
+        // give the list back, so that its storage is reused next pass
+        outputs.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (dirty.empty())
+            dirty.swap(outputs);
+    }
 
-    void SocketOutput::start() { read_commands(); }
+    //////////////
+
+    const std::chrono::seconds SocketOutput::zerocopy_drain_poll(1);
+    const std::chrono::seconds SocketOutput::zerocopy_drain_timeout(10);
+
+    enum class SocketOutput::ParserState { FIND_1A, READ_1, READ_OPTION, READ_RESUME };
+
+    EncodeCache &SocketOutput::encode_cache() {
+        static thread_local EncodeCache cache;
+        return cache;
+    }
+
+    SharedEncodings &SocketOutput::shared_encodings() {
+        static thread_local SharedEncodings encodings;
+        return encodings;
+    }
+
+    static bool is_seqpacket(SocketOutput::socket_type &socket) {
+        int type = 0;
+        socklen_t len = sizeof(type);
+        return (getsockopt(socket.native_handle(), SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_SEQPACKET);
+    }
+
+    // A buffer sequence over write_buffers without copying it. asio
+    // keeps a copy of the sequence in each operation, which for the
+    // vector itself would mean an allocation per write.
+    class BufferView {
+      public:
+        typedef asio::const_buffer value_type;
+        typedef const asio::const_buffer *const_iterator;
+
+        explicit BufferView(const std::vector<asio::const_buffer> &buffers) : first(buffers.data()), last(buffers.data() + buffers.size()) {}
+
+        const_iterator begin() const { return first; }
+        const_iterator end() const { return last; }
+
+      private:
+        const_iterator first;
+        const_iterator last;
+    };
+
+    static std::string to_string(const tcp::endpoint &endpoint) {
+        std::ostringstream os;
+        os << endpoint;
+        return os.str();
+    }
+
+    SocketOutput::SocketOutput(asio::io_service &service_, socket_type &&socket_, const std::string &peer_, const Settings &settings_, const OutputOptions &options_) : service(service_), strand(service_), socket(std::move(socket_)), peer(peer_), packet_mode(is_seqpacket(socket)), closed(false), state(ParserState::FIND_1A), resume_length(0), settings(settings_), options(options_), queued_bytes(0), inbox_pending(false), flush_pending(false), uring(nullptr), uring_write(0), zerocopy(false), zerocopy_writing(false), zerocopy_waiting(false), zerocopy_next(0), zerocopy_done(0), flush_timer(service_), dropped_messages(0), overflowing(false), conflated_messages(0), priming(false), backlog_through(0) {
+        if (UringWriter::enabled()) {
+            uring = &asio::use_service<UringWriter>(service);
+            if (!uring->available())
+                uring = nullptr;
+        }
+
+        if (options.compress != Compression::NONE) {
+            if (packet_mode)
+                std::cerr << peer << ": compression is not supported on packet sockets, sending uncompressed" << std::endl;
+            else
+                compressor = Compressor::create(options.compress);
+        }
+    }
+
+    SocketOutput::pointer SocketOutput::attach(asio::io_service &service, socket_type &&socket, const std::string &peer, modes::FilterDistributor &distributor, const Settings &settings, const OutputOptions &options, std::function<void()> close_notifier) {
+        pointer output = create(service, std::move(socket), peer, settings, options);
+
+        // Live messages are held back from when we join the
+        // distributor until the backlog has been queued.
+        if (options.backlog) {
+            output->backlog = Backlog::current();
+            output->priming = (output->backlog != nullptr);
+        }
+
+        modes::FilterDistributor::handle h = distributor.add_batch_client(std::bind(&SocketOutput::write_batch, output, std::placeholders::_1), settings.to_filter());
+
+        output->set_settings_notifier([&distributor, h](const Settings &newsettings) { distributor.update_client_filter(h, newsettings.to_filter()); });
+
+        output->set_close_notifier([&distributor, h, close_notifier] {
+            distributor.remove_client(h);
+            if (close_notifier)
+                close_notifier();
+        });
+
+        if (output->backlog)
+            output->strand.post(std::bind(&SocketOutput::write_backlog, output));
+
+        output->start();
+        return output;
+    }
+
+    SocketOutput::pointer SocketOutput::attach_link(asio::io_service &service, socket_type &&socket, const std::string &peer, LinkReplay::pointer link, const Settings &settings, const OutputOptions &options) {
+        // the link protocol always uses length-prefixed frames
+        Settings link_settings = settings;
+        link_settings.length_prefixed = true;
+
+        pointer output = create(service, std::move(socket), peer, link_settings, options);
+        output->link = link;
+
+        // nothing is sent until the client asks to resume
+        std::weak_ptr<SocketOutput> weak(output);
+        output->set_settings_notifier([link, weak](const Settings &newsettings) {
+            if (auto o = weak.lock())
+                link->update_filter(o.get(), newsettings.to_filter());
+        });
+        SocketOutput *raw = output.get();
+        output->set_close_notifier([link, raw] { link->detach(raw); });
+
+        output->start();
+        return output;
+    }
+
+    void SocketOutput::start() {
+        apply_socket_options();
+        read_commands();
+    }
+
+    void SocketOutput::apply_socket_options() {
+        // These are all best-effort; a failure just means we find out
+        // about dead peers later than we'd like.
+        int fd = socket.native_handle();
+
+        if (options.conflate) {
+            // Keep the kernel's send buffer small, so that a slow client
+            // holds up our writes and gets conflated data, rather than
+            // a large stale backlog sitting in the kernel.
+            boost::system::error_code ec;
+            socket.set_option(asio::socket_base::send_buffer_size(conflate_send_buffer), ec);
+            if (ec)
+                std::cerr << peer << ": could not set send buffer size: " << ec.message() << std::endl;
+        }
+
+        // the rest are all TCP-specific
+        boost::system::error_code family_ec;
+        int family = socket.local_endpoint(family_ec).protocol().family();
+        if (family_ec || (family != AF_INET && family != AF_INET6))
+            return;
+
+        if (options.keepalive.count() > 0) {
+            boost::system::error_code ec;
+            socket.set_option(asio::socket_base::keep_alive(true), ec);
+            if (ec)
+                std::cerr << peer << ": could not enable TCP keepalive: " << ec.message() << std::endl;
+
+#ifdef TCP_KEEPIDLE
+            // start probing after the configured idle time, then
+            // probe a few more times at a shorter interval
+            int idle = (int)options.keepalive.count();
+            int interval = std::max(1, idle / 3);
+            int count = 3;
+            if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 || setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0 || setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0)
+                std::cerr << peer << ": could not set TCP keepalive interval: " << boost::system::error_code(errno, boost::system::system_category()).message() << std::endl;
+#endif
+        }
+
+        if (options.user_timeout.count() > 0) {
+#ifdef TCP_USER_TIMEOUT
+            unsigned int timeout_ms = (unsigned int)(options.user_timeout.count() * 1000);
+            if (setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout_ms, sizeof(timeout_ms)) < 0)
+                std::cerr << peer << ": could not set TCP user timeout: " << boost::system::error_code(errno, boost::system::system_category()).message() << std::endl;
+#else
+            std::cerr << peer << ": TCP user timeout is not supported on this platform" << std::endl;
+#endif
+        }
+
+        if (options.zerocopy) {
+#ifdef SO_ZEROCOPY
+            // compressed output is written from a per-connection buffer
+            // that is reused for every write, so it can't be lent out
+            int one = 1;
+            if (compressor)
+                std::cerr << peer << ": zero-copy sends are not used for compressed connections" << std::endl;
+            else if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+                std::cerr << peer << ": could not enable zero-copy sends: " << boost::system::error_code(errno, boost::system::system_category()).message() << std::endl;
+            else
+                zerocopy = true;
+#else
+            std::cerr << peer << ": zero-copy sends are not supported on this platform" << std::endl;
+#endif
+        }
+
+        switch (options.profile) {
+        case OutputOptions::FlushProfile::DEFAULT:
+            break;
+
+        case OutputOptions::FlushProfile::LOW_LATENCY: {
+            boost::system::error_code ec;
+            socket.set_option(asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_NODELAY>(true), ec);
+            if (ec)
+                std::cerr << peer << ": could not set TCP_NODELAY: " << ec.message() << std::endl;
+            break;
+        }
+
+        case OutputOptions::FlushProfile::BULK: {
+#ifdef TCP_CORK
+            // only ever send full segments; we write in large chunks
+            // anyway, and the kernel sends any leftover partial segment
+            // after a short delay
+            int cork = 1;
+            if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) < 0)
+                std::cerr << peer << ": could not set TCP_CORK: " << boost::system::error_code(errno, boost::system::system_category()).message() << std::endl;
+#endif
+            break;
+        }
+        }
+
+        (void)fd;
+    }
 
     void SocketOutput::read_commands() {
         auto self(shared_from_this());
-        auto buf = std::make_shared<std::vector<std::uint8_t>>(512);
 
-        socket.async_read_some(asio::buffer(*buf), [this, self, buf](const boost::system::error_code &ec, std::size_t len) {
+        socket.async_read_some(asio::buffer(command_buffer), strand.wrap(helpers::make_alloc_handler(read_memory, [this, self](const boost::system::error_code &ec, std::size_t len) {
             if (ec) {
                 handle_error(ec);
             } else {
-                buf->resize(len);
-                process_commands(*buf);
+                process_commands(helpers::bytespan(command_buffer.data(), len));
                 read_commands();
             }
-        });
+        })));
     }
 
-    void SocketOutput::process_commands(std::vector<std::uint8_t> data) {
+    void SocketOutput::process_commands(helpers::bytespan data) {
         bool got_a_command = false;
+        bool got_resume = false;
+        bool got_snapshot_request = false;
+        std::unique_lock<std::mutex> lock(settings_mutex);
 
         for (auto p = data.begin(); p != data.end(); ++p) {
             switch (state) {
@@ -69,10 +634,26 @@ namespace beast {
                 break;
 
             case ParserState::READ_1:
-                if (*p == 0x31)
+                if (*p == 0x31) {
                     state = ParserState::READ_OPTION;
-                else
+                } else if (*p == 'S' && link) {
+                    resume_length = 0;
+                    state = ParserState::READ_RESUME;
+                } else if (*p == 'W') {
+                    got_snapshot_request = true;
+                    state = ParserState::FIND_1A;
+                } else {
+                    state = ParserState::FIND_1A;
+                }
+                break;
+
+            case ParserState::READ_RESUME:
+                // fixed length and unescaped
+                resume_command[resume_length++] = *p;
+                if (resume_length == resume_command.size()) {
+                    got_resume = true;
                     state = ParserState::FIND_1A;
+                }
                 break;
 
             case ParserState::READ_OPTION:
@@ -83,12 +664,62 @@ namespace beast {
             }
         }
 
+        Settings newsettings = settings;
+        lock.unlock();
+
         if (got_a_command) {
             // just do this once at the end, not on every command
-            std::cerr << peer << ": settings changed to " << settings << std::endl;
+            std::cerr << peer << ": settings changed to " << newsettings << std::endl;
             if (settings_notifier)
-                settings_notifier(settings);
+                settings_notifier(newsettings);
         }
+
+        if (got_resume)
+            process_resume_command();
+
+        if (got_snapshot_request)
+            send_snapshot();
+    }
+
+    void SocketOutput::send_snapshot() {
+        auto table = SnapshotTable::current();
+        if (!table || link) {
+            // link clients get everything in order, with serials, anyway
+            std::cerr << peer << ": ignoring snapshot request, " << (link ? "not supported on link connections" : "start beast-splitter with --snapshot to enable") << std::endl;
+            return;
+        }
+
+        Settings current;
+        {
+            std::lock_guard<std::mutex> lock(settings_mutex);
+            current = settings;
+        }
+
+        modes::MessageBatch messages;
+        table->snapshot(current.to_filter(), messages);
+        std::cerr << peer << ": sending snapshot of " << messages.size() << " messages" << std::endl;
+        if (messages.empty())
+            return;
+
+        modes::FilterDistributor::MessageRefs refs;
+        refs.reserve(messages.size());
+        for (const auto &message : messages)
+            refs.push_back(&message);
+        encode_and_queue(refs);
+    }
+
+    void SocketOutput::process_resume_command() {
+        std::uint64_t epoch, serial;
+        std::memcpy(&epoch, resume_command.data(), 8);
+        std::memcpy(&serial, resume_command.data() + 8, 8);
+
+        modes::Filter filter;
+        {
+            std::lock_guard<std::mutex> lock(settings_mutex);
+            filter = settings.to_filter();
+        }
+
+        link->attach(shared_from_this(), filter, epoch, serial);
     }
 
     void SocketOutput::process_option_command(uint8_t option) {
@@ -133,6 +764,10 @@ namespace beast {
         case 'V':
             settings.verbatim = (ch == 'V');
             break;
+        case 'l':
+        case 'L':
+            settings.length_prefixed = (ch == 'L');
+            break;
         default:
             // unrecognized
             return;
@@ -140,167 +775,707 @@ namespace beast {
     }
 
     void SocketOutput::write(const modes::Message &message) {
-        if (!socket.is_open())
+        helpers::alloc_trace::Scope trace(helpers::alloc_trace::Tag::OUTPUT_WRITE);
+        write_batch(modes::FilterDistributor::MessageRefs{&message});
+    }
+
+    void SocketOutput::write_batch(const modes::FilterDistributor::MessageRefs &messages) {
+        helpers::alloc_trace::Scope trace(helpers::alloc_trace::Tag::OUTPUT_WRITE);
+        if (closed)
             return; // we are shut down
 
-        if (message.type() == modes::MessageType::STATUS) {
-            // local connection settings override the upstream data
-            Settings upstream = Settings(message.data()[0]);
-            Settings used = settings | upstream;
+        if (backlog) {
+            if (priming.load()) {
+                std::lock_guard<std::mutex> lock(priming_mutex);
+                if (priming) {
+                    // the backlog has not been sent yet; hold on to
+                    // these until it has
+                    for (auto message : messages)
+                        held.push_back(*message);
+                    return;
+                }
+            }
+
+            if (messages.front()->serial() <= backlog_through) {
+                // some of these may already have gone out as backlog
+                modes::FilterDistributor::MessageRefs unsent;
+                for (auto message : messages) {
+                    if (!backlog->recorded(*message, backlog_through))
+                        unsent.push_back(message);
+                }
+
+                if (unsent.size() != messages.size()) {
+                    if (!unsent.empty())
+                        encode_and_queue(unsent);
+                    return;
+                }
+            }
+        }
+
+        encode_and_queue(messages);
+    }
+
+    void SocketOutput::write_backlog() {
+        if (closed)
+            return;
+
+        Settings current;
+        {
+            std::lock_guard<std::mutex> lock(settings_mutex);
+            current = settings;
+        }
 
-            auto copy = message.data();
-            copy[0] = used.to_status_byte();
+        modes::MessageBatch messages;
+        {
+            std::lock_guard<std::mutex> lock(priming_mutex);
+            backlog_through = backlog->snapshot(current.to_filter(), messages);
 
-            if (settings.gps_timestamps.on() && !upstream.gps_timestamps.on()) {
-                // we are translating 12MHz to "GPS", set the emulation flag
-                copy[2] |= 0x80; // set UTC-bugfix-and-more-bits flag
-                copy[2] |= 0x20; // set emulated-timestamp flag
+            // anything that arrived while we were waiting to run and is
+            // not in the snapshot goes out after it
+            for (const auto &message : held) {
+                if (!backlog->recorded(message, backlog_through))
+                    messages.push_back(message);
             }
+            held.clear();
 
-            write_message(message.type(), message.timestamp_type(), message.timestamp(), message.signal(), copy);
-        } else {
-            // apply FEC if requested
-            bool needs_fec = (!settings.verbatim && !settings.fec_disable && message.crc_correctable());
-            write_message(message.type(), message.timestamp_type(), message.timestamp(), message.signal(), needs_fec ? message.corrected_data() : message.data());
-        }
-    }
-
-    void SocketOutput::write_message(modes::MessageType type, modes::TimestampType timestamp_type, std::uint64_t timestamp, std::uint8_t signal, const helpers::bytebuf &data) {
-        if (timestamp_type == modes::TimestampType::TWELVEMEG && !settings.radarcape.off() && settings.gps_timestamps.on()) {
-            // GPS timestamps were explicitly requested
-            // scale 12MHz to pseudo-GPS
-            std::uint64_t ns = timestamp * 1000ULL / 12ULL;
-            std::uint64_t seconds = (ns / 1000000000ULL) % 86400;
-            std::uint64_t nanos = ns % 1000000000ULL;
-            timestamp = (seconds << 30) | nanos;
-        } else if (timestamp_type == modes::TimestampType::GPS && (settings.radarcape.off() || settings.gps_timestamps.off())) {
-            // beast output or 12MHz timestamps were explicitly requested
-            // scale GPS to 12MHz
-            std::uint64_t seconds = timestamp >> 30;
-            std::uint64_t nanos = timestamp & 0x3FFFFFFF;
-            std::uint64_t ns = seconds * 1000000000ULL + nanos;
-            timestamp = ns * 12ULL / 1000ULL;
-        }
-
-        // if gps_timestamps is DONTCARE, we just use whatever is provided
-
-        if (settings.binary_format) {
-            write_binary(type, timestamp, signal, data);
-        } else if (settings.avrmlat) {
-            if (type != modes::MessageType::STATUS && type != modes::MessageType::POSITION)
-                write_avrmlat(timestamp, data);
+            // Live messages can go straight out from now on. We are on
+            // our strand, so their output is queued after what we queue
+            // here.
+            priming = false;
+        }
+
+        // held messages that were not recorded can be older than the
+        // last of the snapshot
+        std::stable_sort(messages.begin(), messages.end(), [](const modes::Message &a, const modes::Message &b) { return a.serial() < b.serial(); });
+
+        std::cerr << peer << ": sending " << messages.size() << " messages of backlog" << std::endl;
+        if (messages.empty())
+            return;
+
+        modes::FilterDistributor::MessageRefs refs;
+        refs.reserve(messages.size());
+        for (const auto &message : messages)
+            refs.push_back(&message);
+        encode_and_queue(refs);
+    }
+
+    void SocketOutput::encode_and_queue(const modes::FilterDistributor::MessageRefs &messages) {
+        if (options.conflate && !link) {
+            // encoded later, on our strand, once we know what is left;
+            // copied, as the messages only live for the duration of this call
+            auto batch = std::make_shared<modes::MessageBatch>();
+            batch->reserve(messages.size());
+            for (auto message : messages)
+                batch->push_back(*message);
+
+            auto self(shared_from_this());
+            strand.dispatch([this, self, batch] { conflate(*batch); });
+            return;
+        }
+
+        Settings current;
+        {
+            std::lock_guard<std::mutex> lock(settings_mutex);
+            current = settings;
+        }
+
+        const SharedEncodings::Slices *output;
+        if (link) {
+            // link batches carry serials that are specific to what this
+            // client has seen, so they are not shared
+            link_encoded.clear();
+            encode_prefixed(link_encoded, current, messages, true);
+            output = &link_encoded;
         } else {
-            if (type != modes::MessageType::STATUS && type != modes::MessageType::POSITION)
-                write_avr(data);
+            // reuse another connection's encoding of this batch if we can
+            SharedEncodings &shared = shared_encodings();
+            const SharedEncodings::Slices *slices = shared.lookup(messages, current);
+            if (!slices) {
+                SharedEncodings::Slices &encoded = shared.insert(messages, current);
+                if (current.length_prefixed)
+                    encode_prefixed(encoded, current, messages, false);
+                else
+                    encode_batch(encoded, current, messages);
+                slices = &encoded;
+            }
+
+            output = slices;
+        }
+
+        if (output->empty())
+            return;
+
+        // hand the slices over through the inbox; if a drain is already
+        // on its way, it will pick these up too
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex);
+            inbox.insert(inbox.end(), output->begin(), output->end());
+            if (inbox_pending)
+                return;
+            inbox_pending = true;
+        }
+
+        // with a single thread this normally runs immediately
+        strand.dispatch(helpers::make_alloc_handler(inbox_memory, std::bind(&SocketOutput::drain_inbox, shared_from_this())));
+    }
+
+    void SocketOutput::drain_inbox() {
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex);
+            draining.swap(inbox);
+            inbox_pending = false;
+        }
+
+        queue_output(draining);
+        draining.clear();
+    }
+
+    // Identifies messages that supersede each other for conflation: the
+    // sender's address, the DF, and for extended squitter the type code
+    // (and CPR format, so that both halves of a position survive).
+    static std::uint64_t conflation_key(const modes::Message &message) {
+        auto data = message.data();
+        std::uint64_t type = (std::uint64_t)message.type();
+        int df = message.df();
+
+        std::uint32_t address = 0;
+        std::uint32_t subtype = 0;
+        switch (df) {
+        case -1:
+            // Mode A/C replies are keyed by their code; there is only
+            // one current status or position message
+            if (message.type() == modes::MessageType::MODE_AC)
+                address = (data[0] << 8) | data[1];
+            break;
+
+        case 17:
+        case 18: {
+            address = (data[1] << 16) | (data[2] << 8) | data[3];
+            unsigned typecode = data[4] >> 3;
+            subtype = typecode << 1;
+            if ((typecode >= 5 && typecode <= 18) || (typecode >= 20 && typecode <= 22))
+                subtype |= (data[6] >> 2) & 1;
+            break;
+        }
+
+        case 11:
+            address = (data[1] << 16) | (data[2] << 8) | data[3];
+            break;
+
+        default:
+            // address/parity overlaid on the CRC
+            address = crc::message_residual(data);
+            break;
+        }
+
+        return (type << 40) | ((std::uint64_t)(df & 0xFF) << 32) | ((std::uint64_t)subtype << 24) | address;
+    }
+
+    void SocketOutput::conflate(const modes::MessageBatch &batch) {
+        if (closed)
+            return; // closed while this was on its way here
+
+        for (const auto &message : batch) {
+            auto i = conflation_index.find(conflation_key(message));
+            if (i == conflation_index.end()) {
+                conflation_index.emplace(conflation_key(message), conflated.size());
+                conflated.push_back(message);
+            } else {
+                conflated[i->second] = message;
+                ++conflated_messages;
+            }
+        }
+
+        // if nothing is being written, this can go straight out;
+        // otherwise, it waits for the write to finish
+        if (!flush_pending && enqueue_conflated())
+            schedule_flush();
+    }
+
+    // Encodes and queues the latest message for each key, oldest first.
+    // Returns false if the connection was closed.
+    bool SocketOutput::enqueue_conflated() {
+        if (conflated.empty())
+            return true;
+
+        Settings current;
+        {
+            std::lock_guard<std::mutex> lock(settings_mutex);
+            current = settings;
+        }
+
+        std::sort(conflated.begin(), conflated.end(), [](const modes::Message &a, const modes::Message &b) { return a.serial() < b.serial(); });
+        modes::FilterDistributor::MessageRefs refs;
+        refs.reserve(conflated.size());
+        for (const auto &message : conflated)
+            refs.push_back(&message);
+
+        SharedEncodings::Slices encoded;
+        if (current.length_prefixed)
+            encode_prefixed(encoded, current, refs, false);
+        else
+            encode_batch(encoded, current, refs);
+
+        conflated.clear();
+        conflation_index.clear();
+
+        for (const auto &slice : encoded) {
+            if (!enqueue(slice))
+                return false;
+        }
+        return true;
+    }
+
+    // Encodes messages for everything but the length-prefixed format.
+    //
+    // Frames that the client would get byte-for-byte as they arrived are
+    // copied from the input's read buffer rather than re-encoded, and a
+    // run of them that sat back to back in that buffer (often the whole
+    // read) is copied in one go.
+    void SocketOutput::encode_batch(SharedEncodings::Slices &encoded, const Settings &settings, const modes::FilterDistributor::MessageRefs &messages) {
+        SharedEncodings &shared = shared_encodings();
+        for (std::size_t i = 0; i < messages.size();) {
+            std::uint8_t *out = shared.reserve();
+            auto raw = messages[i]->raw();
+            if (raw.empty() || !encode::passthrough(settings, *messages[i])) {
+                shared.commit(encoded, write_one(out, settings, *messages[i]) - out);
+                ++i;
+                continue;
+            }
+
+            // a slice must hold whole frames, so stop at the end of the chunk
+            const std::uint8_t *begin = raw.data();
+            const std::uint8_t *end = begin + raw.size();
+            std::size_t space = shared.space();
+            std::uint32_t count = 1;
+            for (++i; i < messages.size(); ++i, ++count) {
+                auto next = messages[i]->raw();
+                if (next.data() != end || (std::size_t)(end + next.size() - begin) > space || !encode::passthrough(settings, *messages[i]))
+                    break;
+                end += next.size();
+            }
+
+            std::memcpy(out, begin, end - begin);
+            shared.commit(encoded, end - begin, count);
+        }
+    }
+
+    // As encode_batch, but for the length-prefixed format, where every
+    // slice starts with a batch header giving the number of frames in
+    // it. A slice is then self-contained, so the queue can still drop
+    // or write whole slices without the reader losing its place.
+    //
+    // With link_headers, the headers are link protocol batch headers,
+    // which also give the serial of the last message in the slice.
+    void SocketOutput::encode_prefixed(SharedEncodings::Slices &encoded, const Settings &settings, const modes::FilterDistributor::MessageRefs &messages, bool link_headers) {
+        SharedEncodings &shared = shared_encodings();
+        const std::size_t header_size = (link_headers ? encode::link_header_size : encode::batch_header_size);
+        std::uint8_t *header = nullptr;
+        std::uint8_t *next = nullptr;
+        std::uint32_t count = 0;
+        std::uint64_t last_serial = 0;
+
+        auto finish_header = [&]() {
+            if (link_headers)
+                encode::link_batch_header(header, count, last_serial);
+            else
+                encode::batch_header(header, count);
+        };
+
+        for (auto message : messages) {
+            std::uint8_t *out = shared.reserve(header_size + encode::max_frame_size());
+            if (out != next) {
+                // not following on from the last frame, so a new slice
+                if (header)
+                    finish_header();
+
+                header = out;
+                count = 0;
+                out += header_size;
+                shared.commit(encoded, header_size, 0);
+            }
+
+            next = write_one(out, settings, *message);
+            shared.commit(encoded, next - out);
+            if (next != out) {
+                ++count;
+                last_serial = message->serial();
+            }
+        }
+
+        // nobody else has seen these bytes yet, so the headers can
+        // still be filled in
+        if (header)
+            finish_header();
+    }
+
+    void SocketOutput::write_link_hello(std::uint8_t flags, std::uint32_t replayed, std::uint64_t epoch) {
+        SharedEncodings &shared = shared_encodings();
+        SharedEncodings::Slices hello;
+        std::uint8_t *out = shared.reserve(encode::link_header_size);
+        shared.commit(hello, encode::link_hello(out, flags, replayed, epoch) - out, 0);
+        queue_output(hello);
+    }
+
+    void SocketOutput::queue_output(const SharedEncodings::Slices &slices) {
+        if (closed)
+            return; // closed while this was on its way here
+
+        for (const auto &slice : slices) {
+            if (!enqueue(slice))
+                return; // disconnected
+        }
+
+        schedule_flush();
+    }
+
+    std::uint8_t *SocketOutput::write_one(std::uint8_t *out, const Settings &settings, const modes::Message &message) {
+        if (!encode::representable(settings, message))
+            return out;
+
+        // clients with different settings often still want exactly the
+        // same bytes for a given message (e.g. R vs RG for a message that
+        // already has GPS timestamps), so check the cache first
+        EncodeCache &cache = encode_cache();
+        std::uint32_t variant = 0;
+        if (message.serial() != 0) {
+            variant = encode::variant(settings, message);
+            auto cached = cache.lookup(message.serial(), variant);
+            if (!cached.empty()) {
+                std::memcpy(out, cached.data(), cached.size());
+                return out + cached.size();
+            }
         }
+
+        std::uint8_t *end = encode::message(out, settings, message);
+
+        if (message.serial() != 0)
+            cache.store(message.serial(), variant, helpers::bytespan(out, end - out));
+        return end;
     }
 
-    void SocketOutput::prepare_write() {
-        if (!outbuf) {
-            outbuf = std::make_shared<helpers::bytebuf>();
-            outbuf->reserve(read_buffer_size);
+    // Adds a slice of encoded output to the queue, applying the overflow
+    // policy if that would take us over the high-water mark. Returns
+    // false if the connection was closed.
+    bool SocketOutput::enqueue(const helpers::ChunkSlice &slice) {
+        if (options.max_queue > 0 && queued_bytes + slice.length > options.max_queue) {
+            switch (options.overflow) {
+            case OutputOptions::OverflowPolicy::DROP_NEWEST:
+                note_dropped(slice.messages);
+                return true;
+
+            case OutputOptions::OverflowPolicy::DROP_OLDEST: {
+                queue.push_back(slice);
+                queued_bytes += slice.length;
+
+                // Discard whole slices from the front until we are well
+                // under the limit, so we don't end up doing this on every
+                // message.
+                std::size_t target = options.max_queue - options.max_queue / 4;
+                std::size_t dropped = 0;
+                while (queued_bytes > target && !queue.empty()) {
+                    dropped += queue.front().messages;
+                    queued_bytes -= queue.front().length;
+                    queue.pop_front();
+                }
+                note_dropped(dropped);
+                return true;
+            }
+
+            case OutputOptions::OverflowPolicy::DISCONNECT:
+                std::cerr << peer << ": output queue exceeded " << options.max_queue << " bytes, disconnecting slow client" << std::endl;
+                close();
+                return false;
+            }
         }
+
+        queue.push_back(slice);
+        queued_bytes += slice.length;
+        return true;
     }
 
-    void SocketOutput::complete_write() {
-        if (!flush_pending && !outbuf->empty()) {
-            flush_pending = true;
-            service.post(std::bind(&SocketOutput::flush_outbuf, shared_from_this()));
+    void SocketOutput::note_dropped(std::size_t count) {
+        if (!overflowing) {
+            std::cerr << peer << ": output queue exceeded " << options.max_queue << " bytes, dropping messages" << std::endl;
+            overflowing = true;
         }
+
+        dropped_messages += count;
     }
 
-    void SocketOutput::flush_outbuf() {
-        if (!outbuf || outbuf->empty())
+    void SocketOutput::schedule_flush() {
+        if (flush_pending || queue.empty())
             return;
 
-        std::shared_ptr<helpers::bytebuf> writebuf;
-        writebuf.swap(outbuf);
+        flush_pending = true;
+        if (options.profile == OutputOptions::FlushProfile::BULK) {
+            // let output build up for a while
+            auto self(shared_from_this());
+            flush_timer.expires_from_now(options.flush_window);
+            flush_timer.async_wait(strand.wrap([this, self](const boost::system::error_code &ec) {
+                if (!ec)
+                    flush_queue();
+            }));
+        } else {
+            // write at the end of this pass, along with everyone else
+            asio::use_service<FlushCoordinator>(service).schedule(shared_from_this());
+        }
+    }
+
+    void SocketOutput::flush_queue() {
+        helpers::alloc_trace::Scope trace(helpers::alloc_trace::Tag::FLUSH);
+        if (closed || queue.empty()) {
+            flush_pending = false;
+            return;
+        }
+
+        // hand everything queued to a single gathered write; in packet
+        // mode, only as much as fits in one packet
+        std::size_t count = queue.size();
+        std::size_t bytes = queued_bytes;
+        if (packet_mode) {
+            count = 0;
+            bytes = 0;
+            while (count < queue.size() && count < max_packet_buffers && (count == 0 || bytes + queue[count].length <= max_packet_size))
+                bytes += queue[count++].length;
+        }
+
+        writing.assign(std::make_move_iterator(queue.begin()), std::make_move_iterator(queue.begin() + count));
+        queue.erase(queue.begin(), queue.begin() + count);
+        queued_bytes -= bytes;
+
+        write_buffers.clear();
+        if (compressor) {
+            // one flush per write, so the reader can always decode
+            // everything it has been sent
+            compressed.clear();
+            for (const auto &slice : writing)
+                compressor->compress(helpers::bytespan(slice.data(), slice.length), compressed);
+            compressor->flush(compressed);
+            writing.clear();
+            write_buffers.push_back(asio::buffer(compressed));
+        } else {
+            for (const auto &slice : writing)
+                write_buffers.push_back(asio::buffer(slice.data(), slice.length));
+        }
 
         auto self(shared_from_this());
-        async_write(socket, boost::asio::buffer(*writebuf), [this, self, writebuf](const boost::system::error_code &ec, size_t len) {
+        auto handler = strand.wrap(helpers::make_alloc_handler(write_memory, [this, self](const boost::system::error_code &ec, size_t len) {
             // NB: we only reset the pending flag here,
             // because async_write is a composed operation
             // that might take a while to complete, and
             // if we do another write before it completes
             // then it might interleave data.
+            helpers::alloc_trace::Scope trace(helpers::alloc_trace::Tag::FLUSH);
             flush_pending = false;
+            uring_write = 0;
+            writing.clear();
+            compressed.clear();
+
+            if (ec) {
+                handle_error(ec);
+                return;
+            }
 
-            if (!outbuf) {
-                writebuf->clear();
-                outbuf = writebuf;
+            if (overflowing && queued_bytes <= options.max_queue / 2) {
+                std::cerr << peer << ": output queue drained, " << dropped_messages << " messages dropped so far" << std::endl;
+                overflowing = false;
             }
 
-            if (ec)
-                handle_error(ec);
-        });
+            // with conflate=on, whatever survived while that write was
+            // in progress goes out now
+            if (!enqueue_conflated())
+                return;
+
+            // anything queued while that write was in progress
+            // won't otherwise be sent until the next message arrives
+            if (!queue.empty()) {
+                if (options.profile == OutputOptions::FlushProfile::BULK) {
+                    schedule_flush();
+                } else {
+                    flush_pending = true;
+                    flush_queue();
+                }
+            }
+        }));
+
+        if (zerocopy && !compressor && bytes >= zerocopy_threshold) {
+            zerocopy_send(handler, 0);
+        } else if (uring) {
+            // batched with everyone else's writes from this pass
+            uring_write = uring->async_write(socket.native_handle(), write_buffers, !packet_mode, handler);
+        } else if (packet_mode) {
+            // a single sendmsg(), so the packet boundary is where we want it
+            socket.async_send(BufferView(write_buffers), handler);
+        } else {
+            async_write(socket, BufferView(write_buffers), handler);
+        }
     }
 
-    static inline void push_back_beast(helpers::bytebuf &v, std::uint8_t b) {
-        if (b == 0x1A)
-            v.push_back(0x1A);
-        v.push_back(b);
+    // As async_write, but with MSG_ZEROCOPY: the kernel sends straight
+    // from the chunks rather than copying them first. Each send that
+    // succeeds gets the next id from the kernel; once the write is done,
+    // its chunks are kept in zerocopy_retained until the error queue
+    // says that the kernel has finished with that id.
+    void SocketOutput::zerocopy_send(std::function<void(const boost::system::error_code &, std::size_t)> handler, std::size_t sent) {
+        auto self(shared_from_this());
+        zerocopy_writing = true;
+        socket.async_send(BufferView(write_buffers), MSG_ZEROCOPY, strand.wrap([this, self, handler, sent](const boost::system::error_code &ec, std::size_t len) {
+            if (ec == asio::error::no_buffer_space) {
+                // over the socket's limit on pinned memory; copy the
+                // rest of this write instead
+                async_write(socket, BufferView(write_buffers), strand.wrap([this, self, handler, sent](const boost::system::error_code &ec, std::size_t len) {
+                    zerocopy_writing = false;
+                    if (sent > 0)
+                        retain_zerocopy();
+                    else
+                        reap_zerocopy();
+                    handler(ec, sent + len);
+                }));
+                return;
+            }
+
+            if (!ec) {
+                ++zerocopy_next;
+
+                // step over what was sent and carry on with the rest
+                std::size_t left = len;
+                while (left > 0 && !write_buffers.empty()) {
+                    if (left >= write_buffers.front().size()) {
+                        left -= write_buffers.front().size();
+                        write_buffers.erase(write_buffers.begin());
+                    } else {
+                        write_buffers.front() += left;
+                        left = 0;
+                    }
+                }
+
+                if (!write_buffers.empty() && !closed) {
+                    zerocopy_send(handler, sent + len);
+                    return;
+                }
+            }
+
+            zerocopy_writing = false;
+            if (sent > 0 || !ec)
+                retain_zerocopy();
+            else
+                reap_zerocopy();
+            handler(ec, sent + len);
+        }));
     }
 
-    void SocketOutput::write_binary(modes::MessageType type, std::uint64_t timestamp, std::uint8_t signal, const helpers::bytebuf &data) {
-        prepare_write();
-        outbuf->push_back(0x1A);
-        outbuf->push_back(messagetype_to_byte(type));
+    // Keeps the chunks of the write that just finished until the kernel
+    // has finished with its last send.
+    void SocketOutput::retain_zerocopy() {
+        zerocopy_retained.emplace_back(zerocopy_next - 1, std::move(writing));
+        writing.clear();
+        reap_zerocopy();
+        wait_for_zerocopy();
+    }
 
-        if (type != modes::MessageType::POSITION) {
-            push_back_beast(*outbuf, (timestamp >> 40) & 0xFF);
-            push_back_beast(*outbuf, (timestamp >> 32) & 0xFF);
-            push_back_beast(*outbuf, (timestamp >> 24) & 0xFF);
-            push_back_beast(*outbuf, (timestamp >> 16) & 0xFF);
-            push_back_beast(*outbuf, (timestamp >> 8) & 0xFF);
-            push_back_beast(*outbuf, timestamp & 0xFF);
-            push_back_beast(*outbuf, signal);
+    // Collects completion notifications from the socket's error queue,
+    // and lets go of the chunks of the writes that they cover.
+    void SocketOutput::reap_zerocopy() {
+        int fd = socket.native_handle();
+        for (;;) {
+            char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+            struct msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+                break; // EAGAIN once the queue is empty
+
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                    continue;
+
+                struct sock_extended_err err;
+                std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                    continue;
+
+                // ee_info..ee_data is a range of completed ids; on TCP
+                // they complete in order, so this covers everything
+                // up to ee_data
+                zerocopy_done = err.ee_data + 1;
+
+                if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && zerocopy) {
+                    // e.g. loopback, or a NIC that can't gather
+                    std::cerr << peer << ": the kernel is copying zero-copy sends anyway, using normal sends" << std::endl;
+                    zerocopy = false;
+                }
+            }
         }
 
-        for (auto b : data)
-            push_back_beast(*outbuf, b);
+        while (!zerocopy_retained.empty() && (std::int32_t)(zerocopy_retained.front().first - zerocopy_done) < 0)
+            zerocopy_retained.pop_front();
 
-        complete_write();
+        if (closed && zerocopy_retained.empty() && !zerocopy_writing && socket.is_open()) {
+            // the kernel has finished with everything; see close()
+            flush_timer.cancel();
+            socket.close();
+        }
     }
 
-    // we could use ostrstream here, I guess, but this is simpler
+    // Notifications arrive as POLLERR on the socket. They are also
+    // collected after every zero-copy write, which catches any that
+    // arrived while we were not waiting.
+    void SocketOutput::wait_for_zerocopy() {
+        if (zerocopy_waiting || zerocopy_retained.empty() || !socket.is_open())
+            return;
+
+        zerocopy_waiting = true;
+        auto self(shared_from_this());
+        socket.async_wait(asio::socket_base::wait_error, strand.wrap([this, self](const boost::system::error_code &ec) {
+            zerocopy_waiting = false;
+            if (ec)
+                return;
 
-    static inline void push_back_hex(helpers::bytebuf &v, std::uint8_t b) {
-        static const char *hexdigits = "0123456789ABCDEF";
-        v.push_back((std::uint8_t)hexdigits[(b >> 4) & 0x0F]);
-        v.push_back((std::uint8_t)hexdigits[b & 0x0F]);
+            reap_zerocopy();
+            wait_for_zerocopy();
+        }));
     }
 
-    void SocketOutput::write_avr(const helpers::bytebuf &data) {
-        prepare_write();
+    // After close(), waits for the kernel to finish with our chunks. The
+    // error queue is also checked every zerocopy_drain_poll, in case a
+    // wakeup was missed; if the client has not acknowledged the data by
+    // zerocopy_drain_timeout, the connection is reset, which drops
+    // whatever the kernel still had queued.
+    void SocketOutput::drain_zerocopy() {
+        if (!socket.is_open())
+            return;
 
-        outbuf->push_back((std::uint8_t)'*');
-        for (auto b : data)
-            push_back_hex(*outbuf, b);
-        outbuf->push_back((std::uint8_t)';');
-        outbuf->push_back((std::uint8_t)'\n');
+        wait_for_zerocopy();
 
-        complete_write();
-    }
+        auto self(shared_from_this());
+        flush_timer.expires_from_now(zerocopy_drain_poll);
+        flush_timer.async_wait(strand.wrap([this, self](const boost::system::error_code &ec) {
+            if (ec || !socket.is_open())
+                return;
 
-    void SocketOutput::write_avrmlat(std::uint64_t timestamp, const helpers::bytebuf &data) {
-        prepare_write();
+            reap_zerocopy();
+            if (!socket.is_open())
+                return;
 
-        outbuf->push_back((std::uint8_t)'@');
-        push_back_hex(*outbuf, (timestamp >> 40) & 0xFF);
-        push_back_hex(*outbuf, (timestamp >> 32) & 0xFF);
-        push_back_hex(*outbuf, (timestamp >> 24) & 0xFF);
-        push_back_hex(*outbuf, (timestamp >> 16) & 0xFF);
-        push_back_hex(*outbuf, (timestamp >> 8) & 0xFF);
-        push_back_hex(*outbuf, timestamp & 0xFF);
-        for (auto b : data)
-            push_back_hex(*outbuf, b);
-        outbuf->push_back((std::uint8_t)';');
-        outbuf->push_back((std::uint8_t)'\n');
+            if (std::chrono::steady_clock::now() < zerocopy_deadline) {
+                drain_zerocopy();
+                return;
+            }
 
-        complete_write();
+            std::cerr << peer << ": gave up waiting for zero-copy sends to complete, resetting the connection" << std::endl;
+            boost::system::error_code ignored;
+            socket.set_option(asio::socket_base::linger(true, 0), ignored);
+            socket.close(ignored);
+            zerocopy_retained.clear();
+        }));
     }
 
     void SocketOutput::handle_error(const boost::system::error_code &ec) {
+        if (closed)
+            return; // e.g. a write failing after close() shut the socket down
+
         if (ec == boost::asio::error::eof) {
             std::cerr << peer << ": connection closed" << std::endl;
         } else if (ec != boost::asio::error::operation_aborted) {
@@ -311,20 +1486,61 @@ namespace beast {
     }
 
     void SocketOutput::close() {
-        socket.close();
+        if (closed)
+            return; // already closed
+
+        if (dropped_messages > 0)
+            std::cerr << peer << ": " << dropped_messages << " messages were dropped due to a full output queue" << std::endl;
+        if (conflated_messages > 0)
+            std::cerr << peer << ": " << conflated_messages << " messages were replaced by newer ones while the connection was busy" << std::endl;
+        if (compressor && compressor->raw_bytes() > 0) {
+            std::uint64_t permille = compressor->compressed_bytes() * 1000 / compressor->raw_bytes();
+            std::cerr << peer << ": " << compression::name(options.compress) << " compressed " << compressor->raw_bytes() << " bytes to " << compressor->compressed_bytes() << " (" << permille / 10 << "." << permille % 10 << "%)" << std::endl;
+        }
+
+        closed = true;
+        flush_timer.cancel();
+        if (uring_write) {
+            // the ring must let go of the fd before it can be reused
+            uring->cancel(uring_write);
+            uring_write = 0;
+        }
+        if (zerocopy_retained.empty() && !zerocopy_writing) {
+            socket.close();
+        } else {
+            // The kernel may still be sending straight from some of our
+            // chunks, and they can't go back to the pool until it says
+            // that it has finished with them, which it can only tell us
+            // through this socket. Shut the connection down, so that the
+            // client sees it closed and nothing more is read or sent,
+            // and keep the socket until reap_zerocopy() has seen the
+            // last of them complete.
+            boost::system::error_code ignored;
+            socket.shutdown(socket_type::shutdown_both, ignored);
+            zerocopy_deadline = std::chrono::steady_clock::now() + zerocopy_drain_timeout;
+            drain_zerocopy();
+        }
         if (close_notifier)
             close_notifier();
     }
 
     //////////////
 
-    SocketListener::SocketListener(asio::io_service &service_, const tcp::endpoint &endpoint_, modes::FilterDistributor &distributor_, const Settings &initial_settings_) : service(service_), acceptor(service_), endpoint(endpoint_), socket(service_), distributor(distributor_), initial_settings(initial_settings_) {}
+    SocketListener::SocketListener(asio::io_service &service_, const tcp::endpoint &endpoint_, modes::FilterDistributor &distributor_, const Settings &initial_settings_, const OutputOptions &options_) : service(service_), acceptor(service_), endpoint(endpoint_), socket(service_), distributor(distributor_), initial_settings(initial_settings_), options(options_), pinned_worker(-1), reuse_port(false) {}
 
     void SocketListener::start() {
         acceptor.open(endpoint.protocol());
         acceptor.set_option(asio::socket_base::reuse_address(true));
         acceptor.set_option(tcp::acceptor::reuse_address(true));
 
+        if (reuse_port) {
+#ifdef SO_REUSEPORT
+            acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+            throw boost::system::system_error(asio::error::operation_not_supported, "SO_REUSEPORT");
+#endif
+        }
+
         // We are v6 aware and bind separately to v4 and v6 addresses
         if (endpoint.protocol() == tcp::v6())
             acceptor.set_option(asio::ip::v6_only(true));
@@ -345,19 +1561,78 @@ namespace beast {
         acceptor.async_accept(socket, peer, [this, self](const boost::system::error_code &ec) {
             if (!ec) {
                 std::cerr << endpoint << ": accepted a connection from " << peer << " with settings " << initial_settings << std::endl;
-                SocketOutput::pointer new_output = SocketOutput::create(service, std::move(socket), initial_settings);
+                if (link)
+                    SocketOutput::attach_link(service, std::move(socket), to_string(peer), link, initial_settings, options);
+                else if (workers && pinned_worker >= 0)
+                    workers->attach((unsigned)pinned_worker, std::move(socket), to_string(peer), initial_settings, options, nullptr);
+                else if (workers)
+                    workers->attach(std::move(socket), to_string(peer), initial_settings, options, nullptr);
+                else
+                    SocketOutput::attach(service, std::move(socket), to_string(peer), distributor, initial_settings, options, nullptr);
+            } else {
+                if (ec == boost::system::errc::operation_canceled)
+                    return;
+                std::cerr << endpoint << ": accept error: " << ec.message() << std::endl;
+            }
+
+            accept_connection();
+        });
+    }
+
+    //////////////
 
-                modes::FilterDistributor::handle h = distributor.add_client(std::bind(&SocketOutput::write, new_output, std::placeholders::_1), initial_settings.to_filter());
+    UnixSocketListener::UnixSocketListener(asio::io_service &service_, const std::string &path_, bool seqpacket_, modes::FilterDistributor &distributor_, const Settings &initial_settings_, const OutputOptions &options_) : service(service_), acceptor(service_), path(path_), seqpacket(seqpacket_), socket(service_), distributor(distributor_), initial_settings(initial_settings_), options(options_), next_client(0) {}
 
-                new_output->set_settings_notifier([this, self, h](const Settings &newsettings) { distributor.update_client_filter(h, newsettings.to_filter()); });
+    void UnixSocketListener::start() {
+        asio::generic::stream_protocol::endpoint endpoint(asio::local::stream_protocol::endpoint(path.c_str()));
 
-                new_output->set_close_notifier([this, self, h] { distributor.remove_client(h); });
+        // a socket left behind by a previous run would stop us binding;
+        // don't remove anything that isn't a socket, though
+        struct stat st;
+        if (::lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            ::unlink(path.c_str());
+
+        if (seqpacket) {
+            // asio has no SOCK_SEQPACKET acceptor, but once the socket
+            // exists, accepting from it works the same way
+            int fd = ::socket(AF_UNIX, SOCK_SEQPACKET, 0);
+            if (fd < 0)
+                throw boost::system::system_error(errno, boost::system::system_category(), "socket");
+            acceptor.assign(endpoint.protocol(), fd);
+        } else {
+            acceptor.open(endpoint.protocol());
+        }
 
-                new_output->start();
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        accept_connection();
+    }
+
+    void UnixSocketListener::close() {
+        acceptor.cancel();
+        acceptor.close();
+        socket.close();
+        ::unlink(path.c_str());
+    }
+
+    void UnixSocketListener::accept_connection() {
+        auto self(shared_from_this());
+
+        acceptor.async_accept(socket, [this, self](const boost::system::error_code &ec) {
+            if (!ec) {
+                // local clients don't have useful addresses, so number them
+                std::ostringstream peer;
+                peer << path << "#" << ++next_client;
+
+                std::cerr << path << ": accepted connection " << peer.str() << " with settings " << initial_settings << std::endl;
+                if (workers)
+                    workers->attach(std::move(socket), peer.str(), initial_settings, options, nullptr);
+                else
+                    SocketOutput::attach(service, std::move(socket), peer.str(), distributor, initial_settings, options, nullptr);
             } else {
                 if (ec == boost::system::errc::operation_canceled)
                     return;
-                std::cerr << endpoint << ": accept error: " << ec.message() << std::endl;
+                std::cerr << path << ": accept error: " << ec.message() << std::endl;
             }
 
             accept_connection();
@@ -366,7 +1641,7 @@ namespace beast {
 
     //////////////
 
-    SocketConnector::SocketConnector(asio::io_service &service_, const std::string &host_, const std::string &port_or_service_, modes::FilterDistributor &distributor_, const Settings &initial_settings_) : service(service_), resolver(service_), socket(service_), reconnect_timer(service_), host(host_), port_or_service(port_or_service_), distributor(distributor_), initial_settings(initial_settings_), running(false) {}
+    SocketConnector::SocketConnector(asio::io_service &service_, const std::string &host_, const std::string &port_or_service_, modes::FilterDistributor &distributor_, const Settings &initial_settings_, const OutputOptions &options_) : service(service_), strand(service_), resolver(service_), socket(service_), reconnect_timer(service_), host(host_), port_or_service(port_or_service_), distributor(distributor_), initial_settings(initial_settings_), options(options_), running(false) {}
 
     void SocketConnector::start() {
         running = true;
@@ -393,7 +1668,7 @@ namespace beast {
         auto self(shared_from_this());
 
         tcp::resolver::query query(host, port_or_service);
-        resolver.async_resolve(query, [this, self](const boost::system::error_code &ec, tcp::resolver::iterator it) {
+        resolver.async_resolve(query, strand.wrap([this, self](const boost::system::error_code &ec, tcp::resolver::iterator it) {
             if (!ec) {
                 next_endpoint = it;
                 try_next_endpoint();
@@ -404,7 +1679,7 @@ namespace beast {
                 schedule_reconnect();
                 return;
             }
-        });
+        }));
     }
 
     void SocketConnector::try_next_endpoint() {
@@ -421,7 +1696,7 @@ namespace beast {
         tcp::endpoint endpoint = *next_endpoint++;
 
         auto self(shared_from_this());
-        socket.async_connect(endpoint, [this, self, endpoint](const boost::system::error_code &ec) {
+        socket.async_connect(endpoint, strand.wrap([this, self, endpoint](const boost::system::error_code &ec) {
             if (!ec) {
                 connection_established(endpoint);
             } else if (ec == boost::asio::error::operation_aborted) {
@@ -431,7 +1706,7 @@ namespace beast {
                 socket.close();
                 try_next_endpoint();
             }
-        });
+        }));
     }
 
     void SocketConnector::schedule_reconnect() {
@@ -440,7 +1715,7 @@ namespace beast {
 
             auto self(shared_from_this());
             reconnect_timer.expires_from_now(reconnect_interval);
-            reconnect_timer.async_wait(std::bind(&SocketConnector::resolve_and_connect, self, std::placeholders::_1));
+            reconnect_timer.async_wait(strand.wrap(std::bind(&SocketConnector::resolve_and_connect, self, std::placeholders::_1)));
         }
     }
 
@@ -448,17 +1723,11 @@ namespace beast {
         auto self(shared_from_this());
 
         std::cerr << host << ":" << port_or_service << ": connected to " << endpoint << " with settings " << initial_settings << std::endl;
-        SocketOutput::pointer new_output = SocketOutput::create(service, std::move(socket), initial_settings);
-
-        modes::FilterDistributor::handle h = distributor.add_client(std::bind(&SocketOutput::write, new_output, std::placeholders::_1), initial_settings.to_filter());
-
-        new_output->set_settings_notifier([this, self, h](const Settings &newsettings) { distributor.update_client_filter(h, newsettings.to_filter()); });
-
-        new_output->set_close_notifier([this, self, h] {
-            distributor.remove_client(h);
-            schedule_reconnect();
-        });
 
-        new_output->start();
+        auto reconnect = [this, self] { strand.dispatch(std::bind(&SocketConnector::schedule_reconnect, self)); };
+        if (workers)
+            workers->attach(std::move(socket), to_string(endpoint), initial_settings, options, reconnect);
+        else
+            SocketOutput::attach(service, std::move(socket), to_string(endpoint), distributor, initial_settings, options, reconnect);
     }
 }; // namespace beast
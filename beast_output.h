@@ -28,39 +28,269 @@
 #ifndef BEAST_OUTPUT_H
 #define BEAST_OUTPUT_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <memory>
-
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio/basic_socket_acceptor.hpp>
+#include <boost/asio/generic/stream_protocol.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
 
+#include "beast_backlog.h"
+#include "beast_encode.h"
+#include "beast_link.h"
 #include "beast_settings.h"
+#include "beast_snapshot.h"
+#include "chunk_pool.h"
+#include "compression.h"
+#include "handler_memory.h"
 #include "modes_message.h"
+#include "uring_writer.h"
 
 namespace beast {
-    inline std::uint8_t messagetype_to_byte(modes::MessageType t) {
-        switch (t) {
-        case modes::MessageType::MODE_AC:
-            return 0x31;
-        case modes::MessageType::MODE_S_SHORT:
-            return 0x32;
-        case modes::MessageType::MODE_S_LONG:
-            return 0x33;
-        case modes::MessageType::STATUS:
-            return 0x34;
-        default:
-            return 0;
-        }
-    }
+    // Per-connection output options that are not Beast settings.
+    // These are given as a comma-separated list of key=value pairs
+    // following the settings in --listen / --connect.
+    struct OutputOptions {
+        // what to do when a connection's output queue exceeds max_queue
+        enum class OverflowPolicy { DROP_NEWEST, DROP_OLDEST, DISCONNECT };
+
+        // how eagerly to write output:
+        //   DEFAULT flushes once per input read, leaving the socket alone
+        //   LOW_LATENCY does the same, and also disables Nagle (TCP_NODELAY)
+        //   BULK waits for flush_window to accumulate larger writes, with TCP_CORK
+        enum class FlushProfile { DEFAULT, LOW_LATENCY, BULK };
+
+        // defaults: unbounded queue, system default TCP timeouts
+        OutputOptions();
+
+        // parse from a string like "queue=256k,overflow=drop-oldest";
+        // throws std::invalid_argument on anything unrecognized
+        OutputOptions(const std::string &str);
+
+        std::size_t max_queue;              // queue=N[k|m]: high-water mark for unsent output in bytes, 0 = unlimited
+        OverflowPolicy overflow;            // overflow=drop-newest|drop-oldest|disconnect
+        std::chrono::seconds keepalive;     // keepalive=N: enable TCP keepalive, probing after N seconds idle
+        std::chrono::seconds user_timeout;  // timeout=N: drop the connection if sent data is unacknowledged for N seconds
+        FlushProfile profile;               // profile=low-latency|bulk
+        std::chrono::milliseconds flush_window; // window=MS: how long bulk connections accumulate output before writing
+        Compression compress;               // compress=none|deflate|zstd: compress the stream (not in packet mode)
+
+        // UDP outputs only
+        std::size_t mtu;                    // mtu=N: largest datagram to send, including our header
+        unsigned multicast_ttl;             // ttl=N: hop limit for multicast datagrams
+
+        // shared-memory outputs only
+        std::size_t shm_records;            // records=N[k|m]: ring size in messages, rounded up to a power of two
+
+        // --listen only
+        bool link;                          // link=on|off: speak the link protocol to chained beast-splitters (see beast_link.h)
+        std::size_t link_replay;            // replay=N[k|m]: messages to keep for link clients that reconnect
+
+        // stream outputs only
+        bool backlog;                       // backlog=on|off: send recent history (see beast_backlog.h) before live data
+        bool conflate;                      // conflate=on|off: while a write is in progress, keep only the latest message per aircraft and kind
+        bool zerocopy;                      // zerocopy=on|off: send large writes with MSG_ZEROCOPY (TCP only)
+    };
+
+    std::ostream &operator<<(std::ostream &os, const OutputOptions &o);
+
+    // Caches the encoded form of recent messages, keyed by message serial
+    // and output variant (format, timestamp translation, FEC, status byte
+    // rewriting). The first client that needs a particular encoding of a
+    // message stores it here, and other clients with the same variant
+    // copy it rather than encoding the message again.
+    //
+    // This is direct-mapped and fixed-size; a collision just evicts the
+    // older entry.
+    //
+    // Each thread that encodes output has its own cache; the totals
+    // across all of them are available for reporting.
+    class EncodeCache {
+      public:
+        // large enough for the worst case of any of our output formats
+        static const std::size_t max_entry_size = 48;
+
+        // number of entries, must be a power of two
+        static const std::size_t num_entries = 4096;
+
+        EncodeCache();
+        ~EncodeCache();
+        EncodeCache(const EncodeCache &) = delete;
+        EncodeCache &operator=(const EncodeCache &) = delete;
+
+        // returns the cached encoding, or an empty span on a miss
+        helpers::bytespan lookup(std::uint64_t serial, std::uint32_t variant);
+        void store(std::uint64_t serial, std::uint32_t variant, helpers::bytespan encoded);
+
+        std::uint64_t hits() const { return hit_count.load(std::memory_order_relaxed); }
+        std::uint64_t misses() const { return miss_count.load(std::memory_order_relaxed); }
+
+        // summed over every cache, past and present
+        static std::uint64_t total_hits();
+        static std::uint64_t total_misses();
+
+      private:
+        struct entry {
+            std::uint64_t serial;
+            std::uint32_t variant;
+            std::uint8_t length;
+            std::array<std::uint8_t, max_entry_size> bytes;
+        };
+
+        static std::size_t index(std::uint64_t serial, std::uint32_t variant) { return (std::size_t)((serial * 0x9E3779B97F4A7C15ULL) ^ (variant * 0xC2B2AE3DULL)) & (num_entries - 1); }
+
+        struct registry;
+        static registry &all_caches();
+
+        std::vector<entry> entries;
+
+        // only ever updated by the owning thread, but may be read by others
+        std::atomic<std::uint64_t> hit_count;
+        std::atomic<std::uint64_t> miss_count;
+    };
+
+    // Encoded output for the batch of messages currently being
+    // distributed. Connections with identical settings produce identical
+    // bytes for a batch, so the first one to see the batch encodes it
+    // into shared chunks and the others just take references to the
+    // same slices, without copying anything.
+    //
+    // A batch is always distributed by a single thread, and each thread
+    // has its own instance of this, so it needs no locking.
+    class SharedEncodings {
+      public:
+        typedef std::vector<helpers::ChunkSlice> Slices;
+
+        // returns the encoded slices for this batch and settings,
+        // or nullptr if nobody has encoded it yet
+        const Slices *lookup(const modes::FilterDistributor::MessageRefs &messages, const Settings &settings);
+
+        // starts a new, empty entry for this batch and settings,
+        // to be filled in by append()
+        Slices &insert(const modes::FilterDistributor::MessageRefs &messages, const Settings &settings);
+
+        // returns space in the current chunk to encode a message into,
+        // with room for at least size bytes
+        std::uint8_t *reserve(std::size_t size = encode::max_frame_size());
+
+        // how many bytes can be written at the last reserve()
+        std::size_t space() const { return chunk->available(); }
+
+        // adds length bytes written at the last reserve() to the given
+        // slices, as the given number of encoded messages
+        void commit(Slices &slices, std::size_t length, std::uint32_t messages = 1);
+
+      private:
+        struct batch_key {
+            std::uint64_t first;
+            std::uint64_t last;
+            std::uint64_t hash;
+            std::size_t count;
+
+            bool operator==(const batch_key &other) const { return first == other.first && last == other.last && hash == other.hash && count == other.count; }
+        };
+
+        static batch_key key_of(const modes::FilterDistributor::MessageRefs &messages);
+
+        // entries beyond used are left over from earlier batches, kept
+        // so that their vectors can be reused without reallocating
+        batch_key current = {0, 0, 0, 0};
+        std::vector<std::pair<Settings, Slices>> entries;
+        std::size_t used = 0;
+        helpers::ChunkRef chunk;
+    };
+
+    class SocketOutput;
+    class OutputWorkers;
+
+    // Collects the outputs that have new data during one pass of the
+    // io_service and flushes them all from a single handler, rather than
+    // every output posting its own flush after every message. There is
+    // one of these per io_service.
+    //
+    // When the io_service is run by several threads, set_parallel(true)
+    // makes each flush a separate handler on the output's strand, so that
+    // the writes are spread across the threads.
+    class FlushCoordinator : public boost::asio::io_service::service {
+      public:
+        static boost::asio::io_service::id id;
+
+        explicit FlushCoordinator(boost::asio::io_service &owner);
+
+        // arrange for output->flush_queue() to be called at the end of
+        // the current pass
+        void schedule(std::shared_ptr<SocketOutput> output);
+
+        void set_parallel(bool parallel_) { parallel = parallel_; }
+
+      private:
+        void shutdown_service() override;
+        void flush_all();
+
+        boost::asio::io_service &service;
+        std::mutex mutex;
+        std::vector<std::shared_ptr<SocketOutput>> dirty;
+        bool pass_pending;
+        helpers::HandlerMemory flush_all_memory;
+        bool parallel;
+    };
 
+    // Sends Beast data to a connected stream socket, and accepts Beast
+    // settings commands from it. The socket can be TCP or a Unix domain
+    // stream socket; TCP sockets convert to socket_type implicitly.
     class SocketOutput : public std::enable_shared_from_this<SocketOutput> {
       public:
         typedef std::shared_ptr<SocketOutput> pointer;
+        typedef boost::asio::generic::stream_protocol::socket socket_type;
 
         const unsigned int read_buffer_size = 4096;
 
-        // factory method, this class must always be constructed via make_shared
-        static pointer create(boost::asio::io_service &service, boost::asio::ip::tcp::socket &&socket, const Settings &settings = Settings()) { return pointer(new SocketOutput(service, std::move(socket), settings)); }
+        // SOCK_SEQPACKET sockets are written in packet mode: every write
+        // is a single packet holding only complete messages, so the
+        // reader gets whole messages from every read. These limit how
+        // much goes in one packet.
+        static const std::size_t max_packet_buffers = 64;
+        static const std::size_t max_packet_size = 65536;
+
+        // SO_SNDBUF for conflate=on connections
+        static const int conflate_send_buffer = 16384;
+
+        // zerocopy=on connections only use MSG_ZEROCOPY for writes of at
+        // least this many bytes; below that, pinning the pages and
+        // handling the completion costs more than the copy it saves
+        static const std::size_t zerocopy_threshold = 16384;
+
+        // when a zerocopy=on connection is closed while the kernel still
+        // holds some of its chunks, how often to look for completions
+        // that we were not woken up for, and how long to wait for them
+        // before resetting the connection anyway
+        static const std::chrono::seconds zerocopy_drain_poll;
+        static const std::chrono::seconds zerocopy_drain_timeout;
+
+        // factory method, this class must always be constructed via make_shared;
+        // peer is a description of the other end, used in log messages
+        static pointer create(boost::asio::io_service &service, socket_type &&socket, const std::string &peer, const Settings &settings = Settings(), const OutputOptions &options = OutputOptions()) { return pointer(new SocketOutput(service, std::move(socket), peer, settings, options)); }
+
+        // creates and starts an output for a newly connected socket, fed
+        // from the given distributor; close_notifier, if set, is called
+        // after the output has removed itself from the distributor
+        static pointer attach(boost::asio::io_service &service, socket_type &&socket, const std::string &peer, modes::FilterDistributor &distributor, const Settings &settings, const OutputOptions &options, std::function<void()> close_notifier);
+
+        // creates and starts an output for a link protocol client; it is
+        // fed by link once the client has said where to resume from
+        static pointer attach_link(boost::asio::io_service &service, socket_type &&socket, const std::string &peer, LinkReplay::pointer link, const Settings &settings, const OutputOptions &options);
 
         void start();
         void close();
@@ -69,43 +299,165 @@ namespace beast {
 
         void set_close_notifier(std::function<void()> notifier) { close_notifier = notifier; }
 
+        // These are called from the input's strand. Messages are encoded
+        // there, and the encoded output is then handed over to this
+        // output's strand to be queued and written.
         void write(const modes::Message &message);
+        void write_batch(const modes::FilterDistributor::MessageRefs &messages);
+
+        // link protocol only; must be called on this output's strand
+        void write_link_hello(std::uint8_t flags, std::uint32_t replayed, std::uint64_t epoch);
+
+        bool is_closed() const { return closed; }
+
+        // the encode cache shared by all outputs on this thread
+        static EncodeCache &encode_cache();
+
+        // the encoded batches shared by all outputs on this thread
+        static SharedEncodings &shared_encodings();
 
       private:
-        SocketOutput(boost::asio::io_service &service_, boost::asio::ip::tcp::socket &&socket_, const Settings &settings_);
+        friend class FlushCoordinator;
+
+        SocketOutput(boost::asio::io_service &service_, socket_type &&socket_, const std::string &peer_, const Settings &settings_, const OutputOptions &options_);
+
+        void apply_socket_options();
 
         void read_commands();
-        void process_commands(std::vector<std::uint8_t> data);
+        void process_commands(helpers::bytespan data);
+        void process_resume_command();
+        void send_snapshot();
         void process_option_command(uint8_t option);
 
         void handle_error(const boost::system::error_code &ec);
 
-        void write_message(modes::MessageType type, modes::TimestampType timestamp_type, std::uint64_t timestamp, std::uint8_t signal, const helpers::bytebuf &data);
-
-        void write_binary(modes::MessageType type, std::uint64_t timestamp, std::uint8_t signal, const helpers::bytebuf &data);
+        void encode_and_queue(const modes::FilterDistributor::MessageRefs &messages);
+        void drain_inbox();
+        void conflate(const modes::MessageBatch &batch);
+        bool enqueue_conflated();
+        void write_backlog();
+
+        std::uint8_t *write_one(std::uint8_t *out, const Settings &settings, const modes::Message &message);
+        void encode_batch(SharedEncodings::Slices &encoded, const Settings &settings, const modes::FilterDistributor::MessageRefs &messages);
+        void encode_prefixed(SharedEncodings::Slices &encoded, const Settings &settings, const modes::FilterDistributor::MessageRefs &messages, bool link_headers);
+        void queue_output(const SharedEncodings::Slices &slices);
+
+        bool enqueue(const helpers::ChunkSlice &slice);
+        void note_dropped(std::size_t count);
+        void schedule_flush();
+        void flush_queue();
+        void zerocopy_send(std::function<void(const boost::system::error_code &, std::size_t)> handler, std::size_t sent);
+        void retain_zerocopy();
+        void reap_zerocopy();
+        void wait_for_zerocopy();
+        void drain_zerocopy();
 
-        void write_avrmlat(std::uint64_t timestamp, const helpers::bytebuf &data);
+        boost::asio::io_service &service;
+        boost::asio::io_service::strand strand;
+        socket_type socket;
+        std::string peer;
+        bool packet_mode;   // socket is SOCK_SEQPACKET
 
-        void write_avr(const helpers::bytebuf &data);
+        // set once close() has been called; checked from other threads
+        std::atomic<bool> closed;
 
-        void prepare_write();
-        void complete_write();
-        void flush_outbuf();
-
-        boost::asio::io_service &service;
-        boost::asio::ip::tcp::socket socket;
-        boost::asio::ip::tcp::endpoint peer;
+        // buffer for commands read from the client
+        std::array<std::uint8_t, 512> command_buffer;
 
         enum class ParserState;
         ParserState state;
 
+        // set for link protocol clients, along with the resume command
+        // being read from the client
+        LinkReplay::pointer link;
+        std::array<std::uint8_t, encode::link_resume_size - 2> resume_command;
+        std::size_t resume_length;
+
+        // settings are changed on our strand, but read when encoding
+        std::mutex settings_mutex;
         Settings settings;
+        OutputOptions options;
 
         std::function<void(const Settings &)> settings_notifier;
         std::function<void()> close_notifier;
 
-        std::shared_ptr<helpers::bytebuf> outbuf;
+        // encoded output waiting to be written, as references into
+        // chunks that may be shared with other connections
+        std::deque<helpers::ChunkSlice> queue;
+        std::size_t queued_bytes;
+
+        // encoded output handed over from the input's strand, waiting
+        // for drain_inbox() to queue it on ours. inbox_pending is set
+        // while a drain is on its way. The vectors keep their capacity,
+        // so a handover doesn't allocate once they have grown to size.
+        std::mutex inbox_mutex;
+        SharedEncodings::Slices inbox;
+        SharedEncodings::Slices draining;
+        SharedEncodings::Slices link_encoded;
+        bool inbox_pending;
+
+        // output handed to the current async_write; kept here so the
+        // chunks stay alive until the write completes
+        std::vector<helpers::ChunkSlice> writing;
+        std::vector<boost::asio::const_buffer> write_buffers;
         bool flush_pending;
+
+        // storage for the handlers of the operations that every
+        // connection repeats all the time, so that asio doesn't allocate
+        // for each one (see handler_memory.h)
+        helpers::HandlerMemory read_memory;
+        helpers::HandlerMemory inbox_memory;
+        helpers::HandlerMemory flush_memory;
+        helpers::HandlerMemory write_memory;
+
+        // with --io-uring, the writer for this io_service and the
+        // write in progress on it, if any
+        UringWriter *uring;
+        std::uint64_t uring_write;
+
+        // with zerocopy=on: whether MSG_ZEROCOPY is in use, whether a
+        // zero-copy write is in progress, the id the kernel will give our
+        // next zero-copy send, the ids it has told us are complete
+        // (everything before zerocopy_done), and the chunks of completed
+        // writes that it may still be reading from. After close(), the
+        // socket stays open until zerocopy_retained is empty or
+        // zerocopy_deadline has passed.
+        bool zerocopy;
+        bool zerocopy_writing;
+        bool zerocopy_waiting;
+        std::uint32_t zerocopy_next;
+        std::uint32_t zerocopy_done;
+        std::deque<std::pair<std::uint32_t, std::vector<helpers::ChunkSlice>>> zerocopy_retained;
+        std::chrono::steady_clock::time_point zerocopy_deadline;
+
+        // for bulk connections, fires at the end of the flush window
+        boost::asio::steady_timer flush_timer;
+
+        // for compressed connections, the compressor state and the
+        // compressed output handed to the current write
+        Compressor::pointer compressor;
+        helpers::bytebuf compressed;
+
+        // number of messages dropped because the output queue was full
+        std::uint64_t dropped_messages;
+        bool overflowing;
+
+        // with conflate=on: messages waiting for the current write to
+        // finish, at most one per conflation key, and the number that
+        // were replaced by a newer message before they could be sent
+        modes::MessageBatch conflated;
+        std::unordered_map<std::uint64_t, std::size_t> conflation_index;
+        std::uint64_t conflated_messages;
+
+        // with backlog=on: live messages are held while priming is set,
+        // until write_backlog has taken its snapshot; after that, live
+        // messages up to backlog_through that the backlog recorded are
+        // dropped, as they have already been sent
+        Backlog::pointer backlog;
+        std::atomic<bool> priming;
+        std::mutex priming_mutex;
+        modes::MessageBatch held;
+        std::uint64_t backlog_through;
     };
 
     class SocketListener : public std::enable_shared_from_this<SocketListener> {
@@ -113,13 +465,27 @@ namespace beast {
         typedef std::shared_ptr<SocketListener> pointer;
 
         // factory method, this class must always be constructed via make_shared
-        static pointer create(boost::asio::io_service &service, const boost::asio::ip::tcp::endpoint &endpoint, modes::FilterDistributor &distributor, const Settings &initial_settings) { return pointer(new SocketListener(service, endpoint, distributor, initial_settings)); }
+        static pointer create(boost::asio::io_service &service, const boost::asio::ip::tcp::endpoint &endpoint, modes::FilterDistributor &distributor, const Settings &initial_settings, const OutputOptions &options = OutputOptions()) { return pointer(new SocketListener(service, endpoint, distributor, initial_settings, options)); }
 
         void start();
         void close();
 
+        // run accepted connections on these workers rather than our own
+        // io_service; if pinned_worker is given, always use that worker
+        void set_workers(std::shared_ptr<OutputWorkers> workers_, int pinned_worker_ = -1) {
+            workers = workers_;
+            pinned_worker = pinned_worker_;
+        }
+
+        // open the acceptor with SO_REUSEPORT, so that several listeners
+        // can share the same endpoint
+        void set_reuse_port(bool reuse_port_) { reuse_port = reuse_port_; }
+
+        // accepted connections are link protocol clients, fed by link
+        void set_link(LinkReplay::pointer link_) { link = link_; }
+
       private:
-        SocketListener(boost::asio::io_service &service_, const boost::asio::ip::tcp::endpoint &endpoint_, modes::FilterDistributor &distributor, const Settings &initial_settings_);
+        SocketListener(boost::asio::io_service &service_, const boost::asio::ip::tcp::endpoint &endpoint_, modes::FilterDistributor &distributor, const Settings &initial_settings_, const OutputOptions &options_);
 
         void accept_connection();
 
@@ -130,6 +496,45 @@ namespace beast {
         boost::asio::ip::tcp::endpoint peer;
         modes::FilterDistributor &distributor;
         Settings initial_settings;
+        OutputOptions options;
+        std::shared_ptr<OutputWorkers> workers;
+        int pinned_worker;
+        bool reuse_port;
+        LinkReplay::pointer link;
+    };
+
+    // Like SocketListener, but accepts connections on a Unix domain
+    // socket. With seqpacket set, the socket is SOCK_SEQPACKET rather
+    // than SOCK_STREAM, and each packet sent to a client holds complete
+    // messages (see SocketOutput).
+    class UnixSocketListener : public std::enable_shared_from_this<UnixSocketListener> {
+      public:
+        typedef std::shared_ptr<UnixSocketListener> pointer;
+
+        // factory method, this class must always be constructed via make_shared
+        static pointer create(boost::asio::io_service &service, const std::string &path, bool seqpacket, modes::FilterDistributor &distributor, const Settings &initial_settings, const OutputOptions &options = OutputOptions()) { return pointer(new UnixSocketListener(service, path, seqpacket, distributor, initial_settings, options)); }
+
+        void start();
+        void close();
+
+        // run accepted connections on these workers rather than our own io_service
+        void set_workers(std::shared_ptr<OutputWorkers> workers_) { workers = workers_; }
+
+      private:
+        UnixSocketListener(boost::asio::io_service &service_, const std::string &path_, bool seqpacket_, modes::FilterDistributor &distributor, const Settings &initial_settings_, const OutputOptions &options_);
+
+        void accept_connection();
+
+        boost::asio::io_service &service;
+        boost::asio::basic_socket_acceptor<boost::asio::generic::stream_protocol> acceptor;
+        std::string path;
+        bool seqpacket;
+        SocketOutput::socket_type socket;
+        modes::FilterDistributor &distributor;
+        Settings initial_settings;
+        OutputOptions options;
+        std::shared_ptr<OutputWorkers> workers;
+        unsigned next_client;
     };
 
     class SocketConnector : public std::enable_shared_from_this<SocketConnector> {
@@ -139,13 +544,16 @@ namespace beast {
         const std::chrono::milliseconds reconnect_interval = std::chrono::seconds(60);
 
         // factory method, this class must always be constructed via make_shared
-        static pointer create(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, modes::FilterDistributor &distributor, const Settings &initial_settings) { return pointer(new SocketConnector(service, host, port_or_service, distributor, initial_settings)); }
+        static pointer create(boost::asio::io_service &service, const std::string &host, const std::string &port_or_service, modes::FilterDistributor &distributor, const Settings &initial_settings, const OutputOptions &options = OutputOptions()) { return pointer(new SocketConnector(service, host, port_or_service, distributor, initial_settings, options)); }
 
         void start();
         void close();
 
+        // run established connections on these workers rather than our own io_service
+        void set_workers(std::shared_ptr<OutputWorkers> workers_) { workers = workers_; }
+
       private:
-        SocketConnector(boost::asio::io_service &service_, const std::string &host_, const std::string &port_or_service_, modes::FilterDistributor &distributor, const Settings &initial_settings_);
+        SocketConnector(boost::asio::io_service &service_, const std::string &host_, const std::string &port_or_service_, modes::FilterDistributor &distributor, const Settings &initial_settings_, const OutputOptions &options_);
 
         void schedule_reconnect();
         void resolve_and_connect(const boost::system::error_code &ec = boost::system::error_code());
@@ -153,6 +561,7 @@ namespace beast {
         void connection_established(const boost::asio::ip::tcp::endpoint &endpoint);
 
         boost::asio::io_service &service;
+        boost::asio::io_service::strand strand;
         boost::asio::ip::tcp::resolver resolver;
         boost::asio::ip::tcp::socket socket;
         boost::asio::steady_timer reconnect_timer;
@@ -161,6 +570,8 @@ namespace beast {
         std::string port_or_service;
         modes::FilterDistributor &distributor;
         Settings initial_settings;
+        OutputOptions options;
+        std::shared_ptr<OutputWorkers> workers;
 
         bool running;
         boost::asio::ip::tcp::resolver::iterator next_endpoint;
@@ -0,0 +1,211 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <boost/system/system_error.hpp>
+
+#include "beast_encode.h"
+#include "beast_output_shm.h"
+
+namespace beast {
+    static_assert(sizeof(beast_shm_header) % 64 == 0, "shm header should be a whole number of cache lines");
+    static_assert(sizeof(beast_shm_record) == 64, "shm records should be one cache line");
+    static_assert(modes::max_payload_size <= BEAST_SHM_MAX_PAYLOAD, "shm payload is too small");
+
+    static boost::system::system_error errno_error(const std::string &what) { return boost::system::system_error(errno, boost::system::system_category(), what); }
+
+    ShmOutput::ShmOutput(const std::string &path_, modes::FilterDistributor &distributor_, const Settings &settings_, const OutputOptions &options_) : path(path_), distributor(distributor_), handle(0), settings(settings_), options(options_), running(false), header(nullptr), records(nullptr), mapped_size(0), mask(0), next(0) {}
+
+    ShmOutput::~ShmOutput() {
+        if (header)
+            ::munmap(header, mapped_size);
+    }
+
+    void ShmOutput::start() {
+        std::uint64_t capacity = 1;
+        while (capacity < options.shm_records)
+            capacity <<= 1;
+
+        mapped_size = sizeof(beast_shm_header) + capacity * sizeof(beast_shm_record);
+
+        // Build the new ring under a temporary name and rename it into
+        // place, so readers never see a partly initialized file.
+        std::string temppath = path + ".new";
+        ::unlink(temppath.c_str());
+        int fd = ::open(temppath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0)
+            throw errno_error("open " + temppath);
+
+        if (::ftruncate(fd, mapped_size) < 0) {
+            auto err = errno_error("ftruncate " + temppath);
+            ::close(fd);
+            ::unlink(temppath.c_str());
+            throw err;
+        }
+
+        void *mapping = ::mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            auto err = errno_error("mmap " + temppath);
+            ::unlink(temppath.c_str());
+            throw err;
+        }
+
+        // the file is zero-filled, so every record's lock already says
+        // "never written"
+        header = static_cast<beast_shm_header *>(mapping);
+        records = reinterpret_cast<beast_shm_record *>(header + 1);
+        mask = capacity - 1;
+
+        header->version = BEAST_SHM_VERSION;
+        header->header_size = sizeof(beast_shm_header);
+        header->record_size = sizeof(beast_shm_record);
+        header->capacity = capacity;
+        header->epoch = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        __atomic_store_n(&header->magic, BEAST_SHM_MAGIC, __ATOMIC_RELEASE);
+
+        retire_old_ring();
+        if (::rename(temppath.c_str(), path.c_str()) < 0) {
+            auto err = errno_error("rename " + temppath);
+            ::unlink(temppath.c_str());
+            throw err;
+        }
+
+        running = true;
+        handle = distributor.add_batch_client(std::bind(&ShmOutput::write_batch, shared_from_this(), std::placeholders::_1), settings.to_filter());
+    }
+
+    // Tell readers of any ring left by a previous run to reopen the file.
+    void ShmOutput::retire_old_ring() {
+        int fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0)
+            return;
+
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (std::size_t)st.st_size >= sizeof(beast_shm_header)) {
+            void *mapping = ::mmap(nullptr, sizeof(beast_shm_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapping != MAP_FAILED) {
+                beast_shm_header *old = static_cast<beast_shm_header *>(mapping);
+                if (__atomic_load_n(&old->magic, __ATOMIC_ACQUIRE) == BEAST_SHM_MAGIC) {
+                    __atomic_store_n(&old->closed, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+                    __atomic_add_fetch(&old->futex, 1, __ATOMIC_SEQ_CST);
+                    ::syscall(SYS_futex, &old->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+                }
+                ::munmap(mapping, sizeof(beast_shm_header));
+            }
+        }
+
+        ::close(fd);
+    }
+
+    void ShmOutput::close() {
+        if (!running)
+            return;
+
+        running = false;
+        distributor.remove_client(handle);
+
+        // leave the file in place so readers can see where we got to,
+        // but let them know nothing more is coming
+        __atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+        __atomic_add_fetch(&header->futex, 1, __ATOMIC_SEQ_CST);
+        ::syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    }
+
+    void ShmOutput::write_batch(const modes::FilterDistributor::MessageRefs &messages) {
+        if (!running)
+            return;
+
+        for (auto message : messages)
+            write_record(next++, *message);
+
+        __atomic_store_n(&header->next, next, __ATOMIC_RELEASE);
+
+        // only make the syscall if someone is actually asleep
+        __atomic_add_fetch(&header->futex, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+        if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST) > 0)
+            ::syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    }
+
+    void ShmOutput::write_record(std::uint64_t n, const modes::Message &message) {
+        beast_shm_record *r = &records[n & mask];
+
+        // seqlock: odd while we are writing, so a reader that copies the
+        // record while we're in here will see the lock change
+        __atomic_store_n(&r->lock, 2 * n + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        helpers::bytespan data = message.data();
+        std::uint8_t flags = 0;
+        if (message.crc_bad()) {
+            if (!settings.fec_disable && message.crc_correctable()) {
+                data = message.corrected_data();
+                flags |= BEAST_SHM_FLAG_CORRECTED;
+            } else {
+                flags |= BEAST_SHM_FLAG_CRC_BAD;
+            }
+        }
+
+        r->timestamp = message.timestamp();
+        r->type = messagetype_to_record_byte(message.type());
+        switch (message.timestamp_type()) {
+        case modes::TimestampType::TWELVEMEG:
+            r->timestamp_type = BEAST_SHM_TIMESTAMP_12MHZ;
+            break;
+        case modes::TimestampType::GPS:
+            r->timestamp_type = BEAST_SHM_TIMESTAMP_GPS;
+            break;
+        default:
+            r->timestamp_type = BEAST_SHM_TIMESTAMP_UNKNOWN;
+            break;
+        }
+        r->signal = message.signal();
+        r->length = (std::uint8_t)data.size();
+        r->flags = flags;
+        std::memcpy(r->payload, data.data(), data.size());
+
+        __atomic_store_n(&r->lock, 2 * n + 2, __ATOMIC_RELEASE);
+    }
+}; // namespace beast
@@ -0,0 +1,81 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BEAST_OUTPUT_SHM_H
+#define BEAST_OUTPUT_SHM_H
+
+#include <memory>
+#include <string>
+
+#include "beast_output.h"
+#include "beast_settings.h"
+#include "beast_shm.h"
+#include "modes_filter.h"
+
+namespace beast {
+    // Writes messages into a memory-mapped ring that local readers can
+    // map and read without any syscalls or copies on our side. The
+    // layout and the reader side are defined in beast_shm.h.
+    //
+    // The ring holds decoded messages, not Beast frames: settings only
+    // select which messages are written and whether FEC is applied.
+    // Timestamps are written as received.
+    class ShmOutput : public std::enable_shared_from_this<ShmOutput> {
+      public:
+        typedef std::shared_ptr<ShmOutput> pointer;
+
+        // factory method, this class must always be constructed via make_shared
+        static pointer create(const std::string &path, modes::FilterDistributor &distributor, const Settings &settings, const OutputOptions &options = OutputOptions()) { return pointer(new ShmOutput(path, distributor, settings, options)); }
+
+        ~ShmOutput();
+
+        // creates the ring, replacing any existing one at path
+        void start();
+        void close();
+
+      private:
+        ShmOutput(const std::string &path_, modes::FilterDistributor &distributor_, const Settings &settings_, const OutputOptions &options_);
+
+        void retire_old_ring();
+        void write_batch(const modes::FilterDistributor::MessageRefs &messages);
+        void write_record(std::uint64_t n, const modes::Message &message);
+
+        std::string path;
+        modes::FilterDistributor &distributor;
+        modes::FilterDistributor::handle handle;
+        Settings settings;
+        OutputOptions options;
+        bool running;
+
+        beast_shm_header *header;
+        beast_shm_record *records;
+        std::size_t mapped_size;
+        std::uint64_t mask;
+        std::uint64_t next;
+    };
+}; // namespace beast
+
+#endif
@@ -0,0 +1,189 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <boost/asio.hpp>
+
+#include "beast_encode.h"
+#include "beast_output_udp.h"
+
+namespace asio = boost::asio;
+using boost::asio::ip::udp;
+
+namespace beast {
+    UdpOutput::UdpOutput(asio::io_service &service_, const udp::endpoint &endpoint_, modes::FilterDistributor &distributor_, const Settings &settings_, const OutputOptions &options_) : socket(service_), endpoint(endpoint_), distributor(distributor_), handle(0), settings(settings_), options(options_), running(false), buffer(max_pending * options_.mtu), current(0), current_messages(0), sequence(0), dropped_datagrams(0), send_failing(false) { pending.reserve(max_pending); }
+
+    void UdpOutput::start() {
+        socket.open(endpoint.protocol());
+        if (endpoint.address().is_multicast())
+            socket.set_option(asio::ip::multicast::hops((int)options.multicast_ttl));
+
+        // connected, so we can send without giving an address each time
+        socket.connect(endpoint);
+        socket.non_blocking(true);
+
+        running = true;
+        handle = distributor.add_batch_client(std::bind(&UdpOutput::write_batch, shared_from_this(), std::placeholders::_1), settings.to_filter());
+    }
+
+    void UdpOutput::close() {
+        if (!running)
+            return;
+
+        running = false;
+        distributor.remove_client(handle);
+
+        if (dropped_datagrams > 0)
+            std::cerr << "udp(" << endpoint << "): " << dropped_datagrams << " datagrams could not be sent" << std::endl;
+
+        boost::system::error_code ignored;
+        socket.close(ignored);
+    }
+
+    void UdpOutput::write_batch(const modes::FilterDistributor::MessageRefs &messages) {
+        if (!running)
+            return;
+
+        for (auto message : messages) {
+            if (!encode::representable(settings, *message))
+                continue;
+
+            // start a new datagram if the worst case frame won't fit
+            if (current > 0 && current + encode::max_frame_size() > options.mtu)
+                end_datagram();
+            if (current == 0)
+                begin_datagram();
+
+            std::uint8_t *base = datagram(pending.size());
+            current = encode::message(base + current, settings, *message) - base;
+            ++current_messages;
+        }
+
+        // don't hold anything back for the next batch
+        end_datagram();
+        send_pending();
+    }
+
+    void UdpOutput::begin_datagram() {
+        if (pending.size() == max_pending)
+            send_pending();
+
+        std::uint8_t *out = datagram(pending.size());
+        out[0] = (std::uint8_t)(sequence >> 24);
+        out[1] = (std::uint8_t)(sequence >> 16);
+        out[2] = (std::uint8_t)(sequence >> 8);
+        out[3] = (std::uint8_t)sequence;
+        ++sequence;
+
+        current = header_size;
+        current_messages = 0;
+
+        // in the length-prefixed format, each datagram is one batch
+        if (settings.length_prefixed)
+            current = encode::batch_header(out + current, 0) - out;
+    }
+
+    void UdpOutput::end_datagram() {
+        if (current == 0)
+            return;
+
+        if (settings.length_prefixed)
+            encode::batch_header(datagram(pending.size()) + header_size, current_messages);
+
+        pending.push_back(current);
+        current = 0;
+    }
+
+    void UdpOutput::send_pending() {
+        if (pending.empty())
+            return;
+
+        int fd = socket.native_handle();
+        std::size_t sent = 0;
+        int error = 0;
+
+#ifdef __linux__
+        struct iovec iov[max_pending];
+        struct mmsghdr msgs[max_pending];
+        for (std::size_t i = 0; i < pending.size(); ++i) {
+            iov[i].iov_base = datagram(i);
+            iov[i].iov_len = pending[i];
+            std::memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        bool retried = false;
+        while (sent < pending.size()) {
+            int n = ::sendmmsg(fd, msgs + sent, pending.size() - sent, MSG_DONTWAIT);
+            if (n < 0) {
+                // ECONNREFUSED reports an earlier datagram bouncing off a
+                // unicast destination with nobody listening; nothing was
+                // sent this time, and that is no reason to stop
+                if (errno == EINTR || (errno == ECONNREFUSED && !retried)) {
+                    retried = (errno == ECONNREFUSED);
+                    continue;
+                }
+                error = errno;
+                break;
+            }
+            sent += n;
+        }
+#else
+        bool retried = false;
+        while (sent < pending.size()) {
+            if (::send(fd, datagram(sent), pending[sent], MSG_DONTWAIT) < 0) {
+                if (errno == EINTR || (errno == ECONNREFUSED && !retried)) {
+                    retried = (errno == ECONNREFUSED);
+                    continue;
+                }
+                error = errno;
+                break;
+            }
+            ++sent;
+        }
+#endif
+
+        if (sent < pending.size()) {
+            // EAGAIN/ENOBUFS mean we are sending faster than the network
+            // can take it; there is nothing better to do than drop it
+            if (!send_failing) {
+                std::cerr << "udp(" << endpoint << "): send failed, dropping datagrams: " << boost::system::error_code(error, boost::system::system_category()).message() << std::endl;
+                send_failing = true;
+            }
+            dropped_datagrams += pending.size() - sent;
+        } else if (send_failing) {
+            std::cerr << "udp(" << endpoint << "): sending again, " << dropped_datagrams << " datagrams dropped so far" << std::endl;
+            send_failing = false;
+        }
+
+        pending.clear();
+    }
+}; // namespace beast
@@ -0,0 +1,104 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BEAST_OUTPUT_UDP_H
+#define BEAST_OUTPUT_UDP_H
+
+#include <memory>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/udp.hpp>
+
+#include "beast_output.h"
+#include "beast_settings.h"
+#include "modes_filter.h"
+
+namespace beast {
+    // Sends messages to a UDP unicast or multicast destination.
+    //
+    // Each datagram starts with a 4-byte big-endian sequence number,
+    // which increases by one for every datagram, followed by as many
+    // complete frames in the selected format as fit in options.mtu.
+    // Frames are never split across datagrams. A receiver can detect
+    // lost datagrams from gaps in the sequence numbers.
+    //
+    // All the datagrams produced from one batch of input are sent
+    // together, with a single sendmmsg() where available. UDP output
+    // never blocks or queues: datagrams that the kernel will not take
+    // immediately are dropped (but still use up a sequence number).
+    class UdpOutput : public std::enable_shared_from_this<UdpOutput> {
+      public:
+        typedef std::shared_ptr<UdpOutput> pointer;
+
+        // bytes of sequence number at the start of each datagram
+        static const std::size_t header_size = 4;
+
+        // most datagrams to build before sending them
+        static const std::size_t max_pending = 64;
+
+        // factory method, this class must always be constructed via make_shared
+        static pointer create(boost::asio::io_service &service, const boost::asio::ip::udp::endpoint &endpoint, modes::FilterDistributor &distributor, const Settings &settings, const OutputOptions &options = OutputOptions()) { return pointer(new UdpOutput(service, endpoint, distributor, settings, options)); }
+
+        void start();
+        void close();
+
+      private:
+        UdpOutput(boost::asio::io_service &service_, const boost::asio::ip::udp::endpoint &endpoint_, modes::FilterDistributor &distributor_, const Settings &settings_, const OutputOptions &options_);
+
+        void write_batch(const modes::FilterDistributor::MessageRefs &messages);
+
+        std::uint8_t *datagram(std::size_t index) { return buffer.data() + index * options.mtu; }
+        void begin_datagram();
+        void end_datagram();
+        void send_pending();
+
+        boost::asio::ip::udp::socket socket;
+        boost::asio::ip::udp::endpoint endpoint;
+        modes::FilterDistributor &distributor;
+        modes::FilterDistributor::handle handle;
+        Settings settings;
+        OutputOptions options;
+        bool running;
+
+        // room for max_pending datagrams of options.mtu bytes each;
+        // pending holds the lengths of those that are complete, and
+        // current is the length of the one being built (0 if none)
+        std::vector<std::uint8_t> buffer;
+        std::vector<std::size_t> pending;
+        std::size_t current;
+
+        // frames in the current datagram, for the length-prefixed
+        // format's batch header
+        std::uint32_t current_messages;
+
+        std::uint32_t sequence;
+        std::uint64_t dropped_datagrams;
+        bool send_failing;
+    };
+}; // namespace beast
+
+#endif
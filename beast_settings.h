@@ -155,6 +155,7 @@ namespace beast {
         tristate<false, 'k', 'K'> filter_0_4_5;    // off=no filter, on=don't send DF0/4/5 (Beast only)
         tristate<false, 'p', 'P'> position_enable; // off=don't send position messages, on=send position message (Radarcape only, not a real setting)
         tristate<false, 'v', 'V'> verbatim;        // off=send correctable messages with FEC applied, on=send correctable messages without FEC applied
+        tristate<false, 'l', 'L'> length_prefixed; // off=format chosen by c/C, on=length-prefixed unescaped binary (output only, not a real setting)
     };
 
     template <bool D, char OFF, char ON> std::ostream &operator<<(std::ostream &os, const Settings::tristate<D, OFF, ON> &s) {
@@ -0,0 +1,178 @@
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+/*
+ * Layout of the shared-memory ring written by beast-splitter's --shm
+ * output, plus inline helpers for readers. This header is plain C (C99
+ * with GCC/Clang atomic builtins) so that any consumer can include it;
+ * beast_shm_wait() also needs _GNU_SOURCE, or -std=gnu99.
+ *
+ * The file starts with a struct beast_shm_header, followed by
+ * header.capacity records of header.record_size bytes each. Message
+ * number n (counting from 0) is stored in record n % capacity.
+ *
+ * There is a single writer and any number of readers; readers never
+ * write to the ring, apart from the waiters count used by
+ * beast_shm_wait(). A reader that falls more than capacity messages
+ * behind the writer will find its next message overwritten, which
+ * beast_shm_read() reports as BEAST_SHM_OVERRUN; the reader can then
+ * skip ahead (e.g. to beast_shm_next(h) - capacity / 2).
+ *
+ * Each record is protected by its own sequence lock: while message n is
+ * being written to it the lock word is 2n+1, and once it is complete it
+ * is 2n+2. A lock word of 0 means the record has never been written.
+ *
+ * If beast-splitter restarts, it creates a new file rather than reusing
+ * the old one, and sets the closed flag in the old one. Readers should
+ * reopen the file when they see that flag set.
+ */
+
+#ifndef BEAST_SHM_H
+#define BEAST_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BEAST_SHM_MAGIC 0x52485342u /* "BSHR" */
+#define BEAST_SHM_VERSION 1
+
+/* values of beast_shm_record.type; the same as the Beast frame types */
+#define BEAST_SHM_MODE_AC 0x31
+#define BEAST_SHM_MODE_S_SHORT 0x32
+#define BEAST_SHM_MODE_S_LONG 0x33
+#define BEAST_SHM_STATUS 0x34
+#define BEAST_SHM_POSITION 0x35
+
+/* values of beast_shm_record.timestamp_type */
+#define BEAST_SHM_TIMESTAMP_UNKNOWN 0
+#define BEAST_SHM_TIMESTAMP_12MHZ 1
+#define BEAST_SHM_TIMESTAMP_GPS 2
+
+/* bits in beast_shm_record.flags */
+#define BEAST_SHM_FLAG_CRC_BAD 0x01   /* Mode S CRC is bad (and not corrected) */
+#define BEAST_SHM_FLAG_CORRECTED 0x02 /* a 1-bit error was corrected in the payload */
+
+#define BEAST_SHM_MAX_PAYLOAD 24
+
+struct beast_shm_header {
+    uint32_t magic;       /* BEAST_SHM_MAGIC, written last when creating the ring */
+    uint32_t version;     /* BEAST_SHM_VERSION */
+    uint32_t header_size; /* sizeof(struct beast_shm_header) */
+    uint32_t record_size; /* sizeof(struct beast_shm_record) */
+    uint64_t capacity;    /* number of records, a power of two */
+    uint64_t epoch;       /* when the writer created the ring, in ms since 1970 */
+    uint32_t closed;      /* set when the writer has gone away */
+    uint32_t reserved0;
+    uint8_t pad0[24];
+
+    /* on their own cache lines, as they change all the time */
+    uint64_t next;        /* number of messages completely written so far */
+    uint8_t pad1[56];
+    uint32_t futex;       /* incremented after each batch of messages */
+    uint32_t waiters;     /* readers currently blocked in beast_shm_wait */
+    uint8_t pad2[56];
+};
+
+struct beast_shm_record {
+    uint64_t lock;          /* sequence lock, see above */
+    uint64_t timestamp;     /* receiver timestamp, see timestamp_type */
+    uint8_t type;           /* BEAST_SHM_MODE_AC etc */
+    uint8_t timestamp_type; /* BEAST_SHM_TIMESTAMP_* */
+    uint8_t signal;         /* signal level, 0-255 */
+    uint8_t length;         /* bytes of payload */
+    uint8_t flags;          /* BEAST_SHM_FLAG_* */
+    uint8_t reserved[3];
+    uint8_t payload[BEAST_SHM_MAX_PAYLOAD];
+    uint8_t pad[16];
+};
+
+enum { BEAST_SHM_OK = 0, BEAST_SHM_NOT_YET = 1, BEAST_SHM_OVERRUN = 2 };
+
+static inline const struct beast_shm_record *beast_shm_records(const struct beast_shm_header *h) { return (const struct beast_shm_record *)((const uint8_t *)h + h->header_size); }
+
+/* the number of the next message the writer will write */
+static inline uint64_t beast_shm_next(const struct beast_shm_header *h) { return __atomic_load_n(&h->next, __ATOMIC_ACQUIRE); }
+
+/* true if the writer has gone away and readers should reopen the file */
+static inline int beast_shm_closed(const struct beast_shm_header *h) { return __atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) != 0; }
+
+/*
+ * Copy message n to *out. Returns BEAST_SHM_OK on success,
+ * BEAST_SHM_NOT_YET if it hasn't been written yet, or BEAST_SHM_OVERRUN
+ * if it has already been overwritten by a later message.
+ */
+static inline int beast_shm_read(const struct beast_shm_header *h, uint64_t n, struct beast_shm_record *out) {
+    const struct beast_shm_record *r = beast_shm_records(h) + (n & (h->capacity - 1));
+    uint64_t before = __atomic_load_n(&r->lock, __ATOMIC_ACQUIRE);
+    uint64_t after;
+
+    if (before != 2 * n + 2)
+        return (before > 2 * n + 2 ? BEAST_SHM_OVERRUN : BEAST_SHM_NOT_YET);
+
+    memcpy(out, r, sizeof(*out));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&r->lock, __ATOMIC_RELAXED);
+    if (after != before)
+        return BEAST_SHM_OVERRUN; /* overwritten while we were copying it */
+
+    return BEAST_SHM_OK;
+}
+
+#ifdef __linux__
+/*
+ * Block until message n has been written, the timeout (which may be NULL)
+ * expires, or a signal arrives. Returns nonzero if message n is available.
+ */
+static inline int beast_shm_wait(struct beast_shm_header *h, uint64_t n, const struct timespec *timeout) {
+    uint32_t seen = __atomic_load_n(&h->futex, __ATOMIC_ACQUIRE);
+    if (beast_shm_next(h) > n)
+        return 1;
+
+    __atomic_fetch_add(&h->waiters, 1, __ATOMIC_SEQ_CST);
+    if (beast_shm_next(h) <= n)
+        syscall(SYS_futex, &h->futex, FUTEX_WAIT, seen, timeout, NULL, 0);
+    __atomic_fetch_sub(&h->waiters, 1, __ATOMIC_SEQ_CST);
+
+    return beast_shm_next(h) > n;
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
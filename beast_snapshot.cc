@@ -0,0 +1,212 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+
+#include "beast_snapshot.h"
+#include "crc.h"
+#include "helpers.h"
+
+namespace beast {
+    static std::mutex current_mutex;
+    static SnapshotTable::pointer current_table;
+
+    SnapshotTable::pointer SnapshotTable::current() {
+        std::lock_guard<std::mutex> lock(current_mutex);
+        return current_table;
+    }
+
+    void SnapshotTable::set_current(pointer table) {
+        std::lock_guard<std::mutex> lock(current_mutex);
+        current_table = table;
+    }
+
+    SnapshotTable::SnapshotTable(modes::FilterDistributor &distributor_, std::size_t max_aircraft_, std::chrono::milliseconds max_age_) : distributor(distributor_), handle(0), max_aircraft(max_aircraft_), max_age(max_age_), count(0), sweep_index(0) {
+        std::size_t size = helpers::round_up_pow2(std::max<std::size_t>(max_aircraft * 2, 16));
+        table.resize(size);
+        for (auto &e : table)
+            e.used = false;
+
+        mask = size - 1;
+        shift = 32;
+        while (size > 1) {
+            --shift;
+            size >>= 1;
+        }
+    }
+
+    void SnapshotTable::start() {
+        auto self(shared_from_this());
+
+        modes::Filter filter;
+        filter.receive_df[4] = filter.receive_df[5] = filter.receive_df[17] = filter.receive_df[20] = filter.receive_df[21] = true;
+        filter.receive_fec = true;
+        handle = distributor.add_batch_client(std::bind(&SnapshotTable::write_batch, self, std::placeholders::_1), filter);
+    }
+
+    void SnapshotTable::close() { distributor.remove_client(handle); }
+
+    bool SnapshotTable::classify(const modes::Message &message, std::uint32_t &address, Kind &kind) {
+        switch (message.df()) {
+        case 17: {
+            auto data = message.corrected_data();
+            if (data.empty())
+                return false; // bad CRC
+
+            address = (data[1] << 16) | (data[2] << 8) | data[3];
+            unsigned typecode = data[4] >> 3;
+            if (typecode >= 1 && typecode <= 4)
+                kind = Kind::IDENTIFICATION;
+            else if ((typecode >= 5 && typecode <= 18) || (typecode >= 20 && typecode <= 22))
+                kind = (data[6] & 0x04) ? Kind::POSITION_ODD : Kind::POSITION_EVEN;
+            else if (typecode == 19)
+                kind = Kind::VELOCITY;
+            else
+                return false;
+            return true;
+        }
+
+        case 4:
+        case 20:
+            address = crc::message_residual(message.data());
+            kind = Kind::ALTITUDE;
+            return true;
+
+        case 5:
+        case 21:
+            address = crc::message_residual(message.data());
+            kind = Kind::SQUAWK;
+            return true;
+
+        default:
+            return false;
+        }
+    }
+
+    SnapshotTable::entry *SnapshotTable::find(std::uint32_t address, bool add) {
+        std::size_t i = home(address);
+        while (table[i].used) {
+            if (table[i].address == address)
+                return &table[i];
+            i = (i + 1) & mask;
+        }
+
+        if (!add || count >= max_aircraft)
+            return nullptr;
+
+        entry &e = table[i];
+        e.used = true;
+        e.address = address;
+        for (auto &s : e.slots)
+            s.received = std::chrono::steady_clock::time_point();
+        ++count;
+        return &e;
+    }
+
+    void SnapshotTable::erase(std::size_t i) {
+        // Backward-shift deletion: move later entries of the same probe
+        // run up into the hole, unless that would put them before their
+        // home slot.
+        std::size_t j = i;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (!table[j].used)
+                break;
+
+            std::size_t k = home(table[j].address);
+            bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+            if (!stays) {
+                table[i] = table[j];
+                i = j;
+            }
+        }
+
+        table[i].used = false;
+        --count;
+    }
+
+    void SnapshotTable::sweep(std::chrono::steady_clock::time_point cutoff) {
+        for (std::size_t n = 0; n < sweep_per_batch; ++n) {
+            entry &e = table[sweep_index];
+            if (e.used && e.last_seen < cutoff)
+                erase(sweep_index); // look at whatever moved in on the next pass
+            else
+                sweep_index = (sweep_index + 1) & mask;
+        }
+    }
+
+    void SnapshotTable::write_batch(const modes::FilterDistributor::MessageRefs &messages) {
+        auto now = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto message : messages) {
+            std::uint32_t address;
+            Kind kind;
+            if (!classify(*message, address, kind))
+                continue;
+
+            entry *e = find(address, message->df() == 17);
+            if (!e)
+                continue;
+
+            e->last_seen = now;
+            slot &s = e->slots[(std::size_t)kind];
+            s.received = now;
+            s.serial = message->serial();
+            s.timestamp = message->timestamp();
+            s.type = message->type();
+            s.timestamp_type = message->timestamp_type();
+            s.signal = message->signal();
+            std::copy(message->data().begin(), message->data().end(), s.data.begin());
+        }
+
+        sweep(now - max_age);
+    }
+
+    void SnapshotTable::snapshot(const modes::Filter &filter, modes::MessageBatch &out) {
+        auto cutoff = std::chrono::steady_clock::now() - max_age;
+
+        // copy out under the lock, build messages after releasing it
+        std::vector<slot> copied;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            copied.reserve(count * num_kinds);
+            for (const auto &e : table) {
+                if (!e.used || e.last_seen < cutoff)
+                    continue;
+                for (const auto &s : e.slots) {
+                    if (s.received != std::chrono::steady_clock::time_point() && s.received >= cutoff)
+                        copied.push_back(s);
+                }
+            }
+        }
+
+        std::sort(copied.begin(), copied.end(), [](const slot &a, const slot &b) { return a.serial < b.serial; });
+        for (const auto &s : copied) {
+            modes::Message message(s.type, s.timestamp_type, s.timestamp, s.signal, helpers::bytespan(s.data.data(), modes::message_size(s.type)), s.serial);
+            if (filter(message))
+                out.push_back(message);
+        }
+    }
+}; // namespace beast
@@ -0,0 +1,127 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef BEAST_SNAPSHOT_H
+#define BEAST_SNAPSHOT_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "modes_filter.h"
+#include "modes_message.h"
+
+namespace beast {
+    // Keeps the most recent message of each important kind for every
+    // aircraft we have heard recently, so that a client that asks for
+    // it (with 0x1A 'W') can be warmed up with one message per aircraft
+    // per kind, rather than with a replay of everything.
+    //
+    // This is an open-addressing hash table keyed by ICAO address, with
+    // linear probing, allocated once at startup. It is updated from the
+    // broadcast path without allocating, and entries that have not been
+    // updated for max_age are removed a few at a time as messages arrive.
+    //
+    // Aircraft are only added by DF17 messages with a good (or
+    // corrected) CRC, which carry their address in the clear; DF4/5/20/21
+    // replies, whose address is overlaid on the CRC, only update aircraft
+    // that are already known, so noise does not fill the table.
+    class SnapshotTable : public std::enable_shared_from_this<SnapshotTable> {
+      public:
+        typedef std::shared_ptr<SnapshotTable> pointer;
+
+        // what we keep for each aircraft; CPR positions need an even and
+        // an odd message to decode, so we keep one of each
+        enum class Kind { IDENTIFICATION, POSITION_EVEN, POSITION_ODD, VELOCITY, ALTITUDE, SQUAWK };
+        static const std::size_t num_kinds = 6;
+
+        // how many entries to check for expiry after each batch
+        static const std::size_t sweep_per_batch = 16;
+
+        // factory method, this class must always be constructed via make_shared
+        static pointer create(modes::FilterDistributor &distributor, std::size_t max_aircraft, std::chrono::milliseconds max_age) { return pointer(new SnapshotTable(distributor, max_aircraft, max_age)); }
+
+        // the table used for snapshot requests, if there is one
+        static pointer current();
+        static void set_current(pointer table);
+
+        void start();
+        void close();
+
+        // Appends the current messages that pass filter to out, oldest
+        // first.
+        void snapshot(const modes::Filter &filter, modes::MessageBatch &out);
+
+        // Works out which aircraft and kind a message is for. Returns
+        // false for messages we don't keep.
+        static bool classify(const modes::Message &message, std::uint32_t &address, Kind &kind);
+
+      private:
+        SnapshotTable(modes::FilterDistributor &distributor_, std::size_t max_aircraft_, std::chrono::milliseconds max_age_);
+
+        struct slot {
+            std::chrono::steady_clock::time_point received; // default (epoch) if empty
+            std::uint64_t serial;
+            std::uint64_t timestamp;
+            modes::MessageType type;
+            modes::TimestampType timestamp_type;
+            std::uint8_t signal;
+            std::array<std::uint8_t, 14> data; // a Mode S long message at most
+        };
+
+        struct entry {
+            bool used;
+            std::uint32_t address;
+            std::chrono::steady_clock::time_point last_seen;
+            std::array<slot, num_kinds> slots;
+        };
+
+        void write_batch(const modes::FilterDistributor::MessageRefs &messages);
+
+        // call these with the mutex held
+        std::size_t home(std::uint32_t address) const { return (std::uint32_t)(address * 2654435761U) >> shift; }
+        entry *find(std::uint32_t address, bool add);
+        void erase(std::size_t index);
+        void sweep(std::chrono::steady_clock::time_point cutoff);
+
+        modes::FilterDistributor &distributor;
+        modes::FilterDistributor::handle handle;
+        const std::size_t max_aircraft;
+        const std::chrono::milliseconds max_age;
+
+        std::mutex mutex;
+        std::vector<entry> table; // power-of-two size, at least twice max_aircraft
+        std::size_t mask;
+        unsigned shift;
+        std::size_t count;
+        std::size_t sweep_index;
+    };
+}; // namespace beast
+
+#endif
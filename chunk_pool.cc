@@ -0,0 +1,73 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "chunk_pool.h"
+
+namespace helpers {
+    ChunkPool &ChunkPool::instance() {
+        // deliberately never destroyed, as chunk references held in
+        // other statics may be released during exit
+        static ChunkPool *pool = new ChunkPool();
+        return *pool;
+    }
+
+    ChunkRef ChunkPool::allocate() {
+        Chunk *chunk = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (free_list) {
+                chunk = free_list;
+                free_list = chunk->next_free;
+                --free_count;
+            }
+        }
+
+        if (chunk) {
+            chunk->length = 0;
+            chunk->next_free = nullptr;
+        } else {
+            chunk = new Chunk();
+        }
+
+        ++chunks_in_use;
+        return ChunkRef(chunk);
+    }
+
+    void ChunkPool::recycle(Chunk *chunk) {
+        --chunks_in_use;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (free_count < max_free) {
+                chunk->next_free = free_list;
+                free_list = chunk;
+                ++free_count;
+                return;
+            }
+        }
+
+        delete chunk;
+    }
+};
@@ -0,0 +1,154 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef CHUNK_POOL_H
+#define CHUNK_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+#include "helpers.h"
+
+namespace helpers {
+    class ChunkPool;
+
+    // A fixed-size block of encoded output. Bytes are only ever appended
+    // to a chunk; once written they never change, so any number of
+    // connections can hold references to them and write them out
+    // directly without making their own copy.
+    class Chunk {
+      public:
+        static const std::size_t capacity = 16384;
+
+        const std::uint8_t *data() const { return bytes; }
+        std::size_t size() const { return length; }
+        std::size_t available() const { return capacity - length; }
+
+        // the unwritten part of the chunk, and a way to claim some
+        // of it once it has been written to
+        std::uint8_t *tail() { return bytes + length; }
+        void commit(std::size_t n) { length += n; }
+
+        // append some bytes, returning the offset they were written at;
+        // the caller must check available() first
+        std::size_t append(bytespan data) {
+            std::size_t offset = length;
+            std::memcpy(bytes + length, data.data(), data.size());
+            length += data.size();
+            return offset;
+        }
+
+      private:
+        friend class ChunkRef;
+        friend class ChunkPool;
+
+        Chunk() : refcount(0), length(0), next_free(nullptr) {}
+
+        std::atomic<unsigned> refcount;
+        std::size_t length;
+        Chunk *next_free;
+        std::uint8_t bytes[capacity];
+    };
+
+    // A counted reference to a Chunk. When the last reference goes
+    // away, the chunk goes back to the pool.
+    class ChunkRef {
+      public:
+        ChunkRef() : chunk(nullptr) {}
+        explicit ChunkRef(Chunk *chunk_) : chunk(chunk_) { acquire(); }
+        ChunkRef(const ChunkRef &other) : chunk(other.chunk) { acquire(); }
+        ChunkRef(ChunkRef &&other) : chunk(other.chunk) { other.chunk = nullptr; }
+        ~ChunkRef() { release(); }
+
+        ChunkRef &operator=(ChunkRef other) {
+            std::swap(chunk, other.chunk);
+            return *this;
+        }
+
+        Chunk *get() const { return chunk; }
+        Chunk *operator->() const { return chunk; }
+        explicit operator bool() const { return chunk != nullptr; }
+        bool operator==(const ChunkRef &other) const { return chunk == other.chunk; }
+
+      private:
+        void acquire() {
+            if (chunk)
+                chunk->refcount.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void release();
+
+        Chunk *chunk;
+    };
+
+    // A run of complete frames within a chunk
+    struct ChunkSlice {
+        ChunkRef chunk;
+        std::uint32_t offset;
+        std::uint32_t length;
+        std::uint32_t messages; // number of messages encoded in this slice
+
+        const std::uint8_t *data() const { return chunk->data() + offset; }
+    };
+
+    // Recycles chunks so that in the steady state we are not going back
+    // to the allocator for every batch of output.
+    class ChunkPool {
+      public:
+        // how many free chunks to hang on to
+        static const std::size_t max_free = 64;
+
+        static ChunkPool &instance();
+
+        // returns a new, empty chunk
+        ChunkRef allocate();
+
+        // number of chunks currently referenced by someone
+        std::size_t in_use() const { return chunks_in_use.load(std::memory_order_relaxed); }
+
+      private:
+        friend class ChunkRef;
+
+        ChunkPool() : free_list(nullptr), free_count(0), chunks_in_use(0) {}
+
+        void recycle(Chunk *chunk);
+
+        std::mutex mutex;
+        Chunk *free_list;
+        std::size_t free_count;
+        std::atomic<std::size_t> chunks_in_use;
+    };
+
+    inline void ChunkRef::release() {
+        if (chunk && chunk->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            ChunkPool::instance().recycle(chunk);
+        chunk = nullptr;
+    }
+};
+
+#endif
@@ -0,0 +1,327 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <ctime>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compression.h"
+
+namespace beast {
+    namespace compression {
+        Compression parse(const std::string &name) {
+            if (name == "none")
+                return Compression::NONE;
+            if (name == "deflate")
+                return Compression::DEFLATE;
+            if (name == "zstd") {
+#ifdef HAVE_ZSTD
+                return Compression::ZSTD;
+#else
+                throw std::invalid_argument("zstd compression is not supported by this build");
+#endif
+            }
+
+            throw std::invalid_argument("bad value for compress: " + name);
+        }
+
+        const char *name(Compression codec) {
+            switch (codec) {
+            case Compression::DEFLATE:
+                return "deflate";
+            case Compression::ZSTD:
+                return "zstd";
+            default:
+                return "none";
+            }
+        }
+
+        static std::uint8_t header_byte(Compression codec) {
+            switch (codec) {
+            case Compression::DEFLATE:
+                return 'd';
+            case Compression::ZSTD:
+                return 'z';
+            default:
+                return 0;
+            }
+        }
+
+        bool is_header(helpers::bytespan data, Compression &codec) {
+            if (data.size() < header_size || data[0] != 0x1A || data[1] != 'Z')
+                return false;
+
+            switch (data[2]) {
+            case 'd':
+                codec = Compression::DEFLATE;
+                return true;
+#ifdef HAVE_ZSTD
+            case 'z':
+                codec = Compression::ZSTD;
+                return true;
+#endif
+            default:
+                return false;
+            }
+        }
+
+        Stats &output_stats() {
+            static Stats stats;
+            return stats;
+        }
+
+        Stats &input_stats() {
+            static Stats stats;
+            return stats;
+        }
+
+        static std::uint64_t thread_cpu_ns() {
+            struct timespec ts;
+            if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+                return 0;
+            return (std::uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+
+        // output grows in steps of this much while (de)compressing
+        static const std::size_t out_step = 4096;
+    }; // namespace compression
+
+    //////////////
+
+    class DeflateCompressor : public Compressor {
+      public:
+        DeflateCompressor() : Compressor(Compression::DEFLATE) {
+            stream.zalloc = Z_NULL;
+            stream.zfree = Z_NULL;
+            stream.opaque = Z_NULL;
+            if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+                throw std::runtime_error("could not initialize deflate");
+        }
+
+        ~DeflateCompressor() { deflateEnd(&stream); }
+
+      protected:
+        void do_compress(helpers::bytespan data, helpers::bytebuf &out, bool flush) override {
+            stream.next_in = const_cast<Bytef *>(data.data());
+            stream.avail_in = (uInt)data.size();
+
+            // with Z_SYNC_FLUSH, deflate is done once it leaves some
+            // output space unused
+            do {
+                std::size_t used = out.size();
+                out.resize(used + compression::out_step);
+                stream.next_out = out.data() + used;
+                stream.avail_out = (uInt)compression::out_step;
+                deflate(&stream, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+                out.resize(out.size() - stream.avail_out);
+            } while (stream.avail_out == 0 || stream.avail_in > 0);
+        }
+
+      private:
+        z_stream stream;
+    };
+
+    class DeflateDecompressor : public Decompressor {
+      public:
+        DeflateDecompressor() {
+            stream.zalloc = Z_NULL;
+            stream.zfree = Z_NULL;
+            stream.opaque = Z_NULL;
+            stream.next_in = Z_NULL;
+            stream.avail_in = 0;
+            if (inflateInit(&stream) != Z_OK)
+                throw std::runtime_error("could not initialize inflate");
+        }
+
+        ~DeflateDecompressor() { inflateEnd(&stream); }
+
+      protected:
+        bool do_decompress(helpers::bytespan data, helpers::bytebuf &out, std::string &error) override {
+            stream.next_in = const_cast<Bytef *>(data.data());
+            stream.avail_in = (uInt)data.size();
+
+            do {
+                std::size_t used = out.size();
+                out.resize(used + compression::out_step);
+                stream.next_out = out.data() + used;
+                stream.avail_out = (uInt)compression::out_step;
+                int rc = inflate(&stream, Z_SYNC_FLUSH);
+                out.resize(out.size() - stream.avail_out);
+
+                if (rc == Z_STREAM_END && stream.avail_in > 0) {
+                    error = "data after the end of the compressed stream";
+                    return false;
+                }
+                if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                    error = (stream.msg ? stream.msg : "inflate failed");
+                    return false;
+                }
+            } while (stream.avail_out == 0 || stream.avail_in > 0);
+
+            return true;
+        }
+
+      private:
+        z_stream stream;
+    };
+
+#ifdef HAVE_ZSTD
+    class ZstdCompressor : public Compressor {
+      public:
+        ZstdCompressor() : Compressor(Compression::ZSTD), ctx(ZSTD_createCCtx()) {
+            if (!ctx)
+                throw std::runtime_error("could not initialize zstd");
+            ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, ZSTD_CLEVEL_DEFAULT);
+        }
+
+        ~ZstdCompressor() { ZSTD_freeCCtx(ctx); }
+
+      protected:
+        void do_compress(helpers::bytespan data, helpers::bytebuf &out, bool flush) override {
+            ZSTD_inBuffer in = {data.data(), data.size(), 0};
+            std::size_t remaining;
+
+            do {
+                std::size_t used = out.size();
+                out.resize(used + compression::out_step);
+                ZSTD_outBuffer o = {out.data() + used, compression::out_step, 0};
+                remaining = ZSTD_compressStream2(ctx, &o, &in, flush ? ZSTD_e_flush : ZSTD_e_continue);
+                out.resize(used + o.pos);
+                if (ZSTD_isError(remaining))
+                    throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(remaining));
+            } while (in.pos < in.size || (flush && remaining > 0));
+        }
+
+      private:
+        ZSTD_CCtx *ctx;
+    };
+
+    class ZstdDecompressor : public Decompressor {
+      public:
+        ZstdDecompressor() : ctx(ZSTD_createDCtx()) {
+            if (!ctx)
+                throw std::runtime_error("could not initialize zstd");
+        }
+
+        ~ZstdDecompressor() { ZSTD_freeDCtx(ctx); }
+
+      protected:
+        bool do_decompress(helpers::bytespan data, helpers::bytebuf &out, std::string &error) override {
+            ZSTD_inBuffer in = {data.data(), data.size(), 0};
+            bool full;
+
+            do {
+                std::size_t used = out.size();
+                out.resize(used + compression::out_step);
+                ZSTD_outBuffer o = {out.data() + used, compression::out_step, 0};
+                std::size_t rc = ZSTD_decompressStream(ctx, &o, &in);
+                out.resize(used + o.pos);
+                if (ZSTD_isError(rc)) {
+                    error = ZSTD_getErrorName(rc);
+                    return false;
+                }
+                full = (o.pos == o.size);
+            } while (in.pos < in.size || full);
+
+            return true;
+        }
+
+      private:
+        ZSTD_DCtx *ctx;
+    };
+#endif
+
+    //////////////
+
+    Compressor::pointer Compressor::create(Compression codec) {
+        switch (codec) {
+        case Compression::DEFLATE:
+            return pointer(new DeflateCompressor());
+#ifdef HAVE_ZSTD
+        case Compression::ZSTD:
+            return pointer(new ZstdCompressor());
+#endif
+        default:
+            return pointer();
+        }
+    }
+
+    void Compressor::compress(helpers::bytespan data, helpers::bytebuf &out) { run(data, out, false); }
+
+    void Compressor::flush(helpers::bytebuf &out) { run(helpers::bytespan(), out, true); }
+
+    void Compressor::run(helpers::bytespan data, helpers::bytebuf &out, bool flush) {
+        std::size_t before = out.size();
+        if (!started) {
+            out.push_back(0x1A);
+            out.push_back('Z');
+            out.push_back(compression::header_byte(codec));
+            started = true;
+        }
+
+        std::uint64_t start = compression::thread_cpu_ns();
+        do_compress(data, out, flush);
+        std::uint64_t elapsed = compression::thread_cpu_ns() - start;
+
+        raw_count += data.size();
+        compressed_count += out.size() - before;
+
+        compression::Stats &stats = compression::output_stats();
+        stats.raw_bytes += data.size();
+        stats.compressed_bytes += out.size() - before;
+        stats.cpu_ns += elapsed;
+    }
+
+    Decompressor::pointer Decompressor::create(Compression codec) {
+        switch (codec) {
+        case Compression::DEFLATE:
+            return pointer(new DeflateDecompressor());
+#ifdef HAVE_ZSTD
+        case Compression::ZSTD:
+            return pointer(new ZstdDecompressor());
+#endif
+        default:
+            return pointer();
+        }
+    }
+
+    bool Decompressor::decompress(helpers::bytespan data, helpers::bytebuf &out, std::string &error) {
+        std::size_t before = out.size();
+
+        std::uint64_t start = compression::thread_cpu_ns();
+        bool ok = do_decompress(data, out, error);
+        std::uint64_t elapsed = compression::thread_cpu_ns() - start;
+
+        compression::Stats &stats = compression::input_stats();
+        stats.compressed_bytes += data.size();
+        stats.raw_bytes += out.size() - before;
+        stats.cpu_ns += elapsed;
+        return ok;
+    }
+}; // namespace beast
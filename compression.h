@@ -0,0 +1,133 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "helpers.h"
+
+namespace beast {
+    // Optional compression of a Beast output stream, for feeds that run
+    // over slow or metered links.
+    //
+    // A compressed stream starts with a three-byte header, 0x1A 'Z' and a
+    // byte identifying the codec, followed by the compressed data. 'Z' is
+    // not a Beast message type, so a reader that doesn't understand
+    // compression skips the header as a bad frame and then sees garbage,
+    // rather than misinterpreting it; a reader that does (NetInput)
+    // recognizes the header and turns on decompression by itself, so
+    // nothing needs to be configured on that side.
+    //
+    // Each write is flushed completely, so the reader can decode
+    // everything it has received without waiting for more.
+    enum class Compression { NONE, DEFLATE, ZSTD };
+
+    namespace compression {
+        static const std::size_t header_size = 3;
+
+        // parses "none", "deflate" or "zstd"; throws std::invalid_argument
+        // for anything else, or for a codec that was not compiled in
+        Compression parse(const std::string &name);
+        const char *name(Compression codec);
+
+        // is this a compressed stream header? If so, sets codec
+        bool is_header(helpers::bytespan data, Compression &codec);
+
+        // Totals across all connections, for the status file.
+        struct Stats {
+            std::atomic<std::uint64_t> raw_bytes;
+            std::atomic<std::uint64_t> compressed_bytes;
+            std::atomic<std::uint64_t> cpu_ns;
+
+            Stats() : raw_bytes(0), compressed_bytes(0), cpu_ns(0) {}
+        };
+
+        Stats &output_stats();
+        Stats &input_stats();
+    }; // namespace compression
+
+    class Compressor {
+      public:
+        typedef std::unique_ptr<Compressor> pointer;
+
+        // returns nullptr for Compression::NONE
+        static pointer create(Compression codec);
+
+        virtual ~Compressor() {}
+
+        // Compresses data and appends it to out. The first call also
+        // writes the stream header. Nothing is written out until flush().
+        void compress(helpers::bytespan data, helpers::bytebuf &out);
+
+        // Appends everything compressed so far to out, ending on a
+        // boundary that the reader can decode fully.
+        void flush(helpers::bytebuf &out);
+
+        std::uint64_t raw_bytes() const { return raw_count; }
+        std::uint64_t compressed_bytes() const { return compressed_count; }
+
+      protected:
+        explicit Compressor(Compression codec_) : codec(codec_), started(false), raw_count(0), compressed_count(0) {}
+
+        // codec-specific work; both append to out
+        virtual void do_compress(helpers::bytespan data, helpers::bytebuf &out, bool flush) = 0;
+
+      private:
+        void run(helpers::bytespan data, helpers::bytebuf &out, bool flush);
+
+        Compression codec;
+        bool started;
+        std::uint64_t raw_count;
+        std::uint64_t compressed_count;
+    };
+
+    class Decompressor {
+      public:
+        typedef std::unique_ptr<Decompressor> pointer;
+
+        // returns nullptr for Compression::NONE
+        static pointer create(Compression codec);
+
+        virtual ~Decompressor() {}
+
+        // Decompresses data (which follows the stream header) and
+        // appends the result to out. Returns false, with a description
+        // in error, if the data is corrupt.
+        bool decompress(helpers::bytespan data, helpers::bytebuf &out, std::string &error);
+
+      protected:
+        Decompressor() {}
+
+        virtual bool do_decompress(helpers::bytespan data, helpers::bytebuf &out, std::string &error) = 0;
+    };
+}; // namespace beast
+
+#endif
@@ -47,6 +47,7 @@ namespace crc {
 
         std::map<std::uint32_t, unsigned> syndromes_short;
         std::map<std::uint32_t, unsigned> syndromes_long;
+        std::once_flag syndromes_once;
 
         void init_syndromes() {
             syndromes_short.clear();
@@ -30,6 +30,7 @@
 
 #include <cstdint>
 #include <map>
+#include <mutex>
 #include <vector>
 
 namespace crc {
@@ -37,6 +38,7 @@ namespace crc {
         extern std::uint32_t crc_table[256];
         extern std::map<std::uint32_t, unsigned> syndromes_short;
         extern std::map<std::uint32_t, unsigned> syndromes_long;
+        extern std::once_flag syndromes_once;
         void init_syndromes();
     }; // namespace detail
 
@@ -50,7 +52,8 @@ namespace crc {
     }
 
     // Compute the Mode S CRC residual for a single Mode S message
-    inline std::uint32_t message_residual(const std::vector<std::uint8_t> message) {
+    // (any contiguous byte container: vector, array, bytespan)
+    template <class Container> std::uint32_t message_residual(const Container &message) {
         std::size_t len = message.size();
         if (len <= 3) {
             return 0;
@@ -69,15 +72,13 @@ namespace crc {
     // If the syndrome is not correctable, return -1.
 
     inline int correctable_bit_short(std::uint32_t syndrome) {
-        if (detail::syndromes_short.empty())
-            detail::init_syndromes();
+        std::call_once(detail::syndromes_once, detail::init_syndromes);
         auto correction = detail::syndromes_short.find(syndrome);
         return (correction != detail::syndromes_short.end()) ? correction->second : -1;
     }
 
     inline int correctable_bit_long(std::uint32_t syndrome) {
-        if (detail::syndromes_long.empty())
-            detail::init_syndromes();
+        std::call_once(detail::syndromes_once, detail::init_syndromes);
         auto correction = detail::syndromes_long.find(syndrome);
         return (correction != detail::syndromes_long.end()) ? correction->second : -1;
     }
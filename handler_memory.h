@@ -0,0 +1,114 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef HANDLER_MEMORY_H
+#define HANDLER_MEMORY_H
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace helpers {
+    // Storage for the handlers of one repeated async operation, such as
+    // a connection's reads, so that asio doesn't go to the heap every
+    // time one is started. Only one allocation at a time fits; anything
+    // bigger, or anything allocated while the storage is in use (which
+    // can happen briefly when a handler starts the next operation),
+    // falls back to the heap.
+    class HandlerMemory {
+      public:
+        static const std::size_t capacity = 512;
+
+        HandlerMemory() : in_use(false) {}
+        HandlerMemory(const HandlerMemory &) = delete;
+        HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+        void *allocate(std::size_t size) {
+            if (size <= capacity && !in_use.exchange(true, std::memory_order_acquire))
+                return &storage;
+            return ::operator new(size);
+        }
+
+        void deallocate(void *pointer) {
+            if (pointer == &storage)
+                in_use.store(false, std::memory_order_release);
+            else
+                ::operator delete(pointer);
+        }
+
+      private:
+        typename std::aligned_storage<capacity>::type storage;
+        std::atomic<bool> in_use;
+    };
+
+    // A standard allocator over a HandlerMemory, for asio's associated
+    // allocator lookup
+    template <typename T> class HandlerAllocator {
+      public:
+        typedef T value_type;
+
+        explicit HandlerAllocator(HandlerMemory &memory_) : memory(&memory_) {}
+        template <typename U> HandlerAllocator(const HandlerAllocator<U> &other) : memory(other.memory) {}
+
+        T *allocate(std::size_t n) { return static_cast<T *>(memory->allocate(sizeof(T) * n)); }
+        void deallocate(T *pointer, std::size_t) { memory->deallocate(pointer); }
+
+        template <typename U> bool operator==(const HandlerAllocator<U> &other) const { return memory == other.memory; }
+        template <typename U> bool operator!=(const HandlerAllocator<U> &other) const { return memory != other.memory; }
+
+      private:
+        template <typename U> friend class HandlerAllocator;
+
+        HandlerMemory *memory;
+    };
+
+    // Wraps a handler so that asio allocates its operations from the given
+    // memory. This goes inside any strand.wrap(): the strand's wrapper
+    // passes allocation through to the handler it wraps, via the hooks.
+    template <typename Handler> class AllocHandler {
+      public:
+        typedef HandlerAllocator<Handler> allocator_type;
+
+        AllocHandler(HandlerMemory &memory_, Handler handler_) : memory(&memory_), handler(std::move(handler_)) {}
+
+        allocator_type get_allocator() const { return allocator_type(*memory); }
+
+        template <typename... Args> void operator()(Args &&... args) { handler(std::forward<Args>(args)...); }
+
+        friend void *asio_handler_allocate(std::size_t size, AllocHandler *self) { return self->memory->allocate(size); }
+
+        friend void asio_handler_deallocate(void *pointer, std::size_t size, AllocHandler *self) { self->memory->deallocate(pointer); }
+
+      private:
+        HandlerMemory *memory;
+        Handler handler;
+    };
+
+    template <typename Handler> inline AllocHandler<typename std::decay<Handler>::type> make_alloc_handler(HandlerMemory &memory, Handler &&handler) { return AllocHandler<typename std::decay<Handler>::type>(memory, std::forward<Handler>(handler)); }
+}; // namespace helpers
+
+#endif
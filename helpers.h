@@ -29,10 +29,75 @@
 #define HELPERS_H
 
 #include <cstdint>
+#include <cstring>
 #include <vector>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace helpers {
     typedef std::vector<std::uint8_t> bytebuf;
+
+    // a non-owning, read-only view of a contiguous run of bytes
+    // (a minimal stand-in for C++20's std::span<const std::uint8_t>)
+    class bytespan {
+      public:
+        bytespan() : ptr(nullptr), len(0) {}
+        bytespan(const std::uint8_t *ptr_, std::size_t len_) : ptr(ptr_), len(len_) {}
+        bytespan(const bytebuf &buf) : ptr(buf.data()), len(buf.size()) {}
+
+        const std::uint8_t *data() const { return ptr; }
+        std::size_t size() const { return len; }
+        bool empty() const { return (len == 0); }
+
+        const std::uint8_t *begin() const { return ptr; }
+        const std::uint8_t *end() const { return ptr + len; }
+
+        const std::uint8_t &operator[](std::size_t i) const { return ptr[i]; }
+
+      private:
+        const std::uint8_t *ptr;
+        std::size_t len;
+    };
+
+    // the smallest power of two that is at least n
+    inline std::size_t round_up_pow2(std::size_t n) {
+        std::size_t size = 1;
+        while (size < n)
+            size <<= 1;
+        return size;
+    }
+
+    // Return a pointer to the first 0x1A byte in [p, end), or end if there is none.
+    // This is the hot loop of Beast deframing, so use SIMD where we have it.
+    inline const std::uint8_t *find_1a(const std::uint8_t *p, const std::uint8_t *end) {
+#if defined(__AVX2__)
+        const __m256i needle32 = _mm256_set1_epi8(0x1A);
+        while (end - p >= 32) {
+            unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), needle32));
+            if (mask)
+                return p + __builtin_ctz(mask);
+            p += 32;
+        }
+#endif
+#if defined(__SSE2__)
+        const __m128i needle16 = _mm_set1_epi8(0x1A);
+        while (end - p >= 16) {
+            unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle16));
+            if (mask)
+                return p + __builtin_ctz(mask);
+            p += 16;
+        }
+#endif
+        // scalar fallback / tail; libc's memchr is usually vectorized too
+        if (p == end)
+            return end;
+        const void *q = std::memchr(p, 0x1A, end - p);
+        return q ? static_cast<const std::uint8_t *>(q) : end;
+    }
 };
 
 #endif
@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+
+# This script checks that the link protocol (see "Chaining with the link
+# protocol" in README.md) delivers everything across an outage. It feeds
+# numbered messages to one beast-splitter with a link=on listener, connects a
+# second beast-splitter to it with --net ...:link through a proxy, and reads
+# from the second splitter's --listen port. Partway through, the proxy cuts
+# the link; once the second splitter has reconnected and resumed, the client
+# must have seen every message exactly once, in order.
+#
+# The --net side waits 60 seconds before reconnecting, so this takes a
+# little over a minute. It exits with status 1 if anything was lost.
+#
+# usage: link-test.py [path to beast-splitter]
+
+import os
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+SPLITTER = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(os.path.abspath(__file__)), 'beast-splitter')
+FEED_PORT = 30205      # first splitter's --net connects here
+LINK_PORT = 30206      # first splitter's link=on listener
+PROXY_PORT = 30207     # second splitter's --net ...:link connects here
+CLIENT_PORT = 30208    # second splitter's --listen
+
+RATE = 200             # messages per second
+RUN_BEFORE_CUT = 5     # seconds
+RUN_AFTER_RESUME = 5   # seconds
+RECONNECT_WAIT = 75    # seconds; the --net side retries after 60
+
+# a DF17 message with a good CRC, so that the default filter passes it
+SAMPLE = bytes.fromhex('8D4840D6202CC371C32CE0576098')
+
+
+def listener(port):
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(('127.0.0.1', port))
+    s.listen(5)
+    return s
+
+
+def drain(sock):
+    try:
+        while sock.recv(4096):
+            pass
+    except OSError:
+        pass
+
+
+def frame(seq):
+    # mode S long, with the sequence number as the timestamp
+    body = bytes([0x33]) + seq.to_bytes(6, 'big') + bytes([0x80]) + SAMPLE
+    return b'\x1a' + body.replace(b'\x1a', b'\x1a\x1a')
+
+
+def feeder(server, stop):
+    conn, _ = server.accept()
+    threading.Thread(target=drain, args=(conn,), daemon=True).start()
+    seq = 1
+    per_burst = RATE // 10
+    while not stop.is_set():
+        conn.sendall(b''.join(frame(seq + i) for i in range(per_burst)))
+        seq += per_burst
+        time.sleep(0.1)
+
+
+class Proxy:
+    def __init__(self, server):
+        self.server = server
+        self.sockets = []
+        self.lock = threading.Lock()
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            down, _ = self.server.accept()
+            up = socket.create_connection(('127.0.0.1', LINK_PORT))
+            with self.lock:
+                self.sockets += [down, up]
+            threading.Thread(target=self.pump, args=(down, up), daemon=True).start()
+            threading.Thread(target=self.pump, args=(up, down), daemon=True).start()
+
+    def pump(self, src, dst):
+        try:
+            while True:
+                data = src.recv(65536)
+                if not data:
+                    break
+                dst.sendall(data)
+        except OSError:
+            pass
+
+    def cut(self):
+        with self.lock:
+            for s in self.sockets:
+                try:
+                    s.shutdown(socket.SHUT_RDWR)
+                except OSError:
+                    pass
+                s.close()
+            self.sockets = []
+
+
+def connect(port):
+    give_up = time.time() + 10
+    while True:
+        try:
+            return socket.create_connection(('127.0.0.1', port))
+        except ConnectionRefusedError:
+            if time.time() > give_up:
+                raise
+            time.sleep(0.1)
+
+
+def reader(sock, seen):
+    # deframe Beast messages, keeping the sequence numbers of mode S long
+    # frames
+    buf = b''
+    while True:
+        try:
+            data = sock.recv(65536)
+        except OSError:
+            return
+        if not data:
+            return
+        buf += data
+
+        i = 0
+        while True:
+            start = buf.find(b'\x1a', i)
+            if start < 0 or start + 1 >= len(buf):
+                buf = buf[start:] if start >= 0 else b''
+                break
+            if buf[start + 1] != 0x33:
+                i = start + 1
+                continue
+
+            # unescape the 21 bytes after the type
+            body = bytearray()
+            j = start + 2
+            while len(body) < 21 and j < len(buf):
+                if buf[j] == 0x1a:
+                    if j + 1 >= len(buf):
+                        break
+                    j += 1
+                body.append(buf[j])
+                j += 1
+            if len(body) < 21:
+                buf = buf[start:]
+                break
+
+            seen.append(int.from_bytes(body[0:6], 'big'))
+            i = j
+
+
+def main():
+    stop = threading.Event()
+    threading.Thread(target=feeder, args=(listener(FEED_PORT), stop), daemon=True).start()
+    proxy = Proxy(listener(PROXY_PORT))
+
+    a = subprocess.Popen([SPLITTER, '--net', '127.0.0.1:%d' % FEED_PORT, '--listen', '127.0.0.1:%d::link=on' % LINK_PORT], stderr=subprocess.DEVNULL)
+    connect(LINK_PORT).close()
+    b = subprocess.Popen([SPLITTER, '--net', '127.0.0.1:%d:link' % PROXY_PORT, '--listen', '127.0.0.1:%d' % CLIENT_PORT], stderr=subprocess.PIPE, text=True)
+    b_log = []
+    threading.Thread(target=lambda: b_log.extend(b.stderr), daemon=True).start()
+
+    try:
+        seen = []
+        threading.Thread(target=reader, args=(connect(CLIENT_PORT), seen), daemon=True).start()
+
+        time.sleep(RUN_BEFORE_CUT)
+        if not seen:
+            print('FAIL: the client received nothing before the link was cut')
+            return 1
+        print('cutting the link after %d messages' % len(seen))
+        proxy.cut()
+
+        give_up = time.time() + RECONNECT_WAIT
+        while not any('resumed link' in line for line in b_log):
+            if time.time() > give_up:
+                print('FAIL: the link was not resumed')
+                return 1
+            time.sleep(1)
+        time.sleep(RUN_AFTER_RESUME)
+    finally:
+        stop.set()
+        for p in (a, b):
+            p.terminate()
+            p.wait()
+
+    for line in b_log:
+        if 'link' in line or 'drop' in line:
+            print('splitter: ' + line.rstrip())
+
+    if not seen:
+        print('FAIL: the client received nothing')
+        return 1
+
+    expected = list(range(seen[0], seen[-1] + 1))
+    if seen != expected:
+        missing = len(set(expected) - set(seen))
+        print('FAIL: the client received %d messages from %d to %d, with %d missing and %d duplicated or out of order' % (len(seen), seen[0], seen[-1], missing, len(seen) - (len(expected) - missing)))
+        return 1
+
+    print('OK: the client received all %d messages from %d to %d' % (len(seen), seen[0], seen[-1]))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
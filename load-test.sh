@@ -0,0 +1,43 @@
+#!/bin/sh
+
+# This script compares client write backends under load: for each client
+# count, it runs beast-load against a beast-splitter with and without
+# --io-uring. Build first with "make IO_URING=1 beast-splitter beast-load".
+#
+# With a splitter built with ALLOC_TRACE=1 as well, set ALLOC_TRACE_MAX_ALLOCS
+# and/or ALLOC_TRACE_MAX_COPIED to a ceiling per message (see alloc_trace.h).
+# The splitter then exits with status 3 if a run goes over either one, and
+# this script stops there with a non-zero status. The splitter's log is kept
+# in load-test.log, and its alloc trace lines are shown after each run.
+#
+# Extra arguments are passed to beast-load, e.g. --rate 2000 --duration 30
+
+TOP=`dirname $0`
+CLIENTS=${CLIENTS:-1000 5000 10000}
+LOG=${LOG:-load-test.log}
+
+: > $LOG
+for n in $CLIENTS
+do
+    for backend in epoll io_uring
+    do
+        if [ $backend = io_uring ]
+        then
+            extra=--io-uring
+        else
+            extra=
+        fi
+
+        printf "%-8s " $backend
+        $TOP/beast-load --clients $n "$@" -- $TOP/beast-splitter --net 127.0.0.1:30005 --listen 127.0.0.1:30105 $extra 2>$LOG.run
+        status=$?
+        grep -e "^alloc trace" -e "^beast-load" $LOG.run | sed 's/^/    /'
+        cat $LOG.run >> $LOG
+        rm -f $LOG.run
+        if [ $status -ne 0 ]
+        then
+            echo "$backend with $n clients failed, see $LOG" >&2
+            exit $status
+        fi
+    done
+done
@@ -23,6 +23,7 @@
 // OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include "alloc_trace.h"
 #include "modes_filter.h"
 
 #include <iostream>
@@ -83,16 +84,32 @@ namespace modes {
 
     FilterDistributor::FilterDistributor() : next_handle(0) {}
 
-    void FilterDistributor::set_filter_notifier(FilterNotifier f) { filter_notifier = f; }
+    void FilterDistributor::set_filter_notifier(FilterNotifier f) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        filter_notifier = f;
+    }
 
     FilterDistributor::handle FilterDistributor::add_client(MessageNotifier message_notifier, const Filter &initial_filter) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+
+        handle h = next_handle++;
+        clients[h] = {message_notifier, BatchNotifier(), initial_filter, false};
+        update_upstream_filter();
+        return h;
+    }
+
+    FilterDistributor::handle FilterDistributor::add_batch_client(BatchNotifier batch_notifier, const Filter &initial_filter) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+
         handle h = next_handle++;
-        clients[h] = {message_notifier, initial_filter, false};
+        clients[h] = {MessageNotifier(), batch_notifier, initial_filter, false};
         update_upstream_filter();
         return h;
     }
 
     void FilterDistributor::update_client_filter(handle h, const Filter &new_filter) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+
         auto i = clients.find(h);
         if (i == clients.end())
             return;
@@ -109,6 +126,8 @@ namespace modes {
     }
 
     void FilterDistributor::remove_client(handle h) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+
         auto i = clients.find(h);
         if (i == clients.end())
             return;
@@ -122,10 +141,59 @@ namespace modes {
     }
 
     void FilterDistributor::broadcast(const Message &message) {
+        helpers::alloc_trace::Scope trace(helpers::alloc_trace::Tag::DISTRIBUTE);
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+
+        for (auto i = clients.begin(); i != clients.end();) {
+            client &c = i->second;
+            if (!c.deleted && c.filter(message)) {
+                if (c.batch_notifier) {
+                    selected.assign(1, &message);
+                    c.batch_notifier(selected);
+                } else {
+                    c.notifier(message);
+                }
+            }
+
+            if (c.deleted)
+                clients.erase(i++);
+            else
+                ++i;
+        }
+    }
+
+    void FilterDistributor::broadcast_batch(const MessageBatch &batch) {
+        helpers::alloc_trace::Scope trace(helpers::alloc_trace::Tag::DISTRIBUTE);
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+
+        // clients often share the same filter (e.g. everyone connected
+        // to one listener), so reuse the previous selection when we can
+        bool have_selection = false;
+        Filter selected_filter;
+
         for (auto i = clients.begin(); i != clients.end();) {
             client &c = i->second;
-            if (!c.deleted && c.filter(message))
-                c.notifier(message);
+            if (!c.deleted && c.batch_notifier) {
+                if (!have_selection || selected_filter != c.filter) {
+                    selected.clear();
+                    for (const auto &message : batch) {
+                        if (c.filter(message))
+                            selected.push_back(&message);
+                    }
+                    selected_filter = c.filter;
+                    have_selection = true;
+                }
+
+                if (!selected.empty())
+                    c.batch_notifier(selected);
+            } else if (!c.deleted) {
+                for (const auto &message : batch) {
+                    if (c.deleted)
+                        break;
+                    if (c.filter(message))
+                        c.notifier(message);
+                }
+            }
 
             if (c.deleted)
                 clients.erase(i++);
@@ -29,6 +29,7 @@
 #define MODES_FILTER_H
 
 #include <array>
+#include <mutex>
 #include <ostream>
 
 #include "modes_message.h"
@@ -79,11 +80,16 @@ namespace modes {
 
     std::ostream &operator<<(std::ostream &os, const Filter &f);
 
+    // Tracks a set of clients and their filters, and delivers messages
+    // to the clients that want them. Clients may be added, updated and
+    // removed from any thread, including from within a notifier.
     class FilterDistributor {
       public:
         typedef unsigned int handle;
         typedef std::function<void(const Filter &)> FilterNotifier;
         typedef std::function<void(const Message &)> MessageNotifier;
+        typedef std::vector<const Message *> MessageRefs;
+        typedef std::function<void(const MessageRefs &)> BatchNotifier;
 
         FilterDistributor();
         FilterDistributor(const FilterDistributor &that) = delete;
@@ -92,24 +98,37 @@ namespace modes {
         void set_filter_notifier(FilterNotifier f);
 
         handle add_client(MessageNotifier message_notifier, const Filter &initial_filter);
+        handle add_batch_client(BatchNotifier batch_notifier, const Filter &initial_filter);
         void update_client_filter(handle client, const Filter &new_filter);
         void remove_client(handle client);
 
         void broadcast(const Message &message);
 
+        // deliver a whole batch; batch clients get all the messages
+        // that pass their filter in a single call, other clients get
+        // one call per message
+        void broadcast_batch(const MessageBatch &batch);
+
       private:
         void update_upstream_filter();
 
+        // recursive, as notifiers may add or remove clients
+        std::recursive_mutex mutex;
+
         handle next_handle;
         FilterNotifier filter_notifier;
 
         struct client {
             MessageNotifier notifier;
+            BatchNotifier batch_notifier;
             Filter filter;
             bool deleted;
         };
 
         std::map<handle, client> clients;
+
+        // scratch space for broadcast_batch, reused between calls
+        MessageRefs selected;
     };
 }; // namespace modes
 
@@ -28,14 +28,18 @@
 #ifndef MODES_MESSAGE_H
 #define MODES_MESSAGE_H
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <map>
 #include <ostream>
 #include <vector>
 
 #include "crc.h"
+#include "helpers.h"
 
 namespace modes {
     // the type of one message
@@ -79,14 +83,34 @@ namespace modes {
         }
     }
 
+    inline std::size_t payload_size(MessageType type) {
+        // return the number of bytes carried in Message::data() for a message
+        // of the given type; position messages also carry the 7 bytes that
+        // would normally be timestamp/signal metadata
+
+        if (type == MessageType::POSITION)
+            return message_size(type) + 7;
+        else
+            return message_size(type);
+    }
+
+    // the largest possible payload_size()
+    const std::size_t max_payload_size = 21;
+
     // a single message
+    //
+    // All storage is inline, so constructing or copying a message never
+    // allocates. Messages are immutable once constructed (the CRC checks
+    // are done up front), so they can safely be shared between threads.
     class Message {
       public:
-        Message() : m_type(MessageType::INVALID), m_timestamp_type(TimestampType::UNKNOWN), m_timestamp(0), m_signal(0) {}
+        Message() : m_type(MessageType::INVALID), m_timestamp_type(TimestampType::UNKNOWN), m_timestamp(0), m_signal(0), m_length(0), m_serial(0) {}
 
-        Message(MessageType type_, TimestampType timestamp_type_, std::uint64_t timestamp_, std::uint8_t signal_, std::vector<std::uint8_t> &&data_) : m_type(type_), m_timestamp_type(timestamp_type_), m_timestamp(timestamp_), m_signal(signal_), m_data(std::move(data_)) { assert(m_data.size() == message_size(m_type)); }
-
-        Message(MessageType type_, TimestampType timestamp_type_, std::uint64_t timestamp_, std::uint8_t signal_, const std::vector<std::uint8_t> &data_) : m_type(type_), m_timestamp_type(timestamp_type_), m_timestamp(timestamp_), m_signal(signal_), m_data(data_), m_residual(0xFFFFFFFF) { assert(m_data.size() == message_size(m_type)); }
+        Message(MessageType type_, TimestampType timestamp_type_, std::uint64_t timestamp_, std::uint8_t signal_, helpers::bytespan data_, std::uint64_t serial_ = 0) : m_type(type_), m_timestamp_type(timestamp_type_), m_timestamp(timestamp_), m_signal(signal_), m_length((std::uint8_t)std::min(data_.size(), max_payload_size)), m_serial(serial_) {
+            assert(data_.size() == payload_size(m_type));
+            std::memcpy(m_data.data(), data_.data(), m_length);
+            check_crc();
+        }
 
         MessageType type() const { return m_type; }
 
@@ -96,7 +120,20 @@ namespace modes {
 
         std::uint8_t signal() const { return m_signal; }
 
-        const std::vector<std::uint8_t> &data() const { return m_data; }
+        // a number that uniquely identifies this message within the
+        // lifetime of the process, or 0 if it has not been assigned one
+        std::uint64_t serial() const { return m_serial; }
+
+        helpers::bytespan data() const { return helpers::bytespan(m_data.data(), m_length); }
+
+        // the frame exactly as it was received from upstream, escaping
+        // and all, or an empty span if that is not available. This points
+        // into the input's read buffer, so it is only valid while the
+        // input is delivering the batch; copies of the message drop it.
+        helpers::bytespan raw() const { return m_raw.span; }
+
+        // for inputs, before the message is passed on
+        void set_raw(helpers::bytespan raw_) { m_raw.span = raw_; }
 
         int df() const {
             switch (m_type) {
@@ -108,82 +145,79 @@ namespace modes {
             }
         }
 
-        bool crc_bad() const {
-            switch (df()) {
-            case 11:
-                return (crc_residual() & 0xFFFF80) != 0;
-            case 17:
-            case 18:
-                return crc_residual() != 0;
-            default:
-                return false;
-            }
-        }
-
-        bool crc_correctable() const { return (crc_correctable_bit() >= 0); }
-
-        const std::vector<std::uint8_t> &corrected_data() const {
-            if (!crc_bad()) {
-                return m_data;
-            }
-
-            if (m_corrected_data.size() != 0) {
-                // already corrected
-                return m_corrected_data;
-            }
+        bool crc_bad() const { return m_crc_bad; }
 
-            auto bit = crc_correctable_bit();
-            if (bit < 0) {
-                // not correctable
-                return m_corrected_data; // empty vector
-            }
+        bool crc_correctable() const { return (m_correctable_bit >= 0); }
 
-            // copy the original data and do FEC
-            m_corrected_data = m_data;
-            m_corrected_data[bit / 8] ^= (1 << (7 - (bit & 7)));
-            return m_corrected_data;
+        // returns the data with FEC applied, or an empty span if the
+        // message has a bad CRC that can't be corrected
+        helpers::bytespan corrected_data() const {
+            if (!m_crc_bad)
+                return data();
+            if (m_correctable_bit < 0)
+                return helpers::bytespan(); // not correctable
+            return helpers::bytespan(m_corrected_data.data(), m_length);
         }
 
       private:
-        std::uint32_t crc_residual() const {
-            if (m_residual == 0xFFFFFFFF) {
-                m_residual = crc::message_residual(m_data);
+        // a span that does not survive copying the message
+        struct transient_span {
+            transient_span() {}
+            transient_span(const transient_span &) {}
+            transient_span &operator=(const transient_span &) {
+                span = helpers::bytespan();
+                return *this;
             }
-            return m_residual;
-        }
 
-        int crc_correctable_bit() const {
-            if (m_correctable_bit == -2) {
-                switch (df()) {
-                case 11:
-                    // For DF11, don't mask off the lower 7 bits
-                    // i.e. try to correct under the assumption that IID=0
-                    m_correctable_bit = crc::correctable_bit_short(crc_residual());
-                    break;
-                case 17:
-                case 18:
-                    m_correctable_bit = crc::correctable_bit_long(crc_residual());
-                    break;
-                default:
-                    m_correctable_bit = -1;
-                    break;
-                }
+            helpers::bytespan span;
+        };
+
+        void check_crc() {
+            std::uint32_t residual;
+            switch (df()) {
+            case 11:
+                residual = crc::message_residual(data());
+                m_crc_bad = (residual & 0xFFFF80) != 0;
+                // For DF11, don't mask off the lower 7 bits
+                // i.e. try to correct under the assumption that IID=0
+                m_correctable_bit = (residual != 0 ? crc::correctable_bit_short(residual) : -1);
+                break;
+            case 17:
+            case 18:
+                residual = crc::message_residual(data());
+                m_crc_bad = (residual != 0);
+                m_correctable_bit = (residual != 0 ? crc::correctable_bit_long(residual) : -1);
+                break;
+            default:
+                m_crc_bad = false;
+                m_correctable_bit = -1;
+                break;
             }
 
-            return m_correctable_bit;
+            if (m_crc_bad && m_correctable_bit >= 0) {
+                // copy the original data and do FEC
+                m_corrected_data = m_data;
+                m_corrected_data[m_correctable_bit / 8] ^= (1 << (7 - (m_correctable_bit & 7)));
+            }
         }
 
         MessageType m_type;
         TimestampType m_timestamp_type;
         std::uint64_t m_timestamp;
         std::uint8_t m_signal;
-        std::vector<std::uint8_t> m_data;
-
-        mutable std::uint32_t m_residual = 0xFFFFFFFF;
-        mutable int m_correctable_bit = -2;
-        mutable std::vector<std::uint8_t> m_corrected_data;
+        std::uint8_t m_length;
+        std::array<std::uint8_t, max_payload_size> m_data;
+        std::uint64_t m_serial;
+
+        bool m_crc_bad = false;
+        int m_correctable_bit = -1;
+        std::array<std::uint8_t, max_payload_size> m_corrected_data;
+        transient_span m_raw;
     };
 
+    // a group of messages deframed together, e.g. from a single read
+    typedef std::vector<Message> MessageBatch;
+
     std::ostream &operator<<(std::ostream &os, const Message &message);
 }; // namespace modes
 
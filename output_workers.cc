@@ -0,0 +1,257 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <iostream>
+
+#include <unistd.h>
+
+#include "output_workers.h"
+
+namespace asio = boost::asio;
+using boost::asio::ip::tcp;
+
+namespace beast {
+    OutputWorkers::OutputWorkers(asio::io_service &service_, modes::FilterDistributor &upstream_, unsigned count) : service(service_), upstream(upstream_), upstream_handle(0), max_batches(count * (ring_size + 1)), worker_failed(false) {
+        for (unsigned i = 0; i < count; ++i)
+            workers.emplace_back(new worker(i, max_batches));
+        free_batches.reserve(max_batches + 1);
+    }
+
+    void OutputWorkers::start() {
+        auto self(shared_from_this());
+
+        // nothing is wanted until some connections turn up
+        upstream_handle = upstream.add_batch_client(std::bind(&OutputWorkers::publish, self, std::placeholders::_1), modes::Filter());
+
+        for (auto &w : workers) {
+            worker *wp = w.get();
+            w->distributor.set_filter_notifier([this, self, wp](const modes::Filter &filter) { update_filter(*wp, filter); });
+            w->work.reset(new asio::io_service::work(w->service));
+            w->thread = std::thread(std::bind(&OutputWorkers::run, self, std::ref(*w)));
+        }
+    }
+
+    void OutputWorkers::stop() {
+        upstream.remove_client(upstream_handle);
+
+        for (auto &w : workers) {
+            w->work.reset();
+            w->service.stop();
+        }
+
+        for (auto &w : workers) {
+            if (w->thread.joinable())
+                w->thread.join();
+        }
+    }
+
+    void OutputWorkers::run(worker &w) {
+        try {
+            w.service.run();
+        } catch (std::exception &e) {
+            std::cerr << "Output worker " << w.index << ": uncaught exception: " << e.what() << std::endl;
+            worker_failed = true;
+            service.stop();
+        }
+    }
+
+    void OutputWorkers::attach(SocketOutput::socket_type &&socket, const std::string &peer, const Settings &settings, const OutputOptions &options, std::function<void()> close_notifier) {
+        unsigned least = 0;
+        for (unsigned i = 1; i < workers.size(); ++i) {
+            if (workers[i]->connections < workers[least]->connections)
+                least = i;
+        }
+
+        attach(least, std::move(socket), peer, settings, options, close_notifier);
+    }
+
+    void OutputWorkers::attach(unsigned index, SocketOutput::socket_type &&socket, const std::string &peer, const Settings &settings, const OutputOptions &options, std::function<void()> close_notifier) {
+        worker *w = workers.at(index).get();
+        ++w->connections;
+
+        if (&socket.get_executor().context() == &w->service) {
+            // accepted by this worker, we're already on the right thread
+            start_output(*w, std::move(socket), peer, settings, options, close_notifier);
+            return;
+        }
+
+        // The socket belongs to the caller's io_service; take the
+        // descriptor away from it and give it to the worker's.
+        boost::system::error_code ec;
+        SocketOutput::socket_type::endpoint_type local = socket.local_endpoint(ec);
+        if (ec) {
+            std::cerr << "could not hand over connection to output worker " << w->index << ": " << ec.message() << std::endl;
+            socket.close(ec);
+            --w->connections;
+            return;
+        }
+
+        int fd = socket.release();
+
+        auto self(shared_from_this());
+        w->service.post([this, self, w, local, fd, peer, settings, options, close_notifier] {
+            SocketOutput::socket_type output_socket(w->service);
+            boost::system::error_code ec;
+            output_socket.assign(local.protocol(), fd, ec);
+            if (ec) {
+                std::cerr << "could not hand over connection to output worker " << w->index << ": " << ec.message() << std::endl;
+                ::close(fd);
+                --w->connections;
+                return;
+            }
+
+            start_output(*w, std::move(output_socket), peer, settings, options, close_notifier);
+        });
+    }
+
+    void OutputWorkers::start_output(worker &w, SocketOutput::socket_type &&socket, const std::string &peer, const Settings &settings, const OutputOptions &options, std::function<void()> close_notifier) {
+        auto self(shared_from_this());
+        worker *wp = &w;
+
+        try {
+            SocketOutput::attach(w.service, std::move(socket), peer, w.distributor, settings, options, [this, self, wp, close_notifier] {
+                --wp->connections;
+                if (close_notifier)
+                    close_notifier();
+            });
+        } catch (boost::system::system_error &err) {
+            // most likely the peer went away already
+            std::cerr << "could not start output on worker " << w.index << ": " << err.what() << std::endl;
+            --w.connections;
+        }
+    }
+
+    void OutputWorkers::listen(const tcp::endpoint &endpoint, const Settings &settings, const OutputOptions &options) {
+        for (auto &w : workers) {
+            auto listener = SocketListener::create(w->service, endpoint, w->distributor, settings, options);
+            listener->set_reuse_port(true);
+            listener->set_workers(shared_from_this(), w->index);
+            listener->start();
+        }
+    }
+
+    void OutputWorkers::publish(const modes::FilterDistributor::MessageRefs &messages) {
+        // connections come and go on the workers' threads, so decide
+        // up front who gets this batch
+        unsigned users = 0;
+        for (auto &w : workers) {
+            w->publishing = (w->connections != 0);
+            if (w->publishing)
+                ++users;
+        }
+        if (users == 0)
+            return;
+
+        // copy the batch once; the workers share it read-only
+        batch *b = allocate_batch();
+        b->messages.clear();
+        for (auto message : messages)
+            b->messages.push_back(*message);
+
+        // set before anyone can see it, so that workers that finish
+        // quickly can't release it while we are still handing it out
+        b->users.store(users, std::memory_order_relaxed);
+        auto self(shared_from_this());
+
+        for (auto &w : workers) {
+            if (!w->publishing)
+                continue;
+
+            batch *item = b;
+            if (!w->ring.push(std::move(item))) {
+                if (b->users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    free_batches.push_back(b);
+
+                if (!w->behind) {
+                    std::cerr << "Output worker " << w->index << " is not keeping up, dropping messages" << std::endl;
+                    w->behind = true;
+                }
+                ++w->dropped_batches;
+                continue;
+            }
+
+            if (w->behind) {
+                std::cerr << "Output worker " << w->index << " caught up, " << w->dropped_batches << " batches dropped so far" << std::endl;
+                w->behind = false;
+            }
+
+            // wake the worker, unless it is already going to look at the ring
+            if (!w->drain_pending.exchange(true))
+                w->service.post(helpers::make_alloc_handler(w->drain_memory, std::bind(&OutputWorkers::drain, self, std::ref(*w))));
+        }
+    }
+
+    // Finds a batch to copy into, reusing one that the workers have
+    // finished with if possible. Input thread only.
+    OutputWorkers::batch *OutputWorkers::allocate_batch() {
+        if (free_batches.empty()) {
+            for (auto &w : workers) {
+                batch *b;
+                while (w->returned.pop(b))
+                    free_batches.push_back(b);
+            }
+        }
+
+        if (free_batches.empty()) {
+            // only while warming up, see max_batches
+            batches.emplace_back(new batch());
+            return batches.back().get();
+        }
+
+        batch *b = free_batches.back();
+        free_batches.pop_back();
+        return b;
+    }
+
+    void OutputWorkers::drain(worker &w) {
+        // clear the flag before looking at the ring, so that anything
+        // pushed after we find it empty gets a fresh drain posted. This
+        // is an exchange rather than a store so that it synchronizes
+        // with the producer's exchange, making its push visible to us.
+        w.drain_pending.exchange(false);
+
+        batch *b;
+        while (w.ring.pop(b)) {
+            w.distributor.broadcast_batch(b->messages);
+
+            // the last one to finish with it gives it back
+            if (b->users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                w.returned.push(std::move(b));
+        }
+    }
+
+    void OutputWorkers::update_filter(worker &w, const modes::Filter &filter) {
+        // held while updating upstream, so that concurrent updates from
+        // different workers can't be applied out of order
+        std::lock_guard<std::mutex> lock(filter_mutex);
+
+        w.filter = filter;
+
+        modes::Filter combined;
+        for (auto &other : workers)
+            combined.inplace_combine(other->filter);
+
+        upstream.update_client_filter(upstream_handle, combined);
+    }
+}; // namespace beast
@@ -0,0 +1,153 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef OUTPUT_WORKERS_H
+#define OUTPUT_WORKERS_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include "beast_output.h"
+#include "handler_memory.h"
+#include "modes_filter.h"
+#include "modes_message.h"
+#include "spsc_ring.h"
+
+namespace beast {
+    // Runs client connections on a fixed set of worker threads. Each
+    // worker has its own io_service and its own FilterDistributor, and
+    // owns a disjoint subset of the connections, so workers never
+    // contend with each other or with the input.
+    //
+    // The pool looks like a single batch client to the upstream
+    // distributor, with the combined filter of every connection. Each
+    // batch it receives is copied once and handed to every worker over
+    // a single-producer/single-consumer ring; the workers then do their
+    // own filtering and encoding. The copies are recycled: the last
+    // worker to finish with a batch hands it back over another ring.
+    class OutputWorkers : public std::enable_shared_from_this<OutputWorkers> {
+      public:
+        typedef std::shared_ptr<OutputWorkers> pointer;
+
+        // batches that may be waiting for each worker before we
+        // start dropping them
+        static const std::size_t ring_size = 1024;
+
+        // factory method, this class must always be constructed via make_shared
+        static pointer create(boost::asio::io_service &service, modes::FilterDistributor &upstream, unsigned count) { return pointer(new OutputWorkers(service, upstream, count)); }
+
+        void start();
+        void stop();
+
+        // true if a worker thread died with an exception
+        bool failed() const { return worker_failed; }
+
+        // Hands a newly connected socket over to the worker with the
+        // fewest connections, which creates and runs a SocketOutput for
+        // it (see SocketOutput::attach). close_notifier, if set, is called from that worker's
+        // thread when the connection closes.
+        void attach(SocketOutput::socket_type &&socket, const std::string &peer, const Settings &settings, const OutputOptions &options, std::function<void()> close_notifier);
+
+        // as above, but always uses the given worker
+        void attach(unsigned index, SocketOutput::socket_type &&socket, const std::string &peer, const Settings &settings, const OutputOptions &options, std::function<void()> close_notifier);
+
+        // Opens one SO_REUSEPORT acceptor per worker on the given
+        // endpoint, each running on its worker's io_service. The kernel
+        // then spreads new connections across the workers, and each
+        // connection stays on the worker that accepted it.
+        void listen(const boost::asio::ip::tcp::endpoint &endpoint, const Settings &settings, const OutputOptions &options);
+
+      private:
+        // a copied batch, shared by the workers it was handed to;
+        // users counts those that have yet to finish with it
+        struct batch {
+            modes::MessageBatch messages;
+            std::atomic<unsigned> users;
+        };
+
+        struct worker {
+            worker(unsigned index_, std::size_t max_batches) : index(index_), ring(ring_size), returned(max_batches + 1), drain_pending(false), connections(0), dropped_batches(0), behind(false), publishing(false) {}
+
+            unsigned index;
+            boost::asio::io_service service;
+            std::unique_ptr<boost::asio::io_service::work> work;
+            std::thread thread;
+            modes::FilterDistributor distributor;
+
+            // batches from the input thread, and those that this worker
+            // was the last to finish with, going back to it
+            helpers::SpscRing<batch *> ring;
+            helpers::SpscRing<batch *> returned;
+            std::atomic<bool> drain_pending;
+            helpers::HandlerMemory drain_memory;
+
+            std::atomic<unsigned> connections;
+
+            // the combined filter of this worker's connections,
+            // guarded by OutputWorkers::filter_mutex
+            modes::Filter filter;
+
+            // only touched by the input thread
+            std::uint64_t dropped_batches;
+            bool behind;
+            bool publishing; // the current batch is going to this worker
+        };
+
+        OutputWorkers(boost::asio::io_service &service_, modes::FilterDistributor &upstream_, unsigned count);
+
+        void run(worker &w);
+        void start_output(worker &w, SocketOutput::socket_type &&socket, const std::string &peer, const Settings &settings, const OutputOptions &options, std::function<void()> close_notifier);
+        void publish(const modes::FilterDistributor::MessageRefs &messages);
+        batch *allocate_batch();
+        void drain(worker &w);
+        void update_filter(worker &w, const modes::Filter &filter);
+
+        boost::asio::io_service &service;
+        modes::FilterDistributor &upstream;
+        modes::FilterDistributor::handle upstream_handle;
+
+        std::vector<std::unique_ptr<worker>> workers;
+
+        // every batch there is, and those free for reuse; only touched
+        // by the input thread. At most max_batches are in use at once,
+        // which is enough for every worker to have a full ring and one
+        // batch in hand, so there are never more than max_batches + 1.
+        std::size_t max_batches;
+        std::vector<std::unique_ptr<batch>> batches;
+        std::vector<batch *> free_batches;
+        std::mutex filter_mutex;
+        std::atomic<bool> worker_failed;
+    };
+}; // namespace beast
+
+#endif
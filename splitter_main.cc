@@ -23,20 +23,31 @@
 // OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include "alloc_trace.h"
 #include "beast_input.h"
 #include "beast_input_net.h"
 #include "beast_input_serial.h"
 #include "beast_output.h"
+#include "beast_output_shm.h"
+#include "beast_output_udp.h"
 #include "modes_filter.h"
+#include "output_workers.h"
 #include "status_writer.h"
+#include "uring_writer.h"
 
 #include <boost/asio/ip/address_v4.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/program_options.hpp>
 #include <boost/regex.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <thread>
 
 namespace po = boost::program_options;
 using boost::asio::ip::tcp;
@@ -44,28 +55,42 @@ using boost::asio::ip::tcp;
 struct net_option {
     std::string host;
     std::string port;
+    bool link;
 };
 
 struct output_option {
     std::string host;
     std::string port;
     beast::Settings settings;
+    beast::OutputOptions options;
 };
 
 struct listen_option : output_option {};
 struct connect_option : output_option {};
+struct udp_option : output_option {};
+
+struct path_option {
+    std::string path;
+    beast::Settings settings;
+    beast::OutputOptions options;
+};
+
+struct unix_listen_option : path_option {};
+struct seqpacket_listen_option : path_option {};
+struct shm_option : path_option {};
 
 // Specializations of validate for --listen / --connect / --net
 void validate(boost::any &v, const std::vector<std::string> &values, net_option *target_type, int) {
     po::validators::check_first_occurrence(v);
     const std::string &s = po::validators::get_single_string(values);
 
-    static const boost::regex r("([^:]+):(\\d+)");
+    static const boost::regex r("([^:]+):(\\d+)(:link)?");
     boost::smatch match;
     if (boost::regex_match(s, match, r)) {
         net_option o;
         o.host = match[1];
         o.port = match[2];
+        o.link = match[3].matched;
         v = boost::any(o);
     } else {
         throw po::validation_error(po::validation_error::invalid_option_value);
@@ -76,13 +101,40 @@ void validate(boost::any &v, const std::vector<std::string> &values, connect_opt
     po::validators::check_first_occurrence(v);
     const std::string &s = po::validators::get_single_string(values);
 
-    static const boost::regex r("([^:]+):(\\d+)(?::([a-zA-Z]+))?");
+    static const boost::regex r("([^:]+):(\\d+)(?::([a-zA-Z]*)(?::(.*))?)?");
     boost::smatch match;
     if (boost::regex_match(s, match, r)) {
         connect_option o;
         o.host = match[1];
         o.port = match[2];
         o.settings = beast::Settings(match[3]);
+        try {
+            o.options = beast::OutputOptions(match[4]);
+        } catch (std::invalid_argument &e) {
+            throw po::validation_error(po::validation_error::invalid_option_value);
+        }
+        v = boost::any(o);
+    } else {
+        throw po::validation_error(po::validation_error::invalid_option_value);
+    }
+}
+
+void validate(boost::any &v, const std::vector<std::string> &values, udp_option *target_type, int) {
+    po::validators::check_first_occurrence(v);
+    const std::string &s = po::validators::get_single_string(values);
+
+    static const boost::regex r("([^:]+):(\\d+)(?::([a-zA-Z]*)(?::(.*))?)?");
+    boost::smatch match;
+    if (boost::regex_match(s, match, r)) {
+        udp_option o;
+        o.host = match[1];
+        o.port = match[2];
+        o.settings = beast::Settings(match[3]);
+        try {
+            o.options = beast::OutputOptions(match[4]);
+        } catch (std::invalid_argument &e) {
+            throw po::validation_error(po::validation_error::invalid_option_value);
+        }
         v = boost::any(o);
     } else {
         throw po::validation_error(po::validation_error::invalid_option_value);
@@ -93,19 +145,64 @@ void validate(boost::any &v, const std::vector<std::string> &values, listen_opti
     po::validators::check_first_occurrence(v);
     const std::string &s = po::validators::get_single_string(values);
 
-    static const boost::regex r("(?:([^:]+):)?(\\d+)(?::([a-zA-Z]+))?");
+    static const boost::regex r("(?:([^:]+):)?(\\d+)(?::([a-zA-Z]*)(?::(.*))?)?");
     boost::smatch match;
     if (boost::regex_match(s, match, r)) {
         listen_option o;
         o.host = match[1];
         o.port = match[2];
         o.settings = beast::Settings(match[3]);
+        try {
+            o.options = beast::OutputOptions(match[4]);
+        } catch (std::invalid_argument &e) {
+            throw po::validation_error(po::validation_error::invalid_option_value);
+        }
         v = boost::any(o);
     } else {
         throw po::validation_error(po::validation_error::invalid_option_value);
     }
 }
 
+static bool parse_path_option(const std::string &s, path_option &o) {
+    static const boost::regex r("([^:]+)(?::([a-zA-Z]*)(?::(.*))?)?");
+    boost::smatch match;
+    if (!boost::regex_match(s, match, r))
+        return false;
+
+    o.path = match[1];
+    o.settings = beast::Settings(match[2]);
+    try {
+        o.options = beast::OutputOptions(match[3]);
+    } catch (std::invalid_argument &e) {
+        return false;
+    }
+    return true;
+}
+
+void validate(boost::any &v, const std::vector<std::string> &values, unix_listen_option *target_type, int) {
+    po::validators::check_first_occurrence(v);
+    unix_listen_option o;
+    if (!parse_path_option(po::validators::get_single_string(values), o))
+        throw po::validation_error(po::validation_error::invalid_option_value);
+    v = boost::any(o);
+}
+
+void validate(boost::any &v, const std::vector<std::string> &values, seqpacket_listen_option *target_type, int) {
+    po::validators::check_first_occurrence(v);
+    seqpacket_listen_option o;
+    if (!parse_path_option(po::validators::get_single_string(values), o))
+        throw po::validation_error(po::validation_error::invalid_option_value);
+    v = boost::any(o);
+}
+
+void validate(boost::any &v, const std::vector<std::string> &values, shm_option *target_type, int) {
+    po::validators::check_first_occurrence(v);
+    shm_option o;
+    if (!parse_path_option(po::validators::get_single_string(values), o))
+        throw po::validation_error(po::validation_error::invalid_option_value);
+    v = boost::any(o);
+}
+
 namespace beast {
     void validate(boost::any &v, const std::vector<std::string> &values, beast::Settings *target_type, long int) {
         po::validators::check_first_occurrence(v);
@@ -121,14 +218,59 @@ namespace beast {
 } // namespace beast
 
 #define EXIT_NO_RESTART (64)
+#define EXIT_ALLOC_CEILING (3)
+
+#ifdef ALLOC_TRACE
+// with ALLOC_TRACE=1, say how much we are allocating and copying every so often
+static void schedule_alloc_report(boost::asio::steady_timer &timer) {
+    timer.expires_from_now(std::chrono::seconds(10));
+    timer.async_wait([&timer](const boost::system::error_code &ec) {
+        if (ec)
+            return;
+        helpers::alloc_trace::report(std::cerr, false);
+        schedule_alloc_report(timer);
+    });
+}
+#endif
+
+// some output options only make sense for some kinds of output
+template <class T> static bool check_unsupported_option(const po::variables_map &opts, const char *name, bool beast::OutputOptions::*option, const char *description) {
+    if (!opts.count(name))
+        return true;
+
+    for (const auto &o : opts[name].as<std::vector<T>>()) {
+        if (o.options.*option) {
+            std::cerr << description << " is not supported with --" << name << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// the backlog records what the outputs that use it initially want
+template <class T> static void combine_backlog_filter(const po::variables_map &opts, const char *name, modes::Filter &filter, bool &wanted) {
+    if (!opts.count(name))
+        return;
+
+    for (const auto &o : opts[name].as<std::vector<T>>()) {
+        if (o.options.backlog) {
+            filter.inplace_combine(o.settings.to_filter());
+            wanted = true;
+        }
+    }
+}
 
 static int realmain(int argc, char **argv) {
     boost::asio::io_service io_service;
     modes::FilterDistributor distributor;
 
     po::options_description desc("Allowed options");
-    desc.add_options()("help", "produce help message")("serial", po::value<std::string>(), "read from given serial device")("net", po::value<net_option>(), "read from given network host:port")("status-file", po::value<std::string>(), "set path to status file")("fixed-baud", po::value<unsigned>()->default_value(0), "set a fixed baud rate, or 0 for autobauding")("listen", po::value<std::vector<listen_option>>(), "specify a [host:]port[:settings] to listen on")(
-        "connect", po::value<std::vector<connect_option>>(), "specify a host:port[:settings] to connect to")("force", po::value<beast::Settings>()->default_value(beast::Settings()), "specify settings to force on or off when configuring the Beast");
+    desc.add_options()("help", "produce help message")("serial", po::value<std::string>(), "read from given serial device")("net", po::value<net_option>(), "read from given network host:port[:link]")("status-file", po::value<std::string>(), "set path to status file")("fixed-baud", po::value<unsigned>()->default_value(0), "set a fixed baud rate, or 0 for autobauding")("listen", po::value<std::vector<listen_option>>(), "specify a [host:]port[:settings[:options]] to listen on")(
+        "connect", po::value<std::vector<connect_option>>(), "specify a host:port[:settings[:options]] to connect to")("listen-unix", po::value<std::vector<unix_listen_option>>(), "specify a path[:settings[:options]] for a Unix domain socket to listen on")("listen-seqpacket", po::value<std::vector<seqpacket_listen_option>>(), "as --listen-unix, but using a SOCK_SEQPACKET socket that delivers whole messages in each packet")("shm", po::value<std::vector<shm_option>>(), "specify a path[:settings[:options]] for a shared-memory ring of messages (see beast_shm.h)")("udp", po::value<std::vector<udp_option>>(), "specify a host:port[:settings[:options]] to send UDP datagrams to")("force", po::value<beast::Settings>()->default_value(beast::Settings()), "specify settings to force on or off when configuring the Beast")(
+        "threads", po::value<unsigned>()->default_value(1), "number of threads to handle input and output on")("output-workers", po::value<unsigned>()->default_value(0), "number of dedicated threads to run client connections on, or 0 to run them alongside the input")("reuse-port", po::bool_switch(), "with --output-workers, give each worker its own SO_REUSEPORT acceptor for each --listen address")("io-uring", po::bool_switch(), "write to clients using io_uring, if the kernel supports it")(
+        "backlog", po::value<unsigned>()->default_value(30), "seconds of recent messages to send to new clients of outputs with backlog=on")("backlog-size", po::value<unsigned>()->default_value(65536), "most messages to keep for backlog=on outputs, which bounds the memory used")(
+        "snapshot", po::bool_switch(), "keep the latest messages for each aircraft, for clients that ask for a snapshot")("snapshot-aircraft", po::value<unsigned>()->default_value(4096), "most aircraft to keep in the snapshot table")("snapshot-age", po::value<unsigned>()->default_value(60), "seconds after which an aircraft's messages are dropped from the snapshot table");
 
     po::variables_map opts;
 
@@ -146,8 +288,8 @@ static int realmain(int argc, char **argv) {
         return EXIT_NO_RESTART;
     }
 
-    if (!opts.count("connect") && !opts.count("listen")) {
-        std::cerr << "At least one --connect or --listen argument is needed" << std::endl;
+    if (!opts.count("connect") && !opts.count("listen") && !opts.count("listen-unix") && !opts.count("listen-seqpacket") && !opts.count("udp") && !opts.count("shm")) {
+        std::cerr << "At least one --connect, --listen, --listen-unix, --listen-seqpacket, --udp or --shm argument is needed" << std::endl;
         std::cerr << desc << std::endl;
         return EXIT_NO_RESTART;
     }
@@ -157,7 +299,9 @@ static int realmain(int argc, char **argv) {
         input = beast::SerialInput::create(io_service, opts["serial"].as<std::string>(), opts["fixed-baud"].as<unsigned>(), opts["force"].as<beast::Settings>());
     } else if (opts.count("net")) {
         auto net = opts["net"].as<net_option>();
-        input = beast::NetInput::create(io_service, net.host, net.port, opts["force"].as<beast::Settings>());
+        auto netinput = beast::NetInput::create(io_service, net.host, net.port, opts["force"].as<beast::Settings>());
+        netinput->set_link(net.link);
+        input = netinput;
     } else {
         std::cerr << "A --serial or --net argument is needed" << std::endl;
         std::cerr << desc << std::endl;
@@ -166,10 +310,97 @@ static int realmain(int argc, char **argv) {
 
     distributor.set_filter_notifier(std::bind(&beast::BeastInput::set_filter, input, std::placeholders::_1));
 
+    if (opts["reuse-port"].as<bool>() && opts["output-workers"].as<unsigned>() == 0) {
+        std::cerr << "--reuse-port needs --output-workers" << std::endl;
+        std::cerr << desc << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
+    if (opts["io-uring"].as<bool>()) {
+        if (!beast::UringWriter::supported()) {
+            std::cerr << "--io-uring is not supported by this build" << std::endl;
+            return EXIT_NO_RESTART;
+        }
+
+        // this must be set before any outputs are created
+        beast::UringWriter::enable(true);
+    }
+
+    beast::OutputWorkers::pointer workers;
+    if (opts["output-workers"].as<unsigned>() > 0) {
+        workers = beast::OutputWorkers::create(io_service, distributor, opts["output-workers"].as<unsigned>());
+        workers->start();
+    }
+
     tcp::resolver resolver(io_service);
 
+    // link=on only makes sense where the other end connects to us
+    const auto link = &beast::OutputOptions::link;
+    if (!check_unsupported_option<connect_option>(opts, "connect", link, "link=on") || !check_unsupported_option<unix_listen_option>(opts, "listen-unix", link, "link=on") || !check_unsupported_option<seqpacket_listen_option>(opts, "listen-seqpacket", link, "link=on") || !check_unsupported_option<udp_option>(opts, "udp", link, "link=on") || !check_unsupported_option<shm_option>(opts, "shm", link, "link=on")) {
+        std::cerr << desc << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
+    // MSG_ZEROCOPY is only worth having on TCP connections
+    const auto zerocopy = &beast::OutputOptions::zerocopy;
+    if (!check_unsupported_option<unix_listen_option>(opts, "listen-unix", zerocopy, "zerocopy=on") || !check_unsupported_option<seqpacket_listen_option>(opts, "listen-seqpacket", zerocopy, "zerocopy=on") || !check_unsupported_option<udp_option>(opts, "udp", zerocopy, "zerocopy=on") || !check_unsupported_option<shm_option>(opts, "shm", zerocopy, "zerocopy=on")) {
+        std::cerr << desc << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
+    // backlog=on and conflate=on need a connection to each client
+    const auto backlog = &beast::OutputOptions::backlog;
+    const auto conflate = &beast::OutputOptions::conflate;
+    if (!check_unsupported_option<udp_option>(opts, "udp", backlog, "backlog=on") || !check_unsupported_option<shm_option>(opts, "shm", backlog, "backlog=on") || !check_unsupported_option<udp_option>(opts, "udp", conflate, "conflate=on") || !check_unsupported_option<shm_option>(opts, "shm", conflate, "conflate=on")) {
+        std::cerr << desc << std::endl;
+        return EXIT_NO_RESTART;
+    }
+
+    modes::Filter backlog_filter;
+    bool backlog_wanted = false;
+    combine_backlog_filter<listen_option>(opts, "listen", backlog_filter, backlog_wanted);
+    combine_backlog_filter<connect_option>(opts, "connect", backlog_filter, backlog_wanted);
+    combine_backlog_filter<unix_listen_option>(opts, "listen-unix", backlog_filter, backlog_wanted);
+    combine_backlog_filter<seqpacket_listen_option>(opts, "listen-seqpacket", backlog_filter, backlog_wanted);
+    if (opts["snapshot"].as<bool>()) {
+        auto table = beast::SnapshotTable::create(distributor, opts["snapshot-aircraft"].as<unsigned>(), std::chrono::seconds(opts["snapshot-age"].as<unsigned>()));
+        table->start();
+        beast::SnapshotTable::set_current(table);
+    }
+
+    if (backlog_wanted) {
+        auto b = beast::Backlog::create(distributor, backlog_filter, std::chrono::seconds(opts["backlog"].as<unsigned>()), opts["backlog-size"].as<unsigned>());
+        b->start();
+        beast::Backlog::set_current(b);
+    }
+
     if (opts.count("listen")) {
         for (auto l : opts["listen"].as<std::vector<listen_option>>()) {
+            // one replay ring for all the addresses of this listener, so
+            // a client can resume whichever one it reconnects to
+            if (l.options.link && l.options.backlog) {
+                std::cerr << "backlog=on can't be combined with link=on, link clients resume where they left off instead" << std::endl;
+                return EXIT_NO_RESTART;
+            }
+
+            if (l.options.link && l.options.conflate) {
+                std::cerr << "conflate=on can't be combined with link=on, which delivers every message" << std::endl;
+                return EXIT_NO_RESTART;
+            }
+
+            // a dropped message would never be replayed, as the next
+            // batch header moves the client past it
+            if (l.options.link && l.options.max_queue > 0 && l.options.overflow != beast::OutputOptions::OverflowPolicy::DISCONNECT) {
+                std::cerr << "queue= with link=on needs overflow=disconnect, so that a slow link client resumes rather than losing messages" << std::endl;
+                return EXIT_NO_RESTART;
+            }
+
+            beast::LinkReplay::pointer link;
+            if (l.options.link) {
+                link = beast::LinkReplay::create(distributor, l.settings, l.options.link_replay);
+                link->start();
+            }
+
             tcp::resolver::query query(l.host, l.port, tcp::resolver::query::passive);
             boost::system::error_code ec;
 
@@ -179,8 +410,18 @@ static int realmain(int argc, char **argv) {
                 const auto &endpoint = i->endpoint();
 
                 try {
-                    auto listener = beast::SocketListener::create(io_service, endpoint, distributor, l.settings);
-                    listener->start();
+                    if (link) {
+                        // few of these, so they stay on the input's io_service
+                        auto listener = beast::SocketListener::create(io_service, endpoint, distributor, l.settings, l.options);
+                        listener->set_link(link);
+                        listener->start();
+                    } else if (workers && opts["reuse-port"].as<bool>()) {
+                        workers->listen(endpoint, l.settings, l.options);
+                    } else {
+                        auto listener = beast::SocketListener::create(io_service, endpoint, distributor, l.settings, l.options);
+                        listener->set_workers(workers);
+                        listener->start();
+                    }
                     std::cerr << "Listening on " << endpoint << std::endl;
                     success = true;
                 } catch (boost::system::system_error &err) {
@@ -199,22 +440,138 @@ static int realmain(int argc, char **argv) {
         }
     }
 
+    std::vector<std::pair<path_option, bool>> unix_listens;
+    if (opts.count("listen-unix")) {
+        for (auto l : opts["listen-unix"].as<std::vector<unix_listen_option>>())
+            unix_listens.emplace_back(l, false);
+    }
+    if (opts.count("listen-seqpacket")) {
+        for (auto l : opts["listen-seqpacket"].as<std::vector<seqpacket_listen_option>>())
+            unix_listens.emplace_back(l, true);
+    }
+
+    for (auto u : unix_listens) {
+        const path_option &l = u.first;
+        try {
+            auto listener = beast::UnixSocketListener::create(io_service, l.path, u.second, distributor, l.settings, l.options);
+            listener->set_workers(workers);
+            listener->start();
+            std::cerr << "Listening on " << l.path << std::endl;
+        } catch (boost::system::system_error &err) {
+            std::cerr << "Could not listen on " << l.path << ": " << err.what() << std::endl;
+            return 1;
+        }
+    }
+
     if (opts.count("connect")) {
         for (auto l : opts["connect"].as<std::vector<connect_option>>()) {
-            auto connector = beast::SocketConnector::create(io_service, l.host, l.port, distributor, l.settings);
+            auto connector = beast::SocketConnector::create(io_service, l.host, l.port, distributor, l.settings, l.options);
+            connector->set_workers(workers);
             connector->start();
         }
     }
 
+    if (opts.count("udp")) {
+        boost::asio::ip::udp::resolver udp_resolver(io_service);
+        for (auto u : opts["udp"].as<std::vector<udp_option>>()) {
+            boost::asio::ip::udp::resolver::query query(u.host, u.port);
+            boost::system::error_code ec;
+            auto i = udp_resolver.resolve(query, ec);
+            if (ec || i == boost::asio::ip::udp::resolver::iterator()) {
+                std::cerr << "Could not resolve " << u.host << ":" << u.port << ": " << ec.message() << std::endl;
+                return 1;
+            }
+
+            try {
+                auto output = beast::UdpOutput::create(io_service, i->endpoint(), distributor, u.settings, u.options);
+                output->start();
+                std::cerr << "Sending UDP to " << i->endpoint() << " with settings " << u.settings << std::endl;
+            } catch (boost::system::system_error &err) {
+                std::cerr << "Could not send UDP to " << i->endpoint() << ": " << err.what() << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    std::vector<beast::ShmOutput::pointer> shm_outputs;
+    if (opts.count("shm")) {
+        for (auto l : opts["shm"].as<std::vector<shm_option>>()) {
+            try {
+                auto output = beast::ShmOutput::create(l.path, distributor, l.settings, l.options);
+                output->start();
+                shm_outputs.push_back(output);
+                std::cerr << "Writing shared-memory ring " << l.path << " with settings " << l.settings << std::endl;
+            } catch (boost::system::system_error &err) {
+                std::cerr << "Could not create shared-memory ring " << l.path << ": " << err.what() << std::endl;
+                return 1;
+            }
+        }
+    }
+
     if (opts.count("status-file")) {
         auto statuswriter = splitter::StatusWriter::create(io_service, distributor, input, opts["status-file"].as<std::string>());
         statuswriter->start();
     }
 
-    input->set_message_notifier(std::bind(&modes::FilterDistributor::broadcast, &distributor, std::placeholders::_1));
+    input->set_batch_notifier(std::bind(&modes::FilterDistributor::broadcast_batch, &distributor, std::placeholders::_1));
     input->start();
 
-    io_service.run();
+    unsigned threads = std::max(1U, opts["threads"].as<unsigned>());
+    if (threads > 1)
+        boost::asio::use_service<beast::FlushCoordinator>(io_service).set_parallel(true);
+
+#ifdef ALLOC_TRACE
+    // stop cleanly on a signal, so that we get to report the totals
+    boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
+    signals.async_wait([&io_service](const boost::system::error_code &ec, int) {
+        if (!ec)
+            io_service.stop();
+    });
+
+    boost::asio::steady_timer alloc_report_timer(io_service);
+    schedule_alloc_report(alloc_report_timer);
+    helpers::alloc_trace::reset();
+#endif
+
+    // the main thread is one of the pool; a handler that throws on any
+    // thread stops the whole service so that the pool is always joined
+    // before we leave here
+    std::atomic<bool> worker_failed(false);
+    auto run_service = [&io_service, &worker_failed] {
+        try {
+            io_service.run();
+        } catch (std::exception &e) {
+            std::cerr << "Uncaught exception: " << e.what() << std::endl;
+            worker_failed = true;
+            io_service.stop();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; ++i)
+        pool.emplace_back(run_service);
+
+    run_service();
+    io_service.stop();
+    for (auto &t : pool)
+        t.join();
+
+    for (auto &output : shm_outputs)
+        output->close();
+
+    if (workers) {
+        workers->stop();
+        if (workers->failed())
+            worker_failed = true;
+    }
+
+    if (worker_failed)
+        return 2;
+
+    helpers::alloc_trace::report(std::cerr, true);
+    if (!helpers::alloc_trace::within_ceiling(std::cerr))
+        return EXIT_ALLOC_CEILING;
+
     return 0;
 }
 
@@ -0,0 +1,96 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace helpers {
+    // A bounded, lock-free queue for handing items from exactly one
+    // producer thread to exactly one consumer thread. Neither side ever
+    // blocks: push() fails if the ring is full and pop() fails if it is
+    // empty.
+    template <class T> class SpscRing {
+      public:
+        // capacity is rounded up to a power of two
+        explicit SpscRing(std::size_t capacity) : slots(round_up(capacity)), mask(slots.size() - 1), head(0), tail(0) {}
+
+        SpscRing(const SpscRing &) = delete;
+        SpscRing &operator=(const SpscRing &) = delete;
+
+        // producer side
+        bool push(T &&item) {
+            std::size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == slots.size())
+                return false; // full
+
+            slots[t & mask] = std::move(item);
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        // consumer side
+        bool pop(T &item) {
+            std::size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire))
+                return false; // empty
+
+            item = std::move(slots[h & mask]);
+            slots[h & mask] = T();
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        std::size_t capacity() const { return slots.size(); }
+
+      private:
+        static std::size_t round_up(std::size_t n) {
+            std::size_t size = 1;
+            while (size < n)
+                size <<= 1;
+            return size;
+        }
+
+        std::vector<T> slots;
+        const std::size_t mask;
+
+        // read position, written only by the consumer, and write position,
+        // written only by the producer; padded onto separate cache lines so
+        // the two threads don't keep stealing the same line from each other
+        // (padding rather than alignas, as C++11 new ignores over-alignment)
+        static const std::size_t cache_line = 64;
+        char pad0[cache_line];
+        std::atomic<std::size_t> head;
+        char pad1[cache_line - sizeof(std::atomic<std::size_t>)];
+        std::atomic<std::size_t> tail;
+        char pad2[cache_line - sizeof(std::atomic<std::size_t>)];
+    };
+};
+
+#endif
@@ -30,6 +30,7 @@
 #include <iostream>
 #include <sstream>
 
+#include "beast_output.h"
 #include "modes_message.h"
 #include "status_writer.h"
 
@@ -57,7 +58,14 @@ namespace splitter {
         auto self(shared_from_this());
 
         timeout_timer.expires_from_now(timeout_interval); // will cancel previous async_wait
-        timeout_timer.async_wait(std::bind(&StatusWriter::status_timeout, self, std::placeholders::_1));
+
+        auto handler = std::bind(&StatusWriter::status_timeout, self, std::placeholders::_1);
+        if (input) {
+            // run alongside the input, as we look at its state
+            timeout_timer.async_wait(input->get_strand().wrap(handler));
+        } else {
+            timeout_timer.async_wait(handler);
+        }
     }
 
     void StatusWriter::status_timeout(const boost::system::error_code &ec) {
@@ -80,7 +88,7 @@ namespace splitter {
 
         reset_timeout();
 
-        const auto &data = message.data();
+        auto data = message.data();
 
         // 0: settings, including:
         //    10: 1=GPS timestamps, 0=12MHz timestamps
@@ -156,6 +164,18 @@ namespace splitter {
         write_status_file("red", status_buffer.str(), pps_offset);
     }
 
+    void StatusWriter::write_compression_stats(std::ostream &outf, const std::string &name, const beast::compression::Stats &stats) {
+        std::uint64_t raw = stats.raw_bytes.load();
+        if (raw == 0)
+            return; // nothing compressed in this direction
+
+        outf << "  \"" << name << "\" : {" << std::endl;
+        outf << "    \"raw_bytes\"        : " << raw << "," << std::endl;
+        outf << "    \"compressed_bytes\" : " << stats.compressed_bytes.load() << "," << std::endl;
+        outf << "    \"cpu_ms\"           : " << stats.cpu_ns.load() / 1000000 << std::endl;
+        outf << "  }," << std::endl;
+    }
+
     void StatusWriter::write_status_file(const std::string &gps_color, const std::string &gps_message, int pps_offset) {
         // This is simple enough we don't bother with a JSON library.
         // NB: we assume that the status messages do not need escaping.
@@ -187,6 +207,15 @@ namespace splitter {
             outf << "  }," << std::endl;
         }
 
+        outf << "  \"output\"   : {" << std::endl;
+        outf << "    \"encode_cache_hits\"   : " << beast::EncodeCache::total_hits() << "," << std::endl;
+        outf << "    \"encode_cache_misses\" : " << beast::EncodeCache::total_misses() << "," << std::endl;
+        outf << "    \"chunks_in_use\"       : " << helpers::ChunkPool::instance().in_use() << std::endl;
+        outf << "  }," << std::endl;
+
+        write_compression_stats(outf, "compressed_output", beast::compression::output_stats());
+        write_compression_stats(outf, "compressed_input", beast::compression::input_stats());
+
         outf << "  \"time\"     : " << std::chrono::duration_cast<std::chrono::milliseconds>(now - unix_epoch).count() << "," << std::endl;
         outf << "  \"expiry\"   : " << std::chrono::duration_cast<std::chrono::milliseconds>(expiry - unix_epoch).count() << "," << std::endl;
         outf << "  \"interval\" : " << std::chrono::duration_cast<std::chrono::milliseconds>(timeout_interval).count() << std::endl;
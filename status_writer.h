@@ -32,6 +32,7 @@
 #include <boost/asio/steady_timer.hpp>
 
 #include "beast_input.h"
+#include "compression.h"
 #include "modes_filter.h"
 #include "modes_message.h"
 
@@ -54,6 +55,7 @@ namespace splitter {
         void write(const modes::Message &message);
         void reset_timeout();
         void status_timeout(const boost::system::error_code &ec = boost::system::error_code());
+        void write_compression_stats(std::ostream &outf, const std::string &name, const beast::compression::Stats &stats);
         void write_status_file(const std::string &gps_color = std::string(), const std::string &gps_message = std::string(), int pps_offset = -9999);
 
         boost::asio::io_service &service;
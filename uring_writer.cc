@@ -0,0 +1,521 @@
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <boost/asio/error.hpp>
+
+#include "uring_writer.h"
+
+namespace asio = boost::asio;
+
+namespace beast {
+    static std::atomic<bool> uring_enabled(false);
+
+    boost::asio::io_service::id UringWriter::id;
+
+    void UringWriter::enable(bool on) { uring_enabled = on; }
+
+    bool UringWriter::enabled() { return uring_enabled; }
+
+    // one async_write; it has at most one request in the ring at a time
+    struct UringWriter::Write {
+        std::uint64_t id;
+        int fd;
+        bool whole;
+        bool polling; // waiting for the socket to become writable
+        bool cancelled;
+        std::vector<struct iovec> iov;
+        std::size_t next_iov; // first iovec with data left to send
+        std::size_t written;
+        struct msghdr msg;
+        Handler handler;
+    };
+
+    struct UringWriter::Completion {
+        Handler handler;
+        boost::system::error_code ec;
+        std::size_t written;
+    };
+
+#ifdef HAVE_IO_URING
+    bool UringWriter::supported() { return true; }
+
+    // The kernel side of the ring: the shared submission and completion
+    // queues, and the submission queue entries themselves.
+    struct UringWriter::Ring {
+        static const unsigned sq_size = 256;
+        static const unsigned cq_size = 16384; // room for a write per client
+
+        // most iovecs to give one sendmsg
+        static const std::size_t max_iov = 1024;
+
+        Ring() : fd(-1), map(nullptr), map_size(0), sqes(nullptr), sq_entries(0), unsubmitted(0) {}
+
+        ~Ring() {
+            if (sqes)
+                munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+            if (map)
+                munmap(map, map_size);
+            if (fd >= 0)
+                ::close(fd);
+        }
+
+        // returns an empty string on success, or why the ring can't be used
+        std::string setup() {
+            struct io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+            params.cq_entries = cq_size;
+
+            fd = (int)syscall(__NR_io_uring_setup, sq_size, &params);
+            if (fd < 0)
+                return std::strerror(errno);
+
+            if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+                return "kernel is too old";
+
+            std::vector<std::uint8_t> probe_buffer(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+            auto probe = reinterpret_cast<struct io_uring_probe *>(probe_buffer.data());
+            if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+                return std::strerror(errno);
+            for (int op : {IORING_OP_SENDMSG, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL}) {
+                if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                    return "kernel does not support the operations needed";
+            }
+
+            // with IORING_FEAT_SINGLE_MMAP, one mapping covers both queues
+            map_size = std::max<std::size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+            void *p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (p == MAP_FAILED)
+                return std::strerror(errno);
+            map = static_cast<std::uint8_t *>(p);
+
+            p = mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (p == MAP_FAILED)
+                return std::strerror(errno);
+            sqes = static_cast<struct io_uring_sqe *>(p);
+            sq_entries = params.sq_entries;
+
+            sq_head = reinterpret_cast<unsigned *>(map + params.sq_off.head);
+            sq_tail = reinterpret_cast<unsigned *>(map + params.sq_off.tail);
+            sq_mask = reinterpret_cast<unsigned *>(map + params.sq_off.ring_mask);
+            sq_flags = reinterpret_cast<unsigned *>(map + params.sq_off.flags);
+            sq_array = reinterpret_cast<unsigned *>(map + params.sq_off.array);
+            cq_head = reinterpret_cast<unsigned *>(map + params.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned *>(map + params.cq_off.tail);
+            cq_mask = reinterpret_cast<unsigned *>(map + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<struct io_uring_cqe *>(map + params.cq_off.cqes);
+            return std::string();
+        }
+
+        // a cleared entry to fill in and then push(), or nullptr if the
+        // submission queue is full and can't be submitted right now
+        struct io_uring_sqe *next_sqe() {
+            unsigned tail = *sq_tail;
+            if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                submit();
+                if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+                    return nullptr;
+            }
+
+            struct io_uring_sqe *sqe = &sqes[tail & *sq_mask];
+            std::memset(sqe, 0, sizeof(*sqe));
+            return sqe;
+        }
+
+        // turns any requests for user_data that have been pushed but not
+        // yet submitted into no-ops; returns true if there were any
+        bool make_nop(std::uint64_t user_data) {
+            bool found = false;
+            for (unsigned i = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE); i != *sq_tail; ++i) {
+                struct io_uring_sqe &sqe = sqes[sq_array[i & *sq_mask]];
+                if (sqe.user_data == user_data) {
+                    std::memset(&sqe, 0, sizeof(sqe));
+                    sqe.opcode = IORING_OP_NOP;
+                    sqe.user_data = user_data;
+                    found = true;
+                }
+            }
+            return found;
+        }
+
+        void push() {
+            unsigned tail = *sq_tail;
+            sq_array[tail & *sq_mask] = tail & *sq_mask;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            ++unsubmitted;
+        }
+
+        // hand everything pushed so far to the kernel
+        void submit() {
+            while (unsubmitted > 0) {
+                int n = enter(unsubmitted, 0);
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno != EAGAIN && errno != EBUSY)
+                        std::cerr << "io_uring_enter failed: " << std::strerror(errno) << std::endl;
+                    // otherwise the kernel is short of room for
+                    // completions; we try again after the next reap
+                    return;
+                }
+
+                unsubmitted -= n;
+            }
+        }
+
+        int enter(unsigned to_submit, unsigned flags) { return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, nullptr, 0); }
+
+        // true if the kernel is holding completions that did not fit
+        bool overflowed() const { return (__atomic_load_n(sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) != 0; }
+
+        int fd;
+        std::uint8_t *map;
+        std::size_t map_size;
+        struct io_uring_sqe *sqes;
+        unsigned sq_entries;
+        unsigned unsubmitted;
+
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+    };
+
+    UringWriter::UringWriter(asio::io_service &owner) : asio::io_service::service(owner), service(owner), completions(owner), completions_value(0), waiting(false), submit_pending(false), next_id(1) {
+        if (!enabled())
+            return;
+
+        std::unique_ptr<Ring> candidate(new Ring());
+        std::string error = candidate->setup();
+        if (error.empty()) {
+            // the kernel signals this as completions arrive, which is
+            // what gets us back into reap() from the io_service
+            int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (efd < 0) {
+                error = std::strerror(errno);
+            } else {
+                completions.assign(efd);
+                if (syscall(__NR_io_uring_register, candidate->fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0)
+                    error = std::strerror(errno);
+            }
+        }
+
+        if (!error.empty()) {
+            static std::atomic<bool> warned(false);
+            if (!warned.exchange(true))
+                std::cerr << "io_uring is not available (" << error << "), writing to clients with epoll instead" << std::endl;
+            return;
+        }
+
+        ring = std::move(candidate);
+    }
+
+    UringWriter::~UringWriter() {}
+
+    void UringWriter::shutdown_service() {
+        // handlers of unfinished writes are destroyed without being
+        // called, as asio does for its own operations
+        std::unordered_map<std::uint64_t, std::unique_ptr<Write>> abandoned;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            boost::system::error_code ignored;
+            completions.close(ignored);
+            ring.reset(); // the kernel cancels anything still in flight
+            abandoned.swap(writes);
+            pending_cancels.clear();
+        }
+    }
+
+    std::uint64_t UringWriter::async_write(int fd, const std::vector<asio::const_buffer> &buffers, bool whole, Handler handler) {
+        std::unique_ptr<Write> write(new Write());
+        write->fd = fd;
+        write->whole = whole;
+        write->polling = false;
+        write->cancelled = false;
+        write->next_iov = 0;
+        write->written = 0;
+        write->handler = std::move(handler);
+        for (const auto &buffer : buffers)
+            write->iov.push_back({const_cast<void *>(buffer.data()), buffer.size()});
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::uint64_t write_id = next_id++;
+        write->id = write_id;
+        Write &w = *write;
+        writes.emplace(write_id, std::move(write));
+
+        if (!start_send(w)) {
+            // never call the handler from in here
+            service.post(std::bind(std::move(w.handler), asio::error::no_buffer_space, 0));
+            writes.erase(write_id);
+            return write_id;
+        }
+
+        schedule_submit();
+        wait_for_completions();
+        return write_id;
+    }
+
+    void UringWriter::cancel(std::uint64_t write_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!ring)
+            return;
+
+        auto i = writes.find(write_id);
+        if (i == writes.end() || i->second->cancelled)
+            return;
+
+        // once this is set the write is never resubmitted, so its fd can
+        // be closed and reused
+        i->second->cancelled = true;
+
+        // If its request has not gone to the kernel yet, it never will;
+        // that way it can't reach whatever the fd is reused for. Otherwise
+        // the kernel holds the request (and its own reference to the
+        // socket) until it is cancelled, which for a stalled peer is
+        // forever, so a cancel must get through even if the submission
+        // queue is full right now.
+        if (!ring->make_nop(write_id) && !start_cancel(write_id))
+            pending_cancels.push_back(write_id);
+
+        ring->submit();
+    }
+
+    bool UringWriter::start_cancel(std::uint64_t write_id) {
+        if (writes.find(write_id) == writes.end())
+            return true; // finished while the cancel was waiting
+
+        struct io_uring_sqe *sqe = ring->next_sqe();
+        if (!sqe)
+            return false;
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = write_id;
+        sqe->user_data = 0; // nobody is interested in how that went
+        ring->push();
+        return true;
+    }
+
+    bool UringWriter::start_send(Write &write) {
+        struct io_uring_sqe *sqe = ring->next_sqe();
+        if (!sqe)
+            return false;
+
+        std::memset(&write.msg, 0, sizeof(write.msg));
+        write.msg.msg_iov = write.iov.data() + write.next_iov;
+        write.msg.msg_iovlen = std::min(write.iov.size() - write.next_iov, Ring::max_iov);
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = write.fd;
+        sqe->addr = (std::uint64_t)(std::uintptr_t)&write.msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = write.id;
+        ring->push();
+        return true;
+    }
+
+    bool UringWriter::start_poll(Write &write) {
+        // asio puts sockets in non-blocking mode, so a full socket
+        // buffer fails the send with EAGAIN rather than waiting in the
+        // kernel; wait for it to drain, then send again
+        struct io_uring_sqe *sqe = ring->next_sqe();
+        if (!sqe)
+            return false;
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = write.fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = write.id;
+        ring->push();
+        return true;
+    }
+
+    void UringWriter::schedule_submit() {
+        // everything started during this pass goes to the kernel together
+        if (submit_pending)
+            return;
+
+        submit_pending = true;
+        service.post([this] {
+            std::lock_guard<std::mutex> lock(mutex);
+            submit_pending = false;
+            if (ring)
+                ring->submit();
+        });
+    }
+
+    void UringWriter::wait_for_completions() {
+        if (waiting || writes.empty())
+            return;
+
+        // only wait while there are writes in flight, so that we don't
+        // keep the io_service running by ourselves
+        waiting = true;
+        completions.async_read_some(asio::buffer(&completions_value, sizeof(completions_value)), [this](const boost::system::error_code &ec, std::size_t len) {
+            if (ec != asio::error::operation_aborted)
+                reap();
+        });
+    }
+
+    void UringWriter::reap() {
+        std::vector<Completion> done;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            waiting = false;
+            if (!ring)
+                return;
+
+            for (;;) {
+                unsigned head = *ring->cq_head;
+                unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+                if (head == tail) {
+                    // completions that did not fit in the queue are held
+                    // by the kernel until we ask for them
+                    if (!ring->overflowed() || ring->enter(0, IORING_ENTER_GETEVENTS) < 0 || __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) == head)
+                        break;
+                    continue;
+                }
+
+                for (; head != tail; ++head) {
+                    const struct io_uring_cqe &cqe = ring->cqes[head & *ring->cq_mask];
+                    if (cqe.user_data != 0)
+                        complete(cqe.user_data, cqe.res, done);
+                }
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            }
+
+            // with the completion queue drained, there should be room
+            // for any cancels that were held up
+            while (!pending_cancels.empty() && start_cancel(pending_cancels.back()))
+                pending_cancels.pop_back();
+
+            ring->submit();
+            wait_for_completions();
+        }
+
+        for (auto &completion : done)
+            completion.handler(completion.ec, completion.written);
+    }
+
+    void UringWriter::complete(std::uint64_t write_id, int result, std::vector<Completion> &done) {
+        auto i = writes.find(write_id);
+        if (i == writes.end())
+            return;
+
+        Write &write = *i->second;
+        boost::system::error_code ec;
+        if (write.cancelled) {
+            ec = asio::error::operation_aborted;
+        } else if (write.polling) {
+            write.polling = false;
+            if (result < 0)
+                ec = boost::system::error_code(-result, boost::system::system_category());
+            else if (start_send(write))
+                return;
+            else
+                ec = asio::error::no_buffer_space;
+        } else if (result == -EAGAIN) {
+            write.polling = true;
+            if (start_poll(write))
+                return;
+            ec = asio::error::no_buffer_space;
+        } else if (result == -EINTR) {
+            if (start_send(write))
+                return;
+            ec = asio::error::no_buffer_space;
+        } else if (result < 0) {
+            ec = boost::system::error_code(-result, boost::system::system_category());
+        } else {
+            // step over what was sent
+            write.written += result;
+            std::size_t left = result;
+            while (left > 0 && write.next_iov < write.iov.size()) {
+                struct iovec &v = write.iov[write.next_iov];
+                if (left >= v.iov_len) {
+                    left -= v.iov_len;
+                    ++write.next_iov;
+                } else {
+                    v.iov_base = static_cast<std::uint8_t *>(v.iov_base) + left;
+                    v.iov_len -= left;
+                    left = 0;
+                }
+            }
+
+            if (write.whole && write.next_iov < write.iov.size()) {
+                if (result == 0)
+                    ec = asio::error::eof;
+                else if (start_send(write))
+                    return;
+                else
+                    ec = asio::error::no_buffer_space;
+            }
+        }
+
+        finish(write_id, ec, done);
+    }
+
+    void UringWriter::finish(std::uint64_t write_id, const boost::system::error_code &ec, std::vector<Completion> &done) {
+        auto i = writes.find(write_id);
+        done.push_back({std::move(i->second->handler), ec, i->second->written});
+        writes.erase(i);
+    }
+#else
+    // Without IO_URING=1, available() is always false and nothing else
+    // here is used.
+    bool UringWriter::supported() { return false; }
+
+    struct UringWriter::Ring {};
+
+    UringWriter::UringWriter(asio::io_service &owner) : asio::io_service::service(owner), service(owner), completions(owner), completions_value(0), waiting(false), submit_pending(false), next_id(1) {}
+
+    UringWriter::~UringWriter() {}
+
+    void UringWriter::shutdown_service() {}
+
+    std::uint64_t UringWriter::async_write(int fd, const std::vector<asio::const_buffer> &buffers, bool whole, Handler handler) {
+        service.post(std::bind(std::move(handler), asio::error::operation_not_supported, 0));
+        return 0;
+    }
+
+    void UringWriter::cancel(std::uint64_t write_id) {}
+#endif
+}; // namespace beast
@@ -0,0 +1,117 @@
+// -*- c++ -*-
+
+// Copyright (c) 2015-2016, FlightAware LLC.
+// All rights reserved.
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef URING_WRITER_H
+#define URING_WRITER_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+namespace beast {
+    // Writes to sockets using io_uring instead of a write() per socket
+    // from the reactor. Writes started during one pass of the io_service
+    // are queued and handed to the kernel in a single io_uring_enter()
+    // at the end of the pass, so a flush across thousands of clients
+    // costs one system call rather than one per client. There is one of
+    // these per io_service.
+    //
+    // This needs a build with IO_URING=1, --io-uring, and a kernel that
+    // supports it (5.5 or later). Otherwise available() is false and
+    // outputs write through asio as usual.
+    class UringWriter : public boost::asio::io_service::service {
+      public:
+        static boost::asio::io_service::id id;
+
+        typedef std::function<void(const boost::system::error_code &, std::size_t)> Handler;
+
+        explicit UringWriter(boost::asio::io_service &owner);
+        ~UringWriter();
+
+        // true if this build can use io_uring at all
+        static bool supported();
+
+        // use io_uring for io_services that are created after this
+        static void enable(bool on);
+        static bool enabled();
+
+        // true if writes should go through this writer
+        bool available() const { return ring != nullptr; }
+
+        // Sends buffers on fd, then calls handler. With whole set this
+        // carries on until everything is written, as async_write does;
+        // otherwise it is a single send, for packet sockets. The
+        // buffers must stay valid until the handler is called. Returns
+        // an id that can be given to cancel().
+        std::uint64_t async_write(int fd, const std::vector<boost::asio::const_buffer> &buffers, bool whole, Handler handler);
+
+        // abandon a write, which must be done before closing its socket;
+        // the handler is called with operation_aborted
+        void cancel(std::uint64_t write_id);
+
+      private:
+        struct Ring;
+        struct Write;
+        struct Completion;
+
+        void shutdown_service() override;
+
+        // these are called with the mutex held
+        bool start_send(Write &write);
+        bool start_poll(Write &write);
+        bool start_cancel(std::uint64_t write_id);
+        void complete(std::uint64_t write_id, int result, std::vector<Completion> &done);
+        void finish(std::uint64_t write_id, const boost::system::error_code &ec, std::vector<Completion> &done);
+        void schedule_submit();
+        void wait_for_completions();
+
+        void submit();
+        void reap();
+
+        boost::asio::io_service &service;
+        std::mutex mutex;
+        std::unique_ptr<Ring> ring;
+        boost::asio::posix::stream_descriptor completions;
+        std::uint64_t completions_value;
+        bool waiting;
+        bool submit_pending;
+
+        std::uint64_t next_id;
+        std::unordered_map<std::uint64_t, std::unique_ptr<Write>> writes;
+
+        // cancels that found the submission queue full, for reap() to
+        // retry once the kernel has made room
+        std::vector<std::uint64_t> pending_cancels;
+    };
+};
+
+#endif